@@ -0,0 +1,213 @@
+/* Command registry
+ * Serial commands are registered with their dispatch key ("mode", "req"...), code, expected fields and handler.
+ * Dispatch goes through a hash table of keys and a jump table of codes so its cost does not depend on the number of commands.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "command_registry.hpp"
+#include "logger.hpp"
+#include <cstdio>
+#include <cstring>
+
+using namespace Command;
+
+// Name of JSON types in error messages, indexed by JSONValueType.
+static const char* const FIELD_TYPE_NAME[] = {"object", "array", "string", "boolean", "int", "float", "null"};
+
+static const Response::ResponseTemplate ERROR_FIELD("\"err\":\"$r\"");
+
+RequestValue::RequestValue() {};
+RequestValue::RequestValue(JSONParser::JSONValue *value): value(value) {};
+RequestValue::RequestValue(JSONTape::Value value): tape_value(value) {};
+
+const char* RequestValue::getTapeKey(JSONTape::Value key, char *buffer, size_t capacity, size_t *length) {
+    const char *raw = key.getRaw(length);
+    if (raw == NULL || !key.hasEscape()) return raw;
+    return key.copyString(buffer, capacity, length) ? buffer : NULL;
+}
+
+bool RequestValue::exists() const {
+    return this->value != NULL || this->tape_value.exists();
+}
+
+JSONParser::JSONValueType RequestValue::getType() const {
+    if (this->value != NULL) return this->value->getType();
+    return this->tape_value.getType();
+}
+
+bool RequestValue::isBoolean() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Boolean; }
+bool RequestValue::isInt() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Integer; }
+bool RequestValue::isFloat() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Float; }
+bool RequestValue::isString() const { return this->exists() && this->getType() == JSONParser::JSONValueType::String; }
+bool RequestValue::isMap() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Object; }
+bool RequestValue::isArray() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Array; }
+
+bool RequestValue::getBoolean() const {
+    if (!this->isBoolean()) return false;
+    return (this->value != NULL) ? this->value->getBoolean() : this->tape_value.getBoolean();
+}
+
+int RequestValue::getInt() const {
+    if (!this->isInt()) return 0;
+    return (this->value != NULL) ? this->value->getInt() : this->tape_value.getInt();
+}
+
+float RequestValue::getFloat() const {
+    if (!this->isFloat()) return 0.0f;
+    return (this->value != NULL) ? this->value->getFloat() : this->tape_value.getFloat();
+}
+
+size_t RequestValue::size() const {
+    if (this->value == NULL) return this->tape_value.size();
+    if (this->value->isMap()) return this->value->getMap()->size();
+    if (this->value->isArray()) return this->value->getArray()->size();
+    return 0;
+}
+
+RequestValue RequestValue::at(size_t i) const {
+    if (this->value == NULL) return RequestValue(this->tape_value.at(i));
+    if (!this->isArray() || i >= this->size()) return RequestValue();
+    return RequestValue(&(*this->value->getArray())[i]);
+}
+
+RequestValue RequestValue::get(const char *key) const {
+    if (this->value == NULL) return RequestValue(this->tape_value.find(key));
+    if (!this->isMap()) return RequestValue();
+    JSONMap::iterator member = this->value->getMap()->find(key);
+    if (member == this->value->getMap()->end()) return RequestValue();
+    return RequestValue(&member->second);
+}
+
+void RequestValue::query(const JSONQuery::Query& query, RequestValue *values) const {
+    if (this->value != NULL) {
+        JSONParser::JSONValue *found[JSON_QUERY_MAX_PATHS];
+        query.resolve(this->value, found);
+        for (size_t i = 0; i < query.getPathCount(); i++) values[i] = (found[i] != NULL) ? RequestValue(found[i]) : RequestValue();
+    } else {
+        JSONTape::Value found[JSON_QUERY_MAX_PATHS];
+        query.resolve(this->tape_value, found);
+        for (size_t i = 0; i < query.getPathCount(); i++) values[i] = RequestValue(found[i]);
+    }
+}
+
+bool Command::addFields(CommandContext *context, const Response::ResponseTemplate& fields, std::initializer_list<Response::TemplateValue> values) {
+    if (context->fields == NULL) return false;
+
+    // Fields are separated by a comma.
+    size_t separator = (context->fields_length > 0) ? 1 : 0;
+    if (context->fields_length + separator >= context->fields_capacity) return false;
+    size_t written = fields.render(context->fields + context->fields_length + separator, context->fields_capacity - context->fields_length - separator, values);
+    if (written == 0) return false;
+
+    if (separator) context->fields[context->fields_length] = ',';
+    context->fields_length += separator + written;
+    return true;
+}
+
+void Command::setError(CommandContext *context, const char *message, bool isLogged) {
+    if (isLogged)
+        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "%s", message);
+    if (context->hasError) return;
+    context->hasError = true;
+
+    // Errors are hot responses, use the map only if the template does not fit.
+    if (Command::addFields(context, ERROR_FIELD, {message})) return;
+#if !NO_HEAP
+    context->response->insert(std::pair<std::string, JSONParser::JSONValue>("err", JSONParser::JSONValue(new std::string(message))));
+#endif
+}
+
+uint32_t CommandRegistry::hashKey(const char* key, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+KeyEntry* CommandRegistry::findKey(const char* key, size_t length) {
+    uint32_t hash = CommandRegistry::hashKey(key, length);
+    // Linear probing, the table is never full so an empty slot ends the search.
+    for (size_t probe = 0; probe < COMMAND_KEY_TABLE_SIZE; probe++) {
+        uint8_t slot = this->key_table[(hash + probe) % COMMAND_KEY_TABLE_SIZE];
+        if (slot == 0) return NULL;
+
+        KeyEntry* entry = &this->keys[slot - 1];
+        if (entry->hash == hash && std::strlen(entry->key) == length && std::memcmp(entry->key, key, length) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+bool CommandRegistry::registerKey(const char* key, const char* unknown_message) {
+    if (this->key_count >= COMMAND_MAX_KEYS) return false;
+    if (this->findKey(key, std::strlen(key)) != NULL) return true;
+
+    KeyEntry* entry = &this->keys[this->key_count];
+    entry->key = key;
+    entry->hash = CommandRegistry::hashKey(key, std::strlen(key));
+    entry->unknown_message = unknown_message;
+    this->key_count++;
+
+    size_t slot = entry->hash % COMMAND_KEY_TABLE_SIZE;
+    while (this->key_table[slot] != 0) slot = (slot + 1) % COMMAND_KEY_TABLE_SIZE;
+    this->key_table[slot] = this->key_count;
+    return true;
+}
+
+bool CommandRegistry::registerCommand(const char* key, int code, const char* name, std::initializer_list<FieldSpec> fields, CommandHandler handler) {
+    KeyEntry* entry = this->findKey(key, std::strlen(key));
+    if (entry == NULL || code < 0 || code >= COMMAND_MAX_CODES || fields.size() > COMMAND_MAX_FIELDS) {
+        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Couldn't register command %s!", name);
+        return false;
+    }
+
+    CommandEntry* command = &entry->commands[code];
+    command->name = name;
+    command->handler = handler;
+    command->field_count = 0;
+    for (const FieldSpec& field: fields) {
+        command->fields[command->field_count++] = field;
+    }
+    return true;
+}
+
+void CommandRegistry::dispatch(CommandContext *context) {
+    RequestValue request = context->request;
+    this->dispatch_mutex.lock();
+    // Requests only have a few root keys, each one is a single hash lookup.
+    request.forEachMember([this, context, &request](const char *key, size_t key_length, RequestValue value) {
+        KeyEntry* entry = this->findKey(key, key_length);
+        if (entry == NULL || !value.isInt()) return;
+
+        int code = value.getInt();
+        if (code < 0 || code >= COMMAND_MAX_CODES || entry->commands[code].handler == NULL) {
+            // Insert err message in response object
+            Command::setError(context, entry->unknown_message, false);
+            return;
+        }
+
+        CommandEntry* command = &entry->commands[code];
+        context->command = command->name;
+        for (size_t i = 0; i < command->field_count; i++) {
+            RequestValue field = request.get(command->fields[i].name);
+            if (!field.exists() || field.getType() != command->fields[i].type) {
+                char message[96];
+                std::snprintf(message, sizeof(message), "%s expect %s \\\"%s\\\" to be defined.", command->name, FIELD_TYPE_NAME[command->fields[i].type], command->fields[i].name);
+                Command::setError(context, message);
+                return;
+            }
+        }
+        if (!context->isDryRun) command->handler(context);
+    });
+    this->dispatch_mutex.unlock();
+}
+
+void CommandRegistry::lock() {
+    this->dispatch_mutex.lock();
+}
+
+void CommandRegistry::unlock() {
+    this->dispatch_mutex.unlock();
+}
@@ -0,0 +1,259 @@
+/* Command registry
+ * Serial commands are registered with their dispatch key ("mode", "req"...), code, expected fields and handler.
+ * Dispatch goes through a hash table of keys and a jump table of codes so its cost does not depend on the number of commands.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include "mbed.h"
+#include "json_parser.hpp"
+#include "json_tape.hpp"
+#include "json_query.hpp"
+#include "response_template.hpp"
+#include "heap_guard.hpp"
+#include "logger.hpp"
+
+// Maximum number of dispatch keys.
+#define COMMAND_MAX_KEYS 4
+// Size of the keys hash table, power of two larger than COMMAND_MAX_KEYS.
+#define COMMAND_KEY_TABLE_SIZE 8
+// Codes of a key are in [0, COMMAND_MAX_CODES).
+#define COMMAND_MAX_CODES 16
+// Maximum number of required fields of a command.
+#define COMMAND_MAX_FIELDS 4
+// Longest request key with escape sequences that can be dispatched, keys without escape sequences have no limit.
+#define COMMAND_MAX_KEY_LENGTH 32
+
+namespace Command {
+    typedef std::map<std::string, JSONParser::JSONValue> JSONMap;
+
+    /** Condition of a deferred response.
+    *
+    * @param context value given by the handler.
+    * @return true once the response can be sent.
+    */
+    typedef bool (*ReadyCheck)(void *context);
+
+    // Encoding of requests and responses on the serial.
+    enum WireFormat {
+        JSON = 0,
+        MSGPACK = 1,
+    };
+
+    // Output of the channel a request came from, the status pushes of its subscription are written to it.
+    class ResponseChannel {
+    public:
+        virtual ~ResponseChannel() {}
+
+        /** Write a message that is not a response to the channel, from any thread.
+        *
+        * @param type RELEASE for JSON text, BINARY for MessagePack.
+        * @param data encoded message.
+        * @param length message length.
+        */
+        virtual void writePush(Log::LogFrameType type, const char *data, size_t length) = 0;
+    };
+
+    // Read-only view of a request value, backed by a deserialized JSONValue or by an entry of a tape document (no-heap build).
+    class RequestValue {
+        JSONParser::JSONValue *value = NULL;
+        JSONTape::Value tape_value;
+
+        /** Unescaped key of a tape object member.
+        *
+        * @param key key entry.
+        * @param buffer storage of the key if it has escape sequences.
+        * @param capacity size of the buffer.
+        * @param length key length.
+        * @return key characters, NULL if it does not fit the buffer.
+        */
+        static const char* getTapeKey(JSONTape::Value key, char *buffer, size_t capacity, size_t *length);
+    public:
+        // View of nothing, exists() returns false.
+        RequestValue();
+        explicit RequestValue(JSONParser::JSONValue *value);
+        explicit RequestValue(JSONTape::Value value);
+
+        bool exists() const;
+
+        // Type of the value, Null if it does not exist.
+        JSONParser::JSONValueType getType() const;
+        bool isBoolean() const;
+        bool isInt() const;
+        bool isFloat() const;
+        bool isString() const;
+        bool isMap() const;
+        bool isArray() const;
+
+        // Values are returned without warning, 0, 0.0f or false when the type does not match.
+        bool getBoolean() const;
+        int getInt() const;
+        float getFloat() const;
+
+        // Number of elements of an array or members of an object, 0 for other types.
+        size_t size() const;
+
+        // Element of an array, does not exist if out of range.
+        RequestValue at(size_t i) const;
+
+        // Value of an object member, does not exist if the key is missing.
+        RequestValue get(const char *key) const;
+
+        /** Resolve the paths of a query from this value, in one walk when it is backed by a tape.
+        *
+        * @param query compiled paths.
+        * @param values one value per path of the query, does not exist if the path is not found.
+        */
+        void query(const JSONQuery::Query& query, RequestValue *values) const;
+
+        /** Call visit(key, key_length, value) for each member of an object, key is not null terminated.
+        *
+        * @param visit callable taking (const char*, size_t, RequestValue).
+        */
+        template<typename Visitor>
+        void forEachMember(Visitor visit) const;
+    };
+
+    // Request and response of a command being dispatched.
+    struct CommandContext {
+        // Root object of the request.
+        RequestValue request;
+#if !NO_HEAP
+        // Root object of the response, for fields without template. Handlers insert their result here or with addFields.
+        JSONMap *response;
+#endif
+        // Response fields already rendered from templates, without enclosing braces.
+        char *fields = NULL;
+        size_t fields_capacity = 0;
+        size_t fields_length = 0;
+        // Only the first error of a request is reported.
+        bool hasError = false;
+        // Set by handlers of slow operations to send the response only once ready returns true, other commands keep being processed meanwhile.
+        ReadyCheck ready = NULL;
+        void *ready_context = NULL;
+        // Encoding of the request, its response is sent with the same one. Set by handlers to switch the encoding of the next requests.
+        WireFormat format = WireFormat::JSON;
+        // Only check the request: unknown codes and missing fields are reported but handlers are not called.
+        bool isDryRun = false;
+        // Name of the last command found by dispatch, NULL if none.
+        const char *command = NULL;
+        // Channel the request came from, NULL outside of a pipeline.
+        ResponseChannel *channel = NULL;
+        // Working memory of the channel for handlers, kept out of the stage stack and never shared with other channels. Aligned for floats.
+        char *scratch = NULL;
+        size_t scratch_capacity = 0;
+    };
+
+    /** Handler of a command. Required fields are already checked when it is called.
+    *
+    * @param context request and response of the command.
+    */
+    typedef void (*CommandHandler)(CommandContext *context);
+
+    // Required field of a command.
+    struct FieldSpec {
+        const char* name;
+        JSONParser::JSONValueType type;
+    };
+
+    // Registered command, not meant to be used externally.
+    struct CommandEntry {
+        const char* name = NULL;
+        CommandHandler handler = NULL;
+        FieldSpec fields[COMMAND_MAX_FIELDS];
+        size_t field_count = 0;
+    };
+
+    // Registered dispatch key and the jump table of its codes, not meant to be used externally.
+    struct KeyEntry {
+        const char* key = NULL;
+        uint32_t hash = 0;
+        const char* unknown_message = NULL;
+        CommandEntry commands[COMMAND_MAX_CODES];
+    };
+
+    /** Render template fields at the end of the response fields.
+    *
+    * @param context command context.
+    * @param fields template of one or more "key":value pairs.
+    * @param values slot values of the template.
+    * @return false if the fields do not fit, nothing is written then.
+    */
+    bool addFields(CommandContext *context, const Response::ResponseTemplate& fields, std::initializer_list<Response::TemplateValue> values);
+
+    /** Add an "err" field to the response and log it. An existing "err" field is kept.
+    *
+    * @param context command context.
+    * @param message error message, a trailing '.' is expected.
+    * @param isLogged false to not log the error.
+    */
+    void setError(CommandContext *context, const char *message, bool isLogged = true);
+
+    class CommandRegistry {
+        KeyEntry keys[COMMAND_MAX_KEYS];
+        size_t key_count = 0;
+        // Index + 1 in keys of each hash slot, 0 if the slot is empty.
+        uint8_t key_table[COMMAND_KEY_TABLE_SIZE] = {0};
+        // Held during dispatch, channels sharing the registry run their handlers one at a time.
+        Mutex dispatch_mutex;
+
+        // FNV-1a hash of a key.
+        static uint32_t hashKey(const char* key, size_t length);
+        // Find a registered key, NULL if unknown.
+        KeyEntry* findKey(const char* key, size_t length);
+    public:
+        /** Register a dispatch key. When a request contains several keys, they are dispatched in the order of its members (see dispatch).
+        *
+        * @param key root key of the requests, its value must be an int code.
+        * @param unknown_message error returned when the code has no command.
+        * @return false if COMMAND_MAX_KEYS keys are already registered.
+        */
+        bool registerKey(const char* key, const char* unknown_message);
+
+        /** Register a command.
+        *
+        * @param key dispatch key, must be registered.
+        * @param code value of the key selecting this command, in [0, COMMAND_MAX_CODES).
+        * @param name name used in error messages, for example "Mode 0".
+        * @param fields required fields, checked in order before calling the handler.
+        * @param handler command handler.
+        * @return false if the key is unknown, the code out of range or there are too many fields.
+        */
+        bool registerCommand(const char* key, int code, const char* name, std::initializer_list<FieldSpec> fields, CommandHandler handler);
+
+        /** Call the handlers of every registered key found in the request, in the order of its members: byte order of the keys for a
+        * deserialized JSONValue (std::map), order of the message for a tape document (no-heap build). Handlers of every channel are
+        * serialized, they can change the device state without locking.
+        *
+        * @param context request and response, ready is set if a handler deferred the response.
+        */
+        void dispatch(CommandContext *context);
+
+        // Hold off dispatch, for code reading the state changed by the handlers from another thread.
+        void lock();
+        void unlock();
+    };
+
+    template<typename Visitor>
+    void RequestValue::forEachMember(Visitor visit) const {
+        if (!this->isMap()) return;
+        if (this->value != NULL) {
+            for (std::pair<const std::string, JSONParser::JSONValue>& kv: *this->value->getMap())
+                visit(kv.first.data(), kv.first.size(), RequestValue(&kv.second));
+            return;
+        }
+        char buffer[COMMAND_MAX_KEY_LENGTH];
+        JSONTape::Value key = this->tape_value.first();
+        for (size_t i = 0; i < this->tape_value.size(); i++) {
+            JSONTape::Value member = key.next();
+            size_t key_length = 0;
+            const char *key_chars = RequestValue::getTapeKey(key, buffer, sizeof(buffer), &key_length);
+            if (key_chars != NULL) visit(key_chars, key_length, RequestValue(member));
+            key = member.next();
+        }
+    }
+}
\ No newline at end of file
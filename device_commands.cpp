@@ -0,0 +1,564 @@
+/* Device commands
+ * Handlers of the serial commands of the board (LED modes and requests), registered in a CommandRegistry.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "device_commands.hpp"
+#include <stdint.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "msgpack.hpp"
+#include "metrics.hpp"
+#include "memory_stats.hpp"
+#include "thread_stats.hpp"
+#include <vector>
+
+using namespace DeviceCommands;
+using Command::RequestValue;
+
+namespace {
+    // Handlers run under the dispatch lock of the registry, other threads take it to read the state.
+    Command::CommandRegistry *device_registry = NULL;
+    Led::LedController *led_controller = NULL;
+    Log::RamLogSink *crash_log = NULL;
+    State current_state;
+
+    const Response::ResponseTemplate STATUS_FIELDS("\"status\":{\"led\":$f,\"mode\":$i}");
+    const Response::ResponseTemplate STATUS_PUSH_FULL("{\"status\":{\"led\":$f,\"mode\":$i}}");
+    const Response::ResponseTemplate STATUS_PUSH_MODE("{\"status\":{\"mode\":$i}}");
+    const Response::ResponseTemplate STATUS_PUSH_LED("{\"status\":{\"led\":$f}}");
+    const Response::ResponseTemplate PROTOCOL_FIELD("\"proto\":$i");
+    const Response::ResponseTemplate STATS_FIELD("\"stats\":{$r}");
+    const Response::ResponseTemplate STATS_TIME("\"t\":$i");
+    const Response::ResponseTemplate STATS_PROBE(",\"$s\":{\"n\":$i,\"avg\":$i,\"p50\":$i,\"p99\":$i,\"max\":$i");
+    const Response::ResponseTemplate STATS_COUNTER(",\"$s\":$i");
+    const Response::ResponseTemplate MEMORY_FIELD("\"mem\":{$r}");
+    const Response::ResponseTemplate MEMORY_MESSAGES("\"n\":$i,\"allocs\":$i,\"frees\":$i,\"bytes\":$i,\"max_allocs\":$i,\"max_bytes\":$i");
+    const Response::ResponseTemplate MEMORY_HEAP(",\"heap\":$i,\"heap_max\":$i,\"stack\":{");
+    const Response::ResponseTemplate MEMORY_STACK("$r\"$s\":[$i,$i]");
+    const Response::ResponseTemplate THREADS_FIELD("\"threads\":{$r}");
+    const Response::ResponseTemplate THREADS_CPU("\"t\":$i,\"idle\":$i");
+    const Response::ResponseTemplate THREADS_THREAD(",\"$s\":[$i,$i,$i,$i,$i,$i]");
+
+    // Optional fields of the modes reading several of them, resolved in one walk of the request.
+    const JSONQuery::Query FADE_FIELDS({"/from", "/to", "/t", "/wait"});
+    const JSONQuery::Query SEQUENCE_FIELDS({"/seq", "/dt", "/loop", "/wait"});
+
+    // Status subscription of a channel, changes are coalesced and pushed at most once per period.
+    struct Subscription {
+        // Subscribed channel, NULL if the slot is free.
+        Command::ResponseChannel *channel = NULL;
+        std::chrono::milliseconds period{STATUS_PUSH_PERIOD_MS};
+        Kernel::Clock::time_point last_push;
+        // Last pushed values, only changed fields are sent.
+        bool hasPushed = false;
+        int mode = 0;
+        float led = 0.0f;
+        // Pushes use the encoding of the requests of the channel.
+        Command::WireFormat format = Command::WireFormat::JSON;
+    };
+    Subscription subscriptions[STATUS_MAX_SUBSCRIPTIONS];
+    Mutex subscription_mutex;
+
+    /** Subscription of a channel. Must be called with subscription_mutex locked.
+    *
+    * @param channel subscribed channel.
+    * @param isCreated take a free slot if the channel has no subscription.
+    * @return NULL if the channel has none and it is not created, or if every slot is used.
+    */
+    Subscription* findSubscription(Command::ResponseChannel *channel, bool isCreated) {
+        Subscription *free_slot = NULL;
+        for (size_t i = 0; i < STATUS_MAX_SUBSCRIPTIONS; i++) {
+            if (subscriptions[i].channel == channel) return &subscriptions[i];
+            if (subscriptions[i].channel == NULL && free_slot == NULL) free_slot = &subscriptions[i];
+        }
+        if (!isCreated || free_slot == NULL) return NULL;
+        *free_slot = Subscription();
+        free_slot->channel = channel;
+        return free_slot;
+    }
+
+    /** Write the changed status fields to a subscribed channel, in its encoding.
+    *
+    * @param channel subscribed channel.
+    * @param format encoding of the channel.
+    * @param isModeChanged add the mode.
+    * @param isLedChanged add the LED value.
+    * @param mode current mode.
+    * @param led current LED value.
+    */
+    void writeStatusPush(Command::ResponseChannel *channel, Command::WireFormat format, bool isModeChanged, bool isLedChanged, int mode, float led) {
+        if (format == Command::WireFormat::MSGPACK) {
+            uint8_t push[32];
+            MsgPack::Writer writer(push, sizeof(push));
+            writer.writeMapHeader(1);
+            writer.writeString("status", 6);
+            writer.writeMapHeader((isModeChanged && isLedChanged) ? 2 : 1);
+            if (isLedChanged) {
+                writer.writeString("led", 3);
+                writer.writeFloat(led);
+            }
+            if (isModeChanged) {
+                writer.writeString("mode", 4);
+                writer.writeInt(mode);
+            }
+            if (!writer.isOverflow())
+                channel->writePush(Log::LogFrameType::BINARY, (const char*)push, writer.getLength());
+            return;
+        }
+
+        // Only changed fields, patched in their template.
+        char push[64];
+        size_t length;
+        if (isModeChanged && isLedChanged)
+            length = STATUS_PUSH_FULL.render(push, sizeof(push), {led, mode});
+        else if (isModeChanged)
+            length = STATUS_PUSH_MODE.render(push, sizeof(push), {mode});
+        else
+            length = STATUS_PUSH_LED.render(push, sizeof(push), {led});
+        if (length > 0)
+            channel->writePush(Log::LogFrameType::RELEASE, push, length);
+    }
+
+    // Ready check of deferred responses, the effect is done once it stops or is replaced by another one.
+    bool isEffectDone(void *generation) {
+        return !led_controller->isPlaying() || led_controller->getGeneration() != (uint32_t)(uintptr_t)generation;
+    }
+
+    // Defer the response until the current effect is done if the request has "wait":true.
+    void deferUntilEffectDone(Command::CommandContext *context, RequestValue wait) {
+        if (wait.getBoolean()) {
+            context->ready = isEffectDone;
+            context->ready_context = (void*)(uintptr_t)led_controller->getGeneration();
+        }
+    }
+
+    /** Check a duration or period of a request before any conversion, an error naming the field is set if it is rejected.
+    *
+    * @param context command context.
+    * @param command name of the command in the error, for example "Mode 2".
+    * @param key field of the duration.
+    * @param seconds duration in seconds.
+    * @return false if it is not finite or out of [0, LED_MAX_DURATION_S].
+    */
+    bool checkDuration(Command::CommandContext *context, const char *command, const char *key, float seconds) {
+        if (Led::LedController::isValidDuration(seconds)) return true;
+        char message[80];
+        std::snprintf(message, sizeof(message), "%s expect float \\\"%s\\\" to be between 0 and %d.", command, key, LED_MAX_DURATION_S);
+        Command::setError(context, message);
+        return false;
+    }
+
+    void modeOnOff(Command::CommandContext *context) {
+        // Set led state to 1 (on) if on is true, else set led state to 0 (off)
+        led_controller->setOn(context->request.get("on").getBoolean());
+        current_state.mode = 0;
+    }
+
+    void modePwm(Command::CommandContext *context) {
+        float val = context->request.get("v").getFloat();
+        if (val >= 0.0f && val <= 1.0f) {
+            led_controller->setPwm(val);
+            current_state.mode = 1;
+        } else {
+            Command::setError(context, "Mode 1 expect float \\\"v\\\" to be between 0 and 1.");
+        }
+    }
+
+    void modeBlink(Command::CommandContext *context) {
+        // Blink is driven by the controller ticker, no thread is created.
+        float delay = context->request.get("d").getFloat();
+        if (!checkDuration(context, "Mode 2", "d", delay)) return;
+        led_controller->setBlink(delay);
+        current_state.mode = 2;
+    }
+
+    void modeFade(Command::CommandContext *context) {
+        RequestValue fields[4];
+        context->request.query(FADE_FIELDS, fields);
+        // Start from current brightness if "from" is not given.
+        float from = fields[0].isFloat() ? fields[0].getFloat() : led_controller->getValue();
+        float to = fields[1].getFloat();
+        float duration = fields[2].getFloat();
+        if (!checkDuration(context, "Mode 3", "t", duration)) return;
+        if (from >= 0.0f && from <= 1.0f && to >= 0.0f && to <= 1.0f) {
+            led_controller->setFade(from, to, duration);
+            current_state.mode = 3;
+            deferUntilEffectDone(context, fields[3]);
+        } else {
+            Command::setError(context, "Mode 3 expect float \\\"from\\\" and \\\"to\\\" to be between 0 and 1.");
+        }
+    }
+
+    void modeBreathe(Command::CommandContext *context) {
+        float period = context->request.get("t").getFloat();
+        if (!checkDuration(context, "Mode 4", "t", period)) return;
+        led_controller->setBreathe(period);
+        current_state.mode = 4;
+    }
+
+    void modeSequence(Command::CommandContext *context) {
+        RequestValue fields[4];
+        context->request.query(SEQUENCE_FIELDS, fields);
+        float step = fields[1].getFloat();
+        if (!checkDuration(context, "Mode 5", "dt", step)) return;
+        // Samples are converted in the scratch of the channel before being copied by the controller.
+        float *samples = reinterpret_cast<float*>(context->scratch);
+        size_t max_samples = context->scratch_capacity / sizeof(float);
+        if (max_samples > LED_WAVEFORM_MAX_SAMPLES) max_samples = LED_WAVEFORM_MAX_SAMPLES;
+        RequestValue seq = fields[0];
+        size_t count = seq.size();
+        // Convert JSON array to duty cycles, integers are accepted for fully on/off steps.
+        bool isValid = count <= max_samples;
+        for (size_t i = 0; i < count && isValid; i++) {
+            RequestValue sample = seq.at(i);
+            float val = sample.isInt() ? sample.getInt() : (sample.isFloat() ? sample.getFloat() : -1.0f);
+            // Written so that NaN, which fails every comparison, is rejected too.
+            if (!(val >= 0.0f && val <= 1.0f)) isValid = false;
+            samples[i] = val;
+        }
+        bool loop = fields[2].isBoolean() ? fields[2].getBoolean() : true;
+        if (isValid && led_controller->setSequence(samples, count, step, loop)) {
+            current_state.mode = 5;
+            deferUntilEffectDone(context, fields[3]);
+        } else {
+            char message[64];
+            std::snprintf(message, sizeof(message), "Mode 5 expect 1 to %d steps between 0 and 1.", (int)max_samples);
+            Command::setError(context, message);
+        }
+    }
+
+    void requestStatus(Command::CommandContext *context) {
+        // Hot response, rendered from its template when possible.
+        if (Command::addFields(context, STATUS_FIELDS, {led_controller->getValue(), current_state.mode})) return;
+#if NO_HEAP
+        Command::setError(context, "Response too long.");
+#else
+        JSONParser::JSONValue status(new std::map<std::string, JSONParser::JSONValue>);
+
+        status.getMap()->insert(std::pair<std::string, JSONParser::JSONValue>("mode", JSONParser::JSONValue(current_state.mode)));
+        status.getMap()->insert(std::pair<std::string, JSONParser::JSONValue>("led", JSONParser::JSONValue(led_controller->getValue())));
+
+        // Insert status message in response object
+        context->response->insert(std::pair<std::string, JSONParser::JSONValue>("status", status));
+#endif
+    }
+
+    void requestDumpLog(Command::CommandContext *) {
+        // Output the content of the RAM log before the response.
+        Log::Logger::getInstance()->dumpToSinks(crash_log);
+    }
+
+    void requestSubscribe(Command::CommandContext *context) {
+        RequestValue dt = context->request.get("dt");
+        std::chrono::milliseconds period(STATUS_PUSH_PERIOD_MS);
+        if (dt.isFloat()) {
+            if (!checkDuration(context, "Request 2", "dt", dt.getFloat())) return;
+            period = std::chrono::milliseconds(static_cast<int64_t>(dt.getFloat() * 1000.0f));
+        }
+        if (period < std::chrono::milliseconds(STATUS_PUSH_MIN_PERIOD_MS))
+            period = std::chrono::milliseconds(STATUS_PUSH_MIN_PERIOD_MS);
+
+        subscription_mutex.lock();
+        Subscription *subscription = (context->channel != NULL) ? findSubscription(context->channel, true) : NULL;
+        if (subscription != NULL) {
+            subscription->period = period;
+            subscription->format = context->format;
+            // First push sends every field.
+            subscription->hasPushed = false;
+        }
+        subscription_mutex.unlock();
+        if (subscription == NULL) Command::setError(context, "Too many subscriptions.");
+    }
+
+    void requestUnsubscribe(Command::CommandContext *context) {
+        subscription_mutex.lock();
+        Subscription *subscription = findSubscription(context->channel, false);
+        if (subscription != NULL) subscription->channel = NULL;
+        subscription_mutex.unlock();
+    }
+
+    /** Render the members of the stats object, without braces.
+    *
+    * @param buffer output buffer.
+    * @param capacity size of the output buffer.
+    * @param isHistogramRequested add the buckets of each step.
+    * @return number of bytes written, 0 if it does not fit.
+    */
+    size_t renderStats(char *buffer, size_t capacity, bool isHistogramRequested) {
+        size_t length = STATS_TIME.render(buffer, capacity, {(int)(Metrics::getElapsedMicroseconds() / 1000)});
+        if (length == 0) return 0;
+        for (int probe = 0; probe < METRICS_PROBE_COUNT; probe++) {
+            Metrics::Histogram histogram = Metrics::getHistogram((Metrics::Probe)probe);
+            // Latencies in microseconds.
+            size_t written = STATS_PROBE.render(buffer + length, capacity - length, {Metrics::getProbeName((Metrics::Probe)probe), (int)histogram.count,
+                (int)((histogram.count > 0) ? histogram.total_us / histogram.count : 0), (int)Metrics::percentile(histogram, 50),
+                (int)Metrics::percentile(histogram, 99), (int)histogram.max_us});
+            if (written == 0) return 0;
+            length += written;
+            if (isHistogramRequested) {
+                static const char BUCKETS[] = ",\"h\":[";
+                if (length + sizeof(BUCKETS) - 1 > capacity) return 0;
+                std::memcpy(buffer + length, BUCKETS, sizeof(BUCKETS) - 1);
+                length += sizeof(BUCKETS) - 1;
+                for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+                    if (i > 0 && length < capacity) buffer[length++] = ',';
+                    written = Response::writeInt(buffer + length, capacity - length, (int)histogram.buckets[i]);
+                    if (written == 0) return 0;
+                    length += written;
+                }
+                if (length >= capacity) return 0;
+                buffer[length++] = ']';
+            }
+            if (length >= capacity) return 0;
+            buffer[length++] = '}';
+        }
+        for (int counter = 0; counter < METRICS_COUNTER_COUNT; counter++) {
+            size_t written = STATS_COUNTER.render(buffer + length, capacity - length, {Metrics::getCounterName((Metrics::Counter)counter), (int)Metrics::getCounter((Metrics::Counter)counter)});
+            if (written == 0) return 0;
+            length += written;
+        }
+        return length;
+    }
+
+    void requestStats(Command::CommandContext *context) {
+        RequestValue request = context->request;
+        bool isHistogramRequested = request.get("hist").getBoolean();
+
+        size_t length = renderStats(context->scratch, context->scratch_capacity, isHistogramRequested);
+        if (length == 0 || !Command::addFields(context, STATS_FIELD, {Response::TemplateValue(context->scratch, length)})) {
+#if NO_HEAP
+            Command::setError(context, "Response too long, increase pipeline-response-length.");
+#else
+            std::map<std::string, JSONParser::JSONValue> stats;
+            stats["t"] = JSONParser::JSONValue((int)(Metrics::getElapsedMicroseconds() / 1000));
+            for (int probe = 0; probe < METRICS_PROBE_COUNT; probe++) {
+                Metrics::Histogram histogram = Metrics::getHistogram((Metrics::Probe)probe);
+                // Latencies in microseconds.
+                std::map<std::string, JSONParser::JSONValue> latency;
+                latency["n"] = JSONParser::JSONValue((int)histogram.count);
+                latency["avg"] = JSONParser::JSONValue((int)((histogram.count > 0) ? histogram.total_us / histogram.count : 0));
+                latency["p50"] = JSONParser::JSONValue((int)Metrics::percentile(histogram, 50));
+                latency["p99"] = JSONParser::JSONValue((int)Metrics::percentile(histogram, 99));
+                latency["max"] = JSONParser::JSONValue((int)histogram.max_us);
+                if (isHistogramRequested) {
+                    std::vector<JSONParser::JSONValue> buckets;
+                    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) buckets.push_back(JSONParser::JSONValue((int)histogram.buckets[i]));
+                    latency["h"] = JSONParser::JSONValue(&buckets);
+                }
+                stats[Metrics::getProbeName((Metrics::Probe)probe)] = JSONParser::JSONValue(&latency);
+            }
+            for (int counter = 0; counter < METRICS_COUNTER_COUNT; counter++)
+                stats[Metrics::getCounterName((Metrics::Counter)counter)] = JSONParser::JSONValue((int)Metrics::getCounter((Metrics::Counter)counter));
+
+            context->response->insert(std::pair<std::string, JSONParser::JSONValue>("stats", JSONParser::JSONValue(&stats)));
+#endif
+        }
+
+        // Read then reset, so that no sample is lost between two periodic reads.
+        if (request.get("reset").getBoolean())
+            Metrics::reset();
+    }
+
+    /** Render the members of the memory object, without braces.
+    *
+    * @param buffer output buffer.
+    * @param capacity size of the output buffer.
+    * @return number of bytes written, 0 if it does not fit.
+    */
+    size_t renderMemory(char *buffer, size_t capacity) {
+        MemoryStats::MessageStats messages = MemoryStats::getMessageStats();
+        MemoryStats::HeapUsage heap = MemoryStats::getHeapUsage();
+        size_t length = MEMORY_MESSAGES.render(buffer, capacity, {(int)messages.count, (int)messages.total.allocations, (int)messages.total.frees,
+            (int)messages.total.bytes, (int)messages.max_allocations, (int)messages.max_bytes});
+        if (length == 0) return 0;
+        size_t written = MEMORY_HEAP.render(buffer + length, capacity - length, {(int)heap.current, (int)heap.peak});
+        if (written == 0) return 0;
+        length += written;
+        for (size_t i = 0; i < MemoryStats::getThreadCount(); i++) {
+            MemoryStats::StackUsage stack = MemoryStats::getStackUsage(i);
+            written = MEMORY_STACK.render(buffer + length, capacity - length, {(i > 0) ? "," : "", stack.name, (int)stack.used, (int)stack.size});
+            if (written == 0) return 0;
+            length += written;
+        }
+        if (length >= capacity) return 0;
+        buffer[length++] = '}';
+        return length;
+    }
+
+    void requestMemory(Command::CommandContext *context) {
+        size_t length = renderMemory(context->scratch, context->scratch_capacity);
+        if (length == 0 || !Command::addFields(context, MEMORY_FIELD, {Response::TemplateValue(context->scratch, length)})) {
+#if NO_HEAP
+            Command::setError(context, "Response too long, increase pipeline-response-length.");
+#else
+            MemoryStats::MessageStats messages = MemoryStats::getMessageStats();
+            MemoryStats::HeapUsage heap = MemoryStats::getHeapUsage();
+            std::map<std::string, JSONParser::JSONValue> memory;
+            memory["n"] = JSONParser::JSONValue((int)messages.count);
+            memory["allocs"] = JSONParser::JSONValue((int)messages.total.allocations);
+            memory["frees"] = JSONParser::JSONValue((int)messages.total.frees);
+            memory["bytes"] = JSONParser::JSONValue((int)messages.total.bytes);
+            memory["max_allocs"] = JSONParser::JSONValue((int)messages.max_allocations);
+            memory["max_bytes"] = JSONParser::JSONValue((int)messages.max_bytes);
+            memory["heap"] = JSONParser::JSONValue((int)heap.current);
+            memory["heap_max"] = JSONParser::JSONValue((int)heap.peak);
+            // Stack used and size of each watched thread.
+            std::map<std::string, JSONParser::JSONValue> stacks;
+            for (size_t i = 0; i < MemoryStats::getThreadCount(); i++) {
+                MemoryStats::StackUsage stack = MemoryStats::getStackUsage(i);
+                std::vector<JSONParser::JSONValue> usage = {JSONParser::JSONValue((int)stack.used), JSONParser::JSONValue((int)stack.size)};
+                stacks[stack.name] = JSONParser::JSONValue(&usage);
+            }
+            memory["stack"] = JSONParser::JSONValue(&stacks);
+            context->response->insert(std::pair<std::string, JSONParser::JSONValue>("mem", JSONParser::JSONValue(&memory)));
+#endif
+        }
+
+        // Read then reset, like the stats request.
+        if (context->request.get("reset").getBoolean())
+            MemoryStats::reset();
+    }
+
+    // Part of a duration in tenths of percent.
+    int perMille(uint64_t part_us, uint64_t total_us) {
+        return (total_us > 0) ? (int)(part_us * 1000 / total_us) : 0;
+    }
+
+    /** Render the members of the threads object, without braces.
+    *
+    * @param buffer output buffer.
+    * @param capacity size of the output buffer.
+    * @return number of bytes written, 0 if it does not fit.
+    */
+    size_t renderThreads(char *buffer, size_t capacity) {
+        ThreadStats::CpuUsage cpu = ThreadStats::getCpuUsage();
+        size_t length = THREADS_CPU.render(buffer, capacity, {(int)(cpu.elapsed_us / 1000), perMille(cpu.idle_us, cpu.elapsed_us)});
+        if (length == 0) return 0;
+        for (size_t i = 0; i < ThreadStats::getThreadCount(); i++) {
+            ThreadStats::ThreadUsage thread = ThreadStats::getThreadUsage(i);
+            size_t written = THREADS_THREAD.render(buffer + length, capacity - length, {thread.name, thread.priority, perMille(thread.run_us, cpu.elapsed_us),
+                (int)thread.latency.count, (int)Metrics::percentile(thread.latency, 50), (int)Metrics::percentile(thread.latency, 99), (int)thread.latency.max_us});
+            if (written == 0) return 0;
+            length += written;
+        }
+        return length;
+    }
+
+    void requestThreads(Command::CommandContext *context) {
+        size_t length = renderThreads(context->scratch, context->scratch_capacity);
+        if (length == 0 || !Command::addFields(context, THREADS_FIELD, {Response::TemplateValue(context->scratch, length)})) {
+#if NO_HEAP
+            Command::setError(context, "Response too long, increase pipeline-response-length.");
+#else
+            ThreadStats::CpuUsage cpu = ThreadStats::getCpuUsage();
+            std::map<std::string, JSONParser::JSONValue> threads;
+            threads["t"] = JSONParser::JSONValue((int)(cpu.elapsed_us / 1000));
+            threads["idle"] = JSONParser::JSONValue(perMille(cpu.idle_us, cpu.elapsed_us));
+            // Priority, CPU share in tenths of percent, then count and latencies in microseconds of the wake-ups.
+            for (size_t i = 0; i < ThreadStats::getThreadCount(); i++) {
+                ThreadStats::ThreadUsage thread = ThreadStats::getThreadUsage(i);
+                std::vector<JSONParser::JSONValue> usage = {JSONParser::JSONValue(thread.priority), JSONParser::JSONValue(perMille(thread.run_us, cpu.elapsed_us)),
+                    JSONParser::JSONValue((int)thread.latency.count), JSONParser::JSONValue((int)Metrics::percentile(thread.latency, 50)),
+                    JSONParser::JSONValue((int)Metrics::percentile(thread.latency, 99)), JSONParser::JSONValue((int)thread.latency.max_us)};
+                threads[thread.name] = JSONParser::JSONValue(&usage);
+            }
+            context->response->insert(std::pair<std::string, JSONParser::JSONValue>("threads", JSONParser::JSONValue(&threads)));
+#endif
+        }
+
+        // Read then reset, like the stats request.
+        if (context->request.get("reset").getBoolean())
+            ThreadStats::reset();
+    }
+
+    void requestProtocol(Command::CommandContext *context) {
+        int proto = context->request.get("proto").getInt();
+#if NO_HEAP
+        // MessagePack requests are decoded into JSONValue, only JSON is available without heap.
+        if (proto != Command::WireFormat::JSON) {
+            Command::setError(context, "Request 4 expect int \\\"proto\\\" to be 0 (JSON), MessagePack needs the heap.");
+            return;
+        }
+#else
+        if (proto != Command::WireFormat::JSON && proto != Command::WireFormat::MSGPACK) {
+            Command::setError(context, "Request 4 expect int \\\"proto\\\" to be 0 (JSON) or 1 (MessagePack).");
+            return;
+        }
+#endif
+        // The response still uses the current encoding, the next requests use the new one.
+        context->format = (Command::WireFormat)proto;
+        subscription_mutex.lock();
+        Subscription *subscription = findSubscription(context->channel, false);
+        if (subscription != NULL) subscription->format = context->format;
+        subscription_mutex.unlock();
+
+        if (Command::addFields(context, PROTOCOL_FIELD, {proto})) return;
+#if !NO_HEAP
+        context->response->insert(std::pair<std::string, JSONParser::JSONValue>("proto", JSONParser::JSONValue(proto)));
+#endif
+    }
+}
+
+void DeviceCommands::registerAll(Command::CommandRegistry *registry, Led::LedController *led, Log::RamLogSink *log) {
+    device_registry = registry;
+    led_controller = led;
+    crash_log = log;
+
+    registry->registerKey("mode", "Unknown mode.");
+    registry->registerCommand("mode", 0, "Mode 0", {{"on", JSONParser::JSONValueType::Boolean}}, modeOnOff);
+    registry->registerCommand("mode", 1, "Mode 1", {{"v", JSONParser::JSONValueType::Float}}, modePwm);
+    registry->registerCommand("mode", 2, "Mode 2", {{"d", JSONParser::JSONValueType::Float}}, modeBlink);
+    registry->registerCommand("mode", 3, "Mode 3", {{"to", JSONParser::JSONValueType::Float}, {"t", JSONParser::JSONValueType::Float}}, modeFade);
+    registry->registerCommand("mode", 4, "Mode 4", {{"t", JSONParser::JSONValueType::Float}}, modeBreathe);
+    registry->registerCommand("mode", 5, "Mode 5", {{"seq", JSONParser::JSONValueType::Array}, {"dt", JSONParser::JSONValueType::Float}}, modeSequence);
+
+    registry->registerKey("req", "Unknown request.");
+    registry->registerCommand("req", 0, "Request 0", {}, requestStatus);
+    registry->registerCommand("req", 1, "Request 1", {}, requestDumpLog);
+    registry->registerCommand("req", 2, "Request 2", {}, requestSubscribe);
+    registry->registerCommand("req", 3, "Request 3", {}, requestUnsubscribe);
+    registry->registerCommand("req", 4, "Request 4", {{"proto", JSONParser::JSONValueType::Integer}}, requestProtocol);
+    registry->registerCommand("req", 5, "Request 5", {}, requestStats);
+    registry->registerCommand("req", 6, "Request 6", {}, requestMemory);
+    registry->registerCommand("req", 7, "Request 7", {}, requestThreads);
+}
+
+State DeviceCommands::getState() {
+    device_registry->lock();
+    State state = current_state;
+    device_registry->unlock();
+    return state;
+}
+
+void DeviceCommands::pushStatusChanges() {
+    // Read the state before the subscriptions, handlers lock in this order.
+    State state = DeviceCommands::getState();
+    float led = led_controller->getValue();
+    Kernel::Clock::time_point now = Kernel::Clock::now();
+    for (size_t i = 0; i < STATUS_MAX_SUBSCRIPTIONS; i++) {
+        subscription_mutex.lock();
+        Subscription& subscription = subscriptions[i];
+        if (subscription.channel == NULL || (subscription.hasPushed && now - subscription.last_push < subscription.period)) {
+            subscription_mutex.unlock();
+            continue;
+        }
+        bool isModeChanged = !subscription.hasPushed || state.mode != subscription.mode;
+        bool isLedChanged = !subscription.hasPushed || led != subscription.led;
+        if (!isModeChanged && !isLedChanged) {
+            subscription_mutex.unlock();
+            continue;
+        }
+        subscription.hasPushed = true;
+        subscription.last_push = now;
+        subscription.mode = state.mode;
+        subscription.led = led;
+        Command::ResponseChannel *channel = subscription.channel;
+        Command::WireFormat format = subscription.format;
+        subscription_mutex.unlock();
+
+        // Written without the lock, a channel may block on its serial.
+        writeStatusPush(channel, format, isModeChanged, isLedChanged, state.mode, led);
+    }
+}
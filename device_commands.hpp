@@ -0,0 +1,44 @@
+/* Device commands
+ * Handlers of the serial commands of the board (LED modes and requests), registered in a CommandRegistry.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include "command_registry.hpp"
+#include "led_controller.hpp"
+#include "logger.hpp"
+
+// Default delay between two status pushes of a subscription in milliseconds. Can be overridden with "status-push-period-ms" in mbed_app.json.
+#ifdef MBED_CONF_APP_STATUS_PUSH_PERIOD_MS
+#define STATUS_PUSH_PERIOD_MS MBED_CONF_APP_STATUS_PUSH_PERIOD_MS
+#else
+#define STATUS_PUSH_PERIOD_MS 100
+#endif
+
+// Shortest delay between two status pushes in milliseconds.
+#define STATUS_PUSH_MIN_PERIOD_MS 10
+
+// Maximum number of channels subscribed to status pushes at the same time.
+#define STATUS_MAX_SUBSCRIPTIONS 4
+
+namespace DeviceCommands {
+    // State of the device reported by the status request.
+    struct State {
+        int mode = 0;
+    };
+
+    /** Register every device command.
+    *
+    * @param registry registry to fill.
+    * @param led controller of the built-in LED.
+    * @param crash_log RAM log dumped by the dump request.
+    */
+    void registerAll(Command::CommandRegistry *registry, Led::LedController *led, Log::RamLogSink *crash_log);
+
+    // Current state of the device.
+    State getState();
+
+    // Push the status fields changed since the last push to each subscribed channel whose period elapsed. Must be called periodically.
+    void pushStatusChanges();
+}
\ No newline at end of file
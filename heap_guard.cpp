@@ -0,0 +1,146 @@
+/* Heap guard
+ * Checks of the no-heap build: once the guard is locked, any heap operation is a fatal error.
+ * The same allocator hook counts every heap operation for MemoryStats.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "heap_guard.hpp"
+#include "memory_stats.hpp"
+#include "mbed.h"
+
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    volatile bool isHeapLocked = false;
+}
+
+#if defined(__MBED__)
+#include "mbed_mem_trace.h"
+
+#if NO_HEAP && !defined(MBED_MEM_TRACING_ENABLED)
+#error "no-heap needs the memory tracer to catch allocations, build with --profile profiles/stats.json"
+#endif
+
+#if defined(MBED_MEM_TRACING_ENABLED)
+// Called by the allocator wrappers for every malloc, realloc, calloc and free. Freed sizes are not known.
+static void onHeapOperation(uint8_t op, void *res, void *caller, ...) {
+    va_list args;
+    va_start(args, caller);
+    bool isNullFree = false;
+    switch (op) {
+        case MBED_MEM_TRACE_MALLOC: {
+            size_t size = va_arg(args, size_t);
+            if (res != NULL) MemoryStats::onHeapOperation(true, size);
+            break;
+        }
+        case MBED_MEM_TRACE_CALLOC: {
+            size_t count = va_arg(args, size_t);
+            size_t size = va_arg(args, size_t);
+            if (res != NULL) MemoryStats::onHeapOperation(true, count * size);
+            break;
+        }
+        case MBED_MEM_TRACE_REALLOC: {
+            void *ptr = va_arg(args, void*);
+            size_t size = va_arg(args, size_t);
+            // A moved or resized block counts as a free of the old one and a new allocation.
+            if (res != NULL && ptr != NULL) MemoryStats::onHeapOperation(false, 0);
+            if (res != NULL) MemoryStats::onHeapOperation(true, size);
+            break;
+        }
+        case MBED_MEM_TRACE_FREE:
+            isNullFree = va_arg(args, void*) == NULL;
+            if (!isNullFree) MemoryStats::onHeapOperation(false, 0);
+            break;
+    }
+    va_end(args);
+    if (!isHeapLocked || isNullFree) return;
+    error("Heap used after HeapGuard::lock() (operation %d from %p)!\r\n", op, caller);
+}
+#endif
+
+void HeapGuard::init() {
+#if defined(MBED_MEM_TRACING_ENABLED)
+    mbed_mem_trace_set_callback(onHeapOperation);
+#endif
+}
+
+void HeapGuard::lock() {
+    isHeapLocked = true;
+}
+#else
+// Host: the shim allocates where Mbed OS does not (std::function, std::thread), those allocations are neither checked nor counted.
+static bool isShimOperation(const char *operation, size_t size) {
+    if (mbed_host::shimAllocationDepth() > 0) return true;
+    if (isHeapLocked) {
+        std::fprintf(stderr, "Heap %s of %lu bytes after HeapGuard::lock()!\n", operation, (unsigned long)size);
+        std::abort();
+    }
+    return false;
+}
+
+// Header of a block, keeps its size for the free. Aligned so that the block stays aligned.
+union BlockHeader {
+    struct {
+        size_t size;
+        bool isCounted;
+    } block;
+    std::max_align_t alignment;
+};
+
+void HeapGuard::init() {}
+
+void HeapGuard::lock() {
+    isHeapLocked = true;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    bool isCounted = !isShimOperation("allocation", size);
+    BlockHeader *header = static_cast<BlockHeader*>(std::malloc(sizeof(BlockHeader) + size));
+    if (header == NULL) return NULL;
+    header->block.size = size;
+    header->block.isCounted = isCounted;
+    if (isCounted) MemoryStats::onHeapOperation(true, size);
+    return header + 1;
+}
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+void* operator new(std::size_t size) {
+    void *ptr = operator new(size, std::nothrow);
+    if (ptr == NULL) throw std::bad_alloc();
+    return ptr;
+}
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+void operator delete(void *ptr) noexcept {
+    if (ptr == NULL) return;
+    BlockHeader *header = static_cast<BlockHeader*>(ptr) - 1;
+    isShimOperation("free", header->block.size);
+    if (header->block.isCounted) MemoryStats::onHeapOperation(false, header->block.size);
+    std::free(header);
+}
+void operator delete[](void *ptr) noexcept {
+    operator delete(ptr);
+}
+void operator delete(void *ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+void operator delete[](void *ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+void operator delete(void *ptr, const std::nothrow_t&) noexcept {
+    operator delete(ptr);
+}
+void operator delete[](void *ptr, const std::nothrow_t&) noexcept {
+    operator delete(ptr);
+}
+#endif
+
+bool HeapGuard::isLocked() {
+    return isHeapLocked;
+}
@@ -0,0 +1,24 @@
+/* Heap guard
+ * Checks of the no-heap build: once the guard is locked, any heap operation is a fatal error. Allocations are caught
+ * by the global operator new on the host and by the Mbed OS memory tracer on the board, and counted for MemoryStats.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+// Build every stage of command processing on fixed capacity buffers, without heap after boot. Can be enabled with "no-heap" in mbed_app.json.
+#ifdef MBED_CONF_APP_NO_HEAP
+#define NO_HEAP MBED_CONF_APP_NO_HEAP
+#else
+#define NO_HEAP 0
+#endif
+
+namespace HeapGuard {
+    // Install the allocator hook counting heap operations for MemoryStats. Called first at boot.
+    void init();
+
+    // Make any later heap operation fatal. Called once boot is done and every thread is started.
+    void lock();
+
+    bool isLocked();
+}
@@ -0,0 +1,402 @@
+/* JSON benchmark
+ * Host benchmark of the JSON hot paths on adversarial inputs: payload shapes (many small objects, strings close to the
+ * read buffer, numbers, keywords, nesting at the depth limit and past it) lexed whole or in chunks split like the serial
+ * receives them, mid-string, mid-number, mid-keyword or byte by byte, through the same ChunkLexer as the pipeline. Each
+ * shape is also deserialized and serialized back, and parsed into a tape whose JSON Pointer query reads a few values.
+ *
+ * Every row reports ns/byte and allocations per message at the large size, and the growth of ns/byte from the small to
+ * the large size (four times more values): about 1 for a linear path, 4 for a quadratic one. The run exits with 1
+ * when a growth exceeds --max-growth, when ns/byte exceeds the stored baseline times --threshold, or when allocations
+ * do, and with 2 on invalid arguments. Times depend on the machine, write the baseline again when it changes.
+ *
+ * g++ -std=gnu++14 -O2 -pthread -Ihost -I. host/json_bench.cpp $(ls *.cpp | grep -v main.cpp) -o json_bench
+ * ./json_bench [--baseline host/json_bench_baseline.txt] [--threshold 1.5] [--max-growth 2] [--write-baseline file]
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "mbed.h"
+#include "json_parser.hpp"
+#include "json_query.hpp"
+#include "json_tape.hpp"
+#include "logger.hpp"
+#include "memory_stats.hpp"
+#include "pipeline.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#if NO_HEAP
+#error "The benchmark builds JSONValue trees, build it without no-heap."
+#endif
+
+// Values of a message at the small and large sizes, the large one stays below JSON_MAX_ELEMENTS.
+#define BENCH_SMALL_VALUES 100
+#define BENCH_LARGE_VALUES 400
+// Length of the generated strings, lexed in one piece within the pipeline read buffer.
+#define BENCH_STRING_LENGTH 48
+// Each measure keeps the fastest of its batches, a batch runs for at least this time.
+#define BENCH_BATCHES 5
+#define BENCH_BATCH_NS 2000000
+// Deserialized trees are never freed, so runs are bounded.
+#define BENCH_MAX_ITERATIONS 1000
+
+#define BENCH_DEFAULT_THRESHOLD 1.5
+#define BENCH_DEFAULT_MAX_GROWTH 2.0
+
+// Frames of the parser (rejected messages) are dropped before formatting.
+Log::Logger logger;
+
+namespace {
+    struct Shape {
+        const char *name;
+        // Message with about the given number of values.
+        std::function<std::string(int values)> generate;
+    };
+
+    struct Chunking {
+        const char *name;
+        // Positions where the message is cut before the chunks are split to the read buffer length. Empty for a single chunk.
+        std::function<std::vector<size_t>(const std::string& message)> cuts;
+        bool isWhole;
+    };
+
+    struct Measure {
+        size_t bytes = 0;
+        double ns_per_byte = 0.0;
+        uint32_t allocations = 0;
+    };
+
+    struct Row {
+        std::string name;
+        Measure small;
+        Measure large;
+
+        double growth() const {
+            return (this->small.ns_per_byte > 0.0) ? this->large.ns_per_byte / this->small.ns_per_byte : 0.0;
+        }
+    };
+
+    struct BaselineEntry {
+        double ns_per_byte;
+        uint32_t allocations;
+    };
+
+    std::string generateObjects(int values) {
+        std::string message = "[";
+        for (int i = 0; i < values / 3; i++) {
+            if (i > 0) message += ',';
+            message += "{\"id\":" + std::to_string(i) + ",\"on\":" + ((i % 2 == 0) ? "true" : "false") + "}";
+        }
+        return message + "]";
+    }
+
+    std::string generateStrings(int values) {
+        std::string message = "[";
+        for (int i = 0; i < values; i++) {
+            if (i > 0) message += ',';
+            message += '"' + std::string(BENCH_STRING_LENGTH, 'a' + i % 26) + '"';
+        }
+        return message + "]";
+    }
+
+    std::string generateNumbers(int values) {
+        std::string message = "[";
+        for (int i = 0; i < values; i++) {
+            if (i > 0) message += ',';
+            message += (i % 2 == 0) ? std::to_string(100000 + i * 7) : "0." + std::to_string(123456 + i);
+        }
+        return message + "]";
+    }
+
+    std::string generateKeywords(int values) {
+        static const char* const KEYWORDS[] = {"true", "false", "null"};
+        std::string message = "[";
+        for (int i = 0; i < values; i++) {
+            if (i > 0) message += ',';
+            message += KEYWORDS[i % 3];
+        }
+        return message + "]";
+    }
+
+    // Groups nested up to the depth limit, root included.
+    std::string generateNested(int values) {
+        int depth = JSON_MAX_DEPTH - 1;
+        std::string message = "[";
+        for (int i = 0; i < values / depth; i++) {
+            if (i > 0) message += ',';
+            message += std::string(depth - 1, '[') + std::to_string(i) + std::string(depth - 1, ']');
+        }
+        return message + "]";
+    }
+
+    // Nesting far past the depth limit, rejected by Deserialize.
+    std::string generateTooDeep(int values) {
+        return std::string(values, '[') + std::string(values, ']');
+    }
+
+    // Cut after the first character of every token starting with one of the given characters, strings outside.
+    std::vector<size_t> cutInTokens(const std::string& message, const char *starts) {
+        std::vector<size_t> cuts;
+        bool isInString = false;
+        for (size_t i = 0; i < message.size(); i++) {
+            char c = message[i];
+            bool isStart = !isInString && std::strchr(starts, c) != NULL && (i == 0 || !std::isalnum((unsigned char)message[i - 1]));
+            if (c == '"') isInString = !isInString;
+            if (isStart && i + 1 < message.size()) cuts.push_back(i + 1 + (c == '"'));
+        }
+        return cuts;
+    }
+
+    std::vector<size_t> cutEveryByte(const std::string& message) {
+        std::vector<size_t> cuts;
+        for (size_t i = 1; i < message.size(); i++) cuts.push_back(i);
+        return cuts;
+    }
+
+    // Chunks of the message at the cuts, no longer than the read buffer of the pipeline.
+    std::vector<std::string> splitChunks(const std::string& message, const Chunking& chunking) {
+        std::vector<std::string> chunks;
+        if (chunking.isWhole) {
+            chunks.push_back(message);
+            return chunks;
+        }
+        std::vector<size_t> cuts = chunking.cuts(message);
+        cuts.push_back(message.size());
+        size_t start = 0;
+        for (size_t cut : cuts) {
+            while (start < cut) {
+                size_t length = std::min<size_t>(cut - start, READ_BUFFER_LENGTH);
+                chunks.push_back(message.substr(start, length));
+                start += length;
+            }
+        }
+        return chunks;
+    }
+
+    uint64_t elapsedNs(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /** Measure an operation, the fastest of BENCH_BATCHES batches.
+    *
+    * @param bytes message length.
+    * @param prepare called before each batch, untimed, with its number of iterations.
+    * @param run one iteration, with its index in the batch.
+    */
+    Measure measure(size_t bytes, std::function<void(int iterations)> prepare, std::function<void(int index)> run) {
+        Measure result;
+        result.bytes = bytes;
+
+        // First run counts allocations and sizes the batches.
+        prepare(1);
+        MemoryStats::Usage mark = MemoryStats::getThreadUsage();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        run(0);
+        uint64_t once_ns = std::max<uint64_t>(elapsedNs(start), 1);
+        result.allocations = MemoryStats::getThreadUsage().allocations - mark.allocations;
+        int iterations = (int)std::min<uint64_t>(std::max<uint64_t>(BENCH_BATCH_NS / once_ns, 1), BENCH_MAX_ITERATIONS);
+
+        double best = 0.0;
+        for (int batch = 0; batch < BENCH_BATCHES; batch++) {
+            prepare(iterations);
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) run(i);
+            double ns_per_byte = (double)elapsedNs(start) / iterations / bytes;
+            if (batch == 0 || ns_per_byte < best) best = ns_per_byte;
+        }
+        result.ns_per_byte = best;
+        return result;
+    }
+
+    Measure measureLex(const std::string& message, const Chunking& chunking) {
+        std::vector<std::string> chunks = splitChunks(message, chunking);
+        // Whole messages are lexed at once, chunks go through the pipeline read buffer.
+        std::vector<char> buffer(chunking.isWhole ? message.size() : READ_BUFFER_LENGTH);
+        return measure(message.size(), [](int) {}, [&](int) {
+            JSONLexer::ChunkLexer lexer(buffer.data(), buffer.size());
+            std::list<JSONLexer::JSONToken> tokens;
+            for (const std::string& chunk : chunks) {
+                if (!lexer.feed(chunk.data(), chunk.size(), &tokens)) {
+                    std::fprintf(stderr, "Token longer than the read buffer in %s chunks!\n", chunking.name);
+                    std::exit(2);
+                }
+            }
+        });
+    }
+
+    std::list<JSONLexer::JSONToken> lexWhole(const std::string& message) {
+        std::vector<char> buffer(message.begin(), message.end());
+        return JSONLexer::LexBuffer(buffer.data(), (int)buffer.size()).tokens;
+    }
+
+    Measure measureDeserialize(const std::string& message) {
+        std::list<JSONLexer::JSONToken> tokens = lexWhole(message);
+        // Deserialize consumes its tokens, copies are made before each batch.
+        std::vector<std::list<JSONLexer::JSONToken>> copies;
+        return measure(message.size(), [&](int iterations) {
+            copies.assign(iterations, tokens);
+        }, [&](int index) {
+            JSONParser::JSONValue::Deserialize(&copies[index]);
+        });
+    }
+
+    // Tape parse then resolution of a few paths, as the handlers of the no-heap build read their fields.
+    Measure measureQuery(const std::string& message) {
+        static const JSONQuery::Query query({"/0/id", "/1", "/2/0"});
+        JSONTape::Value values[3];
+        return measure(message.size(), [](int) {}, [&](int) {
+            JSONTape::Document document;
+            if (document.parse(message.data(), message.size())) query.resolve(document.root(), values);
+        });
+    }
+
+    Measure measureSerialize(const std::string& message) {
+        std::list<JSONLexer::JSONToken> tokens = lexWhole(message);
+        JSONParser::JSONValue value = JSONParser::JSONValue::Deserialize(&tokens);
+        return measure(message.size(), [](int) {}, [&](int) {
+            value.Serialize();
+        });
+    }
+
+    std::map<std::string, BaselineEntry> readBaseline(const char *path) {
+        std::map<std::string, BaselineEntry> baseline;
+        FILE *file = std::fopen(path, "r");
+        if (file == NULL) {
+            std::fprintf(stderr, "Can't read baseline %s!\n", path);
+            std::exit(2);
+        }
+        char line[256];
+        while (std::fgets(line, sizeof(line), file) != NULL) {
+            char name[128];
+            BaselineEntry entry;
+            unsigned long allocations;
+            if (line[0] == '#' || std::sscanf(line, "%127s %lf %lu", name, &entry.ns_per_byte, &allocations) != 3) continue;
+            entry.allocations = allocations;
+            baseline[name] = entry;
+        }
+        std::fclose(file);
+        return baseline;
+    }
+
+    void writeBaseline(const char *path, const std::vector<Row>& rows) {
+        FILE *file = std::fopen(path, "w");
+        if (file == NULL) {
+            std::fprintf(stderr, "Can't write baseline %s!\n", path);
+            std::exit(2);
+        }
+        std::fprintf(file, "# json_bench baseline, large size: row ns/byte allocations\n");
+        for (const Row& row : rows)
+            std::fprintf(file, "%s %.3f %lu\n", row.name.c_str(), row.large.ns_per_byte, (unsigned long)row.large.allocations);
+        std::fclose(file);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *baseline_path = NULL;
+    const char *output_path = NULL;
+    double threshold = BENCH_DEFAULT_THRESHOLD;
+    double max_growth = BENCH_DEFAULT_MAX_GROWTH;
+    for (int i = 1; i < argc; i += 2) {
+        // Every flag takes a value, a trailing one without it is an error rather than ignored.
+        bool isValid = i + 1 < argc;
+        if (isValid) {
+            const char *value = argv[i + 1];
+            char *end = NULL;
+            if (std::strcmp(argv[i], "--baseline") == 0) baseline_path = value;
+            else if (std::strcmp(argv[i], "--write-baseline") == 0) output_path = value;
+            else if (std::strcmp(argv[i], "--threshold") == 0) threshold = std::strtod(value, &end);
+            else if (std::strcmp(argv[i], "--max-growth") == 0) max_growth = std::strtod(value, &end);
+            else isValid = false;
+            // Ratios must be positive numbers.
+            if (end != NULL && (end == value || *end != '\0' || threshold <= 0.0 || max_growth <= 0.0)) isValid = false;
+        }
+        if (!isValid) {
+            std::fprintf(stderr, "Usage: %s [--baseline file] [--threshold ratio] [--max-growth ratio] [--write-baseline file]\n", argv[0]);
+            return 2;
+        }
+    }
+    MemoryStats::watchThread("bench");
+
+    const std::vector<Shape> shapes = {
+        {"objects", generateObjects},
+        {"strings", generateStrings},
+        {"numbers", generateNumbers},
+        {"keywords", generateKeywords},
+        {"nested", generateNested},
+        {"too-deep", generateTooDeep},
+    };
+    const std::vector<Chunking> chunkings = {
+        {"whole", NULL, true},
+        {"serial", [](const std::string&) { return std::vector<size_t>(); }, false},
+        {"mid-string", [](const std::string& message) { return cutInTokens(message, "\""); }, false},
+        {"mid-number", [](const std::string& message) { return cutInTokens(message, "0123456789"); }, false},
+        {"mid-keyword", [](const std::string& message) { return cutInTokens(message, "tfn"); }, false},
+        {"bytes", cutEveryByte, false},
+    };
+
+    std::vector<Row> rows;
+    for (const Shape& shape : shapes) {
+        std::string small = shape.generate(BENCH_SMALL_VALUES);
+        std::string large = shape.generate(BENCH_LARGE_VALUES);
+        for (const Chunking& chunking : chunkings) {
+            Row row;
+            row.name = std::string(shape.name) + "/" + chunking.name + "/lex";
+            row.small = measureLex(small, chunking);
+            row.large = measureLex(large, chunking);
+            rows.push_back(row);
+        }
+        Row deserialize;
+        deserialize.name = std::string(shape.name) + "/deserialize";
+        deserialize.small = measureDeserialize(small);
+        deserialize.large = measureDeserialize(large);
+        rows.push_back(deserialize);
+        Row query;
+        query.name = std::string(shape.name) + "/query";
+        query.small = measureQuery(small);
+        query.large = measureQuery(large);
+        rows.push_back(query);
+
+        Row serialize;
+        serialize.name = std::string(shape.name) + "/serialize";
+        serialize.small = measureSerialize(small);
+        serialize.large = measureSerialize(large);
+        rows.push_back(serialize);
+    }
+
+    std::map<std::string, BaselineEntry> baseline;
+    if (baseline_path != NULL) baseline = readBaseline(baseline_path);
+
+    int failures = 0;
+    std::printf("%-30s %7s %9s %8s %7s %10s  %s\n", "row", "bytes", "ns/byte", "allocs", "growth", "baseline", "status");
+    for (const Row& row : rows) {
+        std::string status = "ok";
+        char reference[32] = "-";
+        if (row.growth() > max_growth) status = "GROWTH";
+        std::map<std::string, BaselineEntry>::iterator entry = baseline.find(row.name);
+        if (entry != baseline.end()) {
+            std::snprintf(reference, sizeof(reference), "%.2fx", entry->second.ns_per_byte > 0.0 ? row.large.ns_per_byte / entry->second.ns_per_byte : 0.0);
+            if (row.large.ns_per_byte > entry->second.ns_per_byte * threshold) status = (status == "ok") ? "SLOWER" : status + ",SLOWER";
+            if (row.large.allocations > entry->second.allocations * threshold) status = (status == "ok") ? "ALLOCS" : status + ",ALLOCS";
+        } else if (baseline_path != NULL) {
+            status = (status == "ok") ? "new" : status;
+        }
+        if (status != "ok" && status != "new") failures++;
+        std::printf("%-30s %7lu %9.2f %8lu %7.2f %10s  %s\n", row.name.c_str(), (unsigned long)row.large.bytes, row.large.ns_per_byte,
+            (unsigned long)row.large.allocations, row.growth(), reference, status.c_str());
+    }
+
+    if (output_path != NULL) writeBaseline(output_path, rows);
+    if (failures > 0) {
+        std::printf("%d rows regressed (threshold %.2f, max growth %.2f)\n", failures, threshold, max_growth);
+        return 1;
+    }
+    return 0;
+}
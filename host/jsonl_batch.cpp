@@ -0,0 +1,302 @@
+/* JSONL batch processor
+ * Host tool validating and analyzing archived device commands and responses, one JSON message per line, with the
+ * lexer, parser and command registry of the firmware. The file is memory-mapped and cut in blocks; lines belong to the
+ * block holding their first byte. Each thread takes blocks from its own range and steals from the end of the others
+ * when it is done, then the statistics of every thread are merged.
+ *
+ * Requests are checked by a dry-run dispatch (see Command::CommandContext::isDryRun): unknown codes and missing fields
+ * are reported like the firmware would, without calling handlers. Other objects are responses.
+ *
+ * g++ -std=gnu++14 -O2 -pthread -Ihost -I. host/jsonl_batch.cpp $(ls *.cpp | grep -v -e main.cpp -e heap_guard.cpp) -o jsonl_batch
+ * ./jsonl_batch [-j threads] commands.jsonl
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "mbed.h"
+#include "json_parser.hpp"
+#include "logger.hpp"
+#include "command_registry.hpp"
+#include "device_commands.hpp"
+#include "led_controller.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if NO_HEAP
+#error "The batch processor builds JSONValue trees, build it without no-heap."
+#endif
+
+// Bytes of the file in a block, the unit of work shared between threads.
+#define BATCH_BLOCK_SIZE (256 * 1024)
+
+// Error messages and commands listed in the report, most frequent first.
+#define BATCH_MAX_REPORTED_ENTRIES 10
+
+// Without sink, frames of the parser are dropped before formatting and without lock.
+Log::Logger logger;
+PwmOut led(LED1);
+Led::LedController led_controller(&led);
+Log::RamLogSink crash_log(Log::LogFrameType::RELEASE);
+Command::CommandRegistry registry;
+
+namespace {
+    // Blocks left to a thread. Begin and end are packed in one word, the owner takes from the begin and thieves from the end.
+    class BlockRange {
+        std::atomic<uint64_t> range{0};
+    public:
+        void set(uint32_t begin, uint32_t end) {
+            this->range.store(((uint64_t)begin << 32) | end);
+        }
+
+        bool takeFront(uint32_t *block) {
+            uint64_t current = this->range.load();
+            while (true) {
+                uint32_t begin = current >> 32, end = (uint32_t)current;
+                if (begin >= end) return false;
+                if (this->range.compare_exchange_weak(current, ((uint64_t)(begin + 1) << 32) | end)) {
+                    *block = begin;
+                    return true;
+                }
+            }
+        }
+
+        bool takeBack(uint32_t *block) {
+            uint64_t current = this->range.load();
+            while (true) {
+                uint32_t begin = current >> 32, end = (uint32_t)current;
+                if (begin >= end) return false;
+                if (this->range.compare_exchange_weak(current, ((uint64_t)begin << 32) | (end - 1))) {
+                    *block = end - 1;
+                    return true;
+                }
+            }
+        }
+    };
+
+    struct BatchStats {
+        uint64_t records = 0;
+        uint64_t bytes = 0;
+        uint64_t empty_lines = 0;
+        // Lines that are not a JSON object or array.
+        uint64_t invalid = 0;
+        uint64_t requests = 0;
+        // Requests the firmware would answer with an error.
+        uint64_t rejected = 0;
+        uint64_t responses = 0;
+        uint64_t error_responses = 0;
+        uint64_t arrays = 0;
+        uint64_t stolen_blocks = 0;
+        std::map<std::string, uint64_t> commands;
+        std::map<std::string, uint64_t> rejections;
+        std::map<std::string, uint64_t> errors;
+
+        void merge(const BatchStats& other) {
+            this->records += other.records;
+            this->bytes += other.bytes;
+            this->empty_lines += other.empty_lines;
+            this->invalid += other.invalid;
+            this->requests += other.requests;
+            this->rejected += other.rejected;
+            this->responses += other.responses;
+            this->error_responses += other.error_responses;
+            this->arrays += other.arrays;
+            this->stolen_blocks += other.stolen_blocks;
+            for (const auto& entry: other.commands) this->commands[entry.first] += entry.second;
+            for (const auto& entry: other.rejections) this->rejections[entry.first] += entry.second;
+            for (const auto& entry: other.errors) this->errors[entry.first] += entry.second;
+        }
+    };
+
+    char *file_data = NULL;
+    size_t file_size = 0;
+    uint32_t block_count = 0;
+    std::vector<BlockRange> ranges;
+    std::vector<BatchStats> thread_stats;
+
+    // Value of a string member of the response map, empty if missing.
+    std::string getErrorMessage(Command::JSONMap *map) {
+        Command::JSONMap::iterator err = map->find("err");
+        if (err == map->end() || !err->second.isString()) return std::string();
+        return err->second.getString();
+    }
+
+    void processRecord(char *line, size_t length, BatchStats *stats) {
+        while (length > 0 && (line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t')) length--;
+        if (length == 0) {
+            stats->empty_lines++;
+            return;
+        }
+        stats->records++;
+        stats->bytes += length;
+
+        JSONLexer::LexerResult lexed = JSONLexer::LexBuffer(line, (int)length);
+        if (!lexed.isLastTokenFinishLexing) {
+            stats->invalid++;
+            return;
+        }
+        JSONParser::JSONValue value = JSONParser::JSONValue::Deserialize(&lexed.tokens);
+        if (value.isArray()) {
+            stats->arrays++;
+            return;
+        }
+        if (!value.isMap()) {
+            stats->invalid++;
+            return;
+        }
+
+        Command::CommandContext context;
+        Command::JSONMap response;
+        context.response = &response;
+        context.request = Command::RequestValue(&value);
+        context.isDryRun = true;
+        registry.dispatch(&context);
+        if (context.command != NULL || context.hasError) {
+            stats->requests++;
+            stats->commands[(context.command != NULL) ? context.command : "Unknown code"]++;
+            if (context.hasError) {
+                stats->rejected++;
+                stats->rejections[getErrorMessage(&response)]++;
+            }
+            return;
+        }
+
+        stats->responses++;
+        std::string error = getErrorMessage(value.getMap());
+        if (!error.empty()) {
+            stats->error_responses++;
+            stats->errors[error]++;
+        }
+    }
+
+    // Process the lines starting in a block, the last one may end in the next block.
+    void processBlock(uint32_t block, BatchStats *stats) {
+        size_t start = (size_t)block * BATCH_BLOCK_SIZE;
+        size_t end = std::min(start + BATCH_BLOCK_SIZE, file_size);
+        // A line started in the previous block belongs to it.
+        if (start > 0 && file_data[start - 1] != '\n') {
+            char *next = (char*)std::memchr(file_data + start, '\n', file_size - start);
+            start = (next == NULL) ? file_size : (size_t)(next - file_data) + 1;
+        }
+        while (start < end) {
+            char *newline = (char*)std::memchr(file_data + start, '\n', file_size - start);
+            size_t line_end = (newline == NULL) ? file_size : (size_t)(newline - file_data);
+            processRecord(file_data + start, line_end - start, stats);
+            start = line_end + 1;
+        }
+    }
+
+    void worker(size_t index) {
+        BatchStats *stats = &thread_stats[index];
+        uint32_t block;
+        while (ranges[index].takeFront(&block)) processBlock(block, stats);
+        // Own blocks are done, help the others from the end of their range.
+        bool isStealing = true;
+        while (isStealing) {
+            isStealing = false;
+            for (size_t i = 1; i < ranges.size(); i++) {
+                if (ranges[(index + i) % ranges.size()].takeBack(&block)) {
+                    stats->stolen_blocks++;
+                    processBlock(block, stats);
+                    isStealing = true;
+                }
+            }
+        }
+    }
+
+    void printTop(const std::map<std::string, uint64_t>& counts, uint64_t total) {
+        std::vector<std::pair<uint64_t, std::string>> sorted;
+        for (const auto& entry: counts) sorted.push_back(std::make_pair(entry.second, entry.first));
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<uint64_t, std::string>& a, const std::pair<uint64_t, std::string>& b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+        for (size_t i = 0; i < sorted.size() && i < BATCH_MAX_REPORTED_ENTRIES; i++)
+            std::printf("  %10llu  %5.1f%%  %s\n", (unsigned long long)sorted[i].first, total > 0 ? 100.0 * sorted[i].first / total : 0.0, sorted[i].second.c_str());
+        if (sorted.size() > BATCH_MAX_REPORTED_ENTRIES) std::printf("  ... %lu more\n", (unsigned long)(sorted.size() - BATCH_MAX_REPORTED_ENTRIES));
+    }
+
+    double percent(uint64_t count, uint64_t total) {
+        return total > 0 ? 100.0 * count / total : 0.0;
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) thread_count = std::max(1, std::atoi(argv[++i]));
+        else path = argv[i];
+    }
+    if (path == NULL) {
+        std::fprintf(stderr, "Usage: %s [-j threads] file.jsonl\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        std::fprintf(stderr, "Can't open %s!\n", path);
+        return 2;
+    }
+    file_size = file_stat.st_size;
+    if (file_size > 0) {
+        // Private writable mapping, the lexer takes a mutable buffer.
+        void *mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            std::fprintf(stderr, "Can't map %s!\n", path);
+            return 2;
+        }
+        file_data = static_cast<char*>(mapping);
+        madvise(file_data, file_size, MADV_SEQUENTIAL);
+    }
+
+    DeviceCommands::registerAll(&registry, &led_controller, &crash_log);
+
+    // Contiguous blocks per thread so that each one reads the file sequentially until it steals.
+    block_count = (uint32_t)((file_size + BATCH_BLOCK_SIZE - 1) / BATCH_BLOCK_SIZE);
+    thread_count = std::min<size_t>(thread_count, std::max<uint32_t>(block_count, 1));
+    ranges = std::vector<BlockRange>(thread_count);
+    thread_stats.resize(thread_count);
+    for (size_t i = 0; i < thread_count; i++)
+        ranges[i].set((uint32_t)(block_count * i / thread_count), (uint32_t)(block_count * (i + 1) / thread_count));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; i++) threads.push_back(std::thread(worker, i));
+    for (std::thread& thread: threads) thread.join();
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1e6;
+    if (seconds <= 0.0) seconds = 1e-6;
+
+    BatchStats total;
+    for (const BatchStats& stats: thread_stats) total.merge(stats);
+
+    std::printf("%llu records, %.1f MB in %.3f s with %lu threads: %.0f records/s, %.1f MB/s, %llu blocks stolen\n",
+        (unsigned long long)total.records, file_size / 1e6, seconds, (unsigned long)thread_count, total.records / seconds,
+        file_size / 1e6 / seconds, (unsigned long long)total.stolen_blocks);
+    std::printf("Invalid records: %llu (%.2f%%), empty lines: %llu, arrays: %llu\n",
+        (unsigned long long)total.invalid, percent(total.invalid, total.records), (unsigned long long)total.empty_lines, (unsigned long long)total.arrays);
+    std::printf("Requests: %llu (%.2f%%), rejected: %llu (%.2f%%)\n", (unsigned long long)total.requests, percent(total.requests, total.records),
+        (unsigned long long)total.rejected, percent(total.rejected, total.requests));
+    printTop(total.commands, total.requests);
+    if (!total.rejections.empty()) {
+        std::printf("Rejections:\n");
+        printTop(total.rejections, total.rejected);
+    }
+    std::printf("Responses: %llu (%.2f%%), with error: %llu (%.2f%%)\n", (unsigned long long)total.responses, percent(total.responses, total.records),
+        (unsigned long long)total.error_responses, percent(total.error_responses, total.responses));
+    printTop(total.errors, total.error_responses);
+
+    if (file_data != NULL) munmap(file_data, file_size);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,636 @@
+/* Host port of the Mbed OS API
+ * Implements the subset of Mbed OS used by this project on top of the C++ standard library so that the
+ * firmware sources can be built and run on a computer. Add "-Ihost" before any Mbed OS include path.
+ *
+ * BufferedSerial reads stdin and writes stdout, PwmOut only stores its duty cycle, Ticker and Thread run on
+ * std::thread and critical sections are emulated with a global recursive mutex also held by Ticker callbacks.
+ * Stack high-water marks are measured on a window painted below the entry of main() and of each Thread.
+ * The serial can record its traffic to a trace or replay one instead of stdin, see serial_trace.h. Only the first serial
+ * reads stdin and records, the others read nothing unless they replay, so that EC_CHANNELS=<n> runs n channels in parallel.
+ * CPU stats simulate a single core: its busy time is the CPU time of the process, idle time the rest of the uptime.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serial_trace.h"
+
+using namespace std::chrono_literals;
+
+#define MBED_ASSERT(expr) assert(expr)
+
+#define LED1 0
+#define USBTX 1
+#define USBRX 2
+typedef int PinName;
+
+typedef int32_t osStatus;
+#define osOK 0
+#define osErrorResource -3
+
+typedef int osPriority;
+#define osPriorityLow 8
+#define osPriorityBelowNormal 16
+#define osPriorityNormal 24
+#define osPriorityAboveNormal 32
+#define osPriorityHigh 40
+#define osPriorityRealtime 48
+
+#ifndef OS_STACK_SIZE
+#define OS_STACK_SIZE 4096
+#endif
+
+// Core clock reported on host, only used to convert cycles.
+#define SystemCoreClock 100000000U
+
+namespace mbed_host {
+    // Lock emulating interrupts masking.
+    inline std::recursive_mutex& criticalSectionMutex() {
+        static std::recursive_mutex mutex;
+        return mutex;
+    }
+
+    // Epoch of the host clocks, first use of any clock.
+    inline std::chrono::steady_clock::time_point epoch() {
+        static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        return start;
+    }
+
+    // Depth of shim code allocating where Mbed OS does not (std::function, std::thread), these allocations are not checked by HeapGuard.
+    inline int& shimAllocationDepth() {
+        static thread_local int depth = 0;
+        return depth;
+    }
+    struct ShimAllocation {
+        ShimAllocation() { shimAllocationDepth()++; }
+        ~ShimAllocation() { shimAllocationDepth()--; }
+    };
+
+    // Bytes of stack painted below the entry of a thread to measure its high-water mark. Host frames are larger than on the board.
+    #define HOST_STACK_WINDOW_SIZE 65536
+    #define HOST_STACK_FILL 0xA5
+
+    // Painted stack window of a thread, also used as its identifier.
+    struct ThreadStack {
+        std::atomic<uintptr_t> low{0};
+    };
+
+    // Fill the stack below the caller with a pattern, bytes still holding it at the bottom of the window were never used.
+    __attribute__((noinline)) inline void paintStack(ThreadStack *stack) {
+        volatile unsigned char window[HOST_STACK_WINDOW_SIZE];
+        for (size_t i = 0; i < HOST_STACK_WINDOW_SIZE; i++) window[i] = HOST_STACK_FILL;
+        stack->low.store(reinterpret_cast<uintptr_t>(window));
+    }
+
+    // Stack of the calling thread, NULL for shim threads (Ticker).
+    inline ThreadStack*& currentThreadStack() {
+        static thread_local ThreadStack *stack = nullptr;
+        return stack;
+    }
+
+    // Stack of the main thread, painted by the static initialization before main() starts.
+    inline ThreadStack* mainThreadStack() {
+        static ThreadStack stack;
+        static bool isPainted = (paintStack(&stack), currentThreadStack() = &stack, true);
+        (void)isPainted;
+        return &stack;
+    }
+    static ThreadStack* const main_thread_stack = mainThreadStack();
+
+    // Number of command channels run by the host build, set by EC_CHANNELS. The first one is the debug channel on stdin.
+    inline int getChannelCount() {
+        const char *count = std::getenv("EC_CHANNELS");
+        int channels = (count != nullptr) ? std::atoi(count) : 1;
+        return (channels > 0) ? channels : 1;
+    }
+
+    // Serials created so far, the index of a serial is the number created before it.
+    inline std::atomic<int>& serialCount() {
+        static std::atomic<int> count(0);
+        return count;
+    }
+}
+
+typedef mbed_host::ThreadStack* osThreadId_t;
+
+// Stack size of a thread, the painted window on host.
+inline uint32_t osThreadGetStackSize(osThreadId_t thread_id) {
+    return (thread_id != nullptr && thread_id->low.load() != 0) ? HOST_STACK_WINDOW_SIZE : 0;
+}
+
+// Stack never used by a thread since its start.
+inline uint32_t osThreadGetStackSpace(osThreadId_t thread_id) {
+    uintptr_t low = (thread_id != nullptr) ? thread_id->low.load() : 0;
+    if (low == 0) return 0;
+    const volatile unsigned char *window = reinterpret_cast<const volatile unsigned char*>(low);
+    uint32_t space = 0;
+    while (space < HOST_STACK_WINDOW_SIZE && window[space] == HOST_STACK_FILL) space++;
+    return space;
+}
+
+// Host threads are not prioritized, every thread reports the default priority.
+inline osPriority osThreadGetPriority(osThreadId_t thread_id) {
+    return osPriorityNormal;
+}
+
+// Times in microseconds, like mbed_stats_cpu_t.
+struct mbed_stats_cpu_t {
+    uint64_t uptime;
+    uint64_t idle_time;
+    uint64_t sleep_time;
+    uint64_t deep_sleep_time;
+};
+
+// Uptime since the first use of a clock, idle time is the part of it not used by the process on a simulated single core.
+inline void mbed_stats_cpu_get(mbed_stats_cpu_t *stats) {
+    uint64_t uptime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mbed_host::epoch()).count();
+    struct timespec cpu_time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_time);
+    uint64_t busy = (uint64_t)cpu_time.tv_sec * 1000000 + cpu_time.tv_nsec / 1000;
+    stats->uptime = uptime;
+    stats->idle_time = (uptime > busy) ? uptime - busy : 0;
+    stats->sleep_time = stats->idle_time;
+    stats->deep_sleep_time = 0;
+}
+
+inline void core_util_critical_section_enter() {
+    mbed_host::criticalSectionMutex().lock();
+}
+inline void core_util_critical_section_exit() {
+    mbed_host::criticalSectionMutex().unlock();
+}
+
+namespace rtos {
+    namespace Kernel {
+        // Kernel clock, milliseconds since start.
+        struct Clock {
+            typedef std::chrono::duration<uint64_t, std::milli> duration;
+            typedef duration::rep rep;
+            typedef duration::period period;
+            typedef std::chrono::time_point<Clock, duration> time_point;
+            typedef std::chrono::duration<uint32_t, std::milli> duration_u32;
+            static const bool is_steady = true;
+
+            static time_point now() {
+                return time_point(std::chrono::duration_cast<duration>(std::chrono::steady_clock::now() - mbed_host::epoch()));
+            }
+        };
+        constexpr Clock::duration_u32 wait_for_u32_forever{UINT32_MAX};
+    }
+}
+
+namespace mbed {
+    template<typename F> class Callback;
+
+    // Callback over std::function, the target is copied like in Mbed OS. Mbed OS stores it inline, so its allocations are not checked.
+    template<typename R, typename... Args>
+    class Callback<R(Args...)> {
+        std::function<R(Args...)> function;
+    public:
+        Callback() {}
+        Callback(std::nullptr_t) {}
+        Callback(R (*f)(Args...)): function(f) {}
+        template<typename T, typename U>
+        Callback(U *obj, R (T::*method)(Args...)) {
+            mbed_host::ShimAllocation shim;
+            this->function = [obj, method](Args... args) { return (obj->*method)(args...); };
+        }
+        template<typename F, typename = typename std::enable_if<!std::is_pointer<F>::value && !std::is_same<typename std::decay<F>::type, Callback>::value>::type>
+        Callback(F f) {
+            mbed_host::ShimAllocation shim;
+            this->function = f;
+        }
+        Callback(const Callback& other) {
+            mbed_host::ShimAllocation shim;
+            this->function = other.function;
+        }
+        Callback& operator=(const Callback& other) {
+            mbed_host::ShimAllocation shim;
+            this->function = other.function;
+            return *this;
+        }
+        ~Callback() {
+            mbed_host::ShimAllocation shim;
+            this->function = nullptr;
+        }
+
+        R call(Args... args) const {
+            return this->function(args...);
+        }
+        R operator()(Args... args) const {
+            return this->function(args...);
+        }
+        explicit operator bool() const {
+            return static_cast<bool>(this->function);
+        }
+    };
+
+    template<typename R, typename... Args>
+    Callback<R(Args...)> callback(R (*f)(Args...)) {
+        return Callback<R(Args...)>(f);
+    }
+    template<typename T, typename U, typename R, typename... Args>
+    Callback<R(Args...)> callback(U *obj, R (T::*method)(Args...)) {
+        return Callback<R(Args...)>(obj, method);
+    }
+    template<typename R, typename... Args>
+    Callback<R(Args...)> callback(const Callback<R(Args...)> &cb) {
+        return cb;
+    }
+
+    // Microseconds clock.
+    struct HighResClock {
+        typedef std::chrono::microseconds duration;
+        typedef duration::rep rep;
+        typedef duration::period period;
+        typedef std::chrono::time_point<HighResClock, duration> time_point;
+        static const bool is_steady = true;
+
+        static time_point now() {
+            return time_point(std::chrono::duration_cast<duration>(std::chrono::steady_clock::now() - mbed_host::epoch()));
+        }
+    };
+
+    class FileHandle {
+    public:
+        virtual ~FileHandle() {}
+    };
+
+    // Serial over file descriptors, stdin and stdout by default.
+    class BufferedSerial : public FileHandle {
+        int read_fd = STDIN_FILENO;
+        int write_fd = STDOUT_FILENO;
+        bool blocking = true;
+        // Serial trace recorded or replayed in place of stdin, see serial_trace.h.
+        std::unique_ptr<mbed_host::SerialTrace::Recorder> recorder;
+        std::unique_ptr<mbed_host::SerialTrace::Replayer> replayer;
+
+        ssize_t readInput(void *buffer, size_t length) {
+            if (this->replayer) return this->replayer->read(buffer, length, this->blocking);
+            if (this->read_fd < 0) {
+                // Serial without input, idle like stdin at its end.
+                if (this->blocking) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                return -EAGAIN;
+            }
+            if (!this->blocking) {
+                struct pollfd fd = {this->read_fd, POLLIN, 0};
+                if (poll(&fd, 1, 0) <= 0) return -EAGAIN;
+            }
+            ssize_t count = ::read(this->read_fd, buffer, length);
+            // End of input behaves like a silent line.
+            if (count == 0) {
+                if (this->blocking) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                return -EAGAIN;
+            }
+            return count < 0 ? -errno : count;
+        }
+    public:
+        BufferedSerial(PinName tx, PinName rx, int baud = 9600) {
+            int index = mbed_host::serialCount()++;
+            const char *replay_path = std::getenv("EC_SERIAL_REPLAY");
+            const char *fast = std::getenv("EC_SERIAL_REPLAY_FAST");
+            const char *record_path = std::getenv("EC_SERIAL_RECORD");
+            // Every serial replays the same trace on its own, only the first one reads stdin and records.
+            if (replay_path != nullptr) this->replayer.reset(new mbed_host::SerialTrace::Replayer(replay_path, fast != nullptr && std::strcmp(fast, "0") != 0, index));
+            if (index > 0) this->read_fd = -1;
+            else if (record_path != nullptr) this->recorder.reset(new mbed_host::SerialTrace::Recorder(record_path));
+        }
+
+        // Host only: replace the file descriptors used by the serial.
+        void setHostFileDescriptors(int read_fd, int write_fd) {
+            this->read_fd = read_fd;
+            this->write_fd = write_fd;
+        }
+
+        ssize_t read(void *buffer, size_t length) {
+            // Traces are bookkeeping of the shim, their allocations are not checked.
+            mbed_host::ShimAllocation shim;
+            ssize_t count = this->readInput(buffer, length);
+            if (this->recorder) {
+                // Only empty non-blocking reads close a message, blocking ones are retried by the receive loop.
+                if (count > 0) this->recorder->record(mbed_host::SerialTrace::RecordType::READ, buffer, count);
+                else if (count == -EAGAIN && !this->blocking) this->recorder->record(mbed_host::SerialTrace::RecordType::EMPTY_READ, nullptr, 0);
+            }
+            return count;
+        }
+        ssize_t write(const void *buffer, size_t length) {
+            mbed_host::ShimAllocation shim;
+            if (this->recorder) this->recorder->record(mbed_host::SerialTrace::RecordType::WRITE, buffer, length);
+            if (this->replayer) this->replayer->write(buffer, length);
+            ssize_t count = ::write(this->write_fd, buffer, length);
+            return count < 0 ? -errno : count;
+        }
+        bool readable() {
+            if (this->replayer) return this->replayer->readable();
+            struct pollfd fd = {this->read_fd, POLLIN, 0};
+            return poll(&fd, 1, 0) > 0;
+        }
+        bool writable() {
+            return true;
+        }
+        int set_blocking(bool blocking) {
+            this->blocking = blocking;
+            return 0;
+        }
+        bool is_blocking() const {
+            return this->blocking;
+        }
+        void set_baud(int baud) {}
+    };
+
+    // PWM output only keeping its duty cycle.
+    class PwmOut {
+        float duty = 0.0f;
+    public:
+        PwmOut(PinName pin) {}
+        void write(float value) {
+            this->duty = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+        }
+        float read() {
+            return this->duty;
+        }
+        void period_us(int us) {}
+    };
+
+    // Periodic callback on a dedicated thread, called inside a critical section like an interrupt.
+    class Ticker {
+        struct State {
+            std::mutex mutex;
+            std::condition_variable condition;
+            bool running = true;
+        };
+        std::shared_ptr<State> state;
+        std::thread worker;
+    public:
+        Ticker() {}
+        ~Ticker() {
+            this->detach();
+        }
+
+        void attach(Callback<void()> func, std::chrono::microseconds period) {
+            this->detach();
+            mbed_host::ShimAllocation shim;
+            std::shared_ptr<State> state = std::make_shared<State>();
+            this->state = state;
+            this->worker = std::thread([state, func, period]() {
+                // Only the callback runs firmware code, the rest of the thread belongs to the shim, its release included.
+                mbed_host::shimAllocationDepth()++;
+                std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now() + period;
+                std::unique_lock<std::mutex> lock(state->mutex);
+                while (!state->condition.wait_until(lock, next, [&state]() { return !state->running; })) {
+                    lock.unlock();
+                    core_util_critical_section_enter();
+                    mbed_host::shimAllocationDepth()--;
+                    func();
+                    mbed_host::shimAllocationDepth()++;
+                    core_util_critical_section_exit();
+                    lock.lock();
+                    next += period;
+                }
+            });
+        }
+        void detach() {
+            if (!this->state) return;
+            mbed_host::ShimAllocation shim;
+            {
+                std::lock_guard<std::mutex> lock(this->state->mutex);
+                this->state->running = false;
+            }
+            this->state->condition.notify_all();
+            // Detaching from the callback itself can't join its own thread.
+            if (this->worker.get_id() == std::this_thread::get_id())
+                this->worker.detach();
+            else if (this->worker.joinable())
+                this->worker.join();
+            this->state.reset();
+        }
+    };
+
+    class Timer {
+        std::chrono::steady_clock::time_point start_time;
+        std::chrono::microseconds accumulated{0};
+        bool running = false;
+    public:
+        void start() {
+            if (this->running) return;
+            this->start_time = std::chrono::steady_clock::now();
+            this->running = true;
+        }
+        void stop() {
+            if (!this->running) return;
+            this->accumulated += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->start_time);
+            this->running = false;
+        }
+        void reset() {
+            this->accumulated = std::chrono::microseconds(0);
+            this->start_time = std::chrono::steady_clock::now();
+        }
+        std::chrono::microseconds elapsed_time() const {
+            if (!this->running) return this->accumulated;
+            return this->accumulated + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - this->start_time);
+        }
+    };
+}
+
+namespace rtos {
+    // Recursive like Mbed OS mutexes.
+    class Mutex {
+        std::recursive_mutex mutex;
+    public:
+        void lock() {
+            this->mutex.lock();
+        }
+        bool trylock() {
+            return this->mutex.try_lock();
+        }
+        void unlock() {
+            this->mutex.unlock();
+        }
+    };
+
+    class Semaphore {
+        std::mutex mutex;
+        std::condition_variable condition;
+        int32_t count;
+        int32_t max_count;
+    public:
+        Semaphore(int32_t count = 0, uint16_t max_count = 0xFFFF): count(count), max_count(max_count) {}
+
+        void acquire() {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->condition.wait(lock, [this]() { return this->count > 0; });
+            this->count--;
+        }
+        bool try_acquire() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->count <= 0) return false;
+            this->count--;
+            return true;
+        }
+        bool try_acquire_for(Kernel::Clock::duration_u32 rel_time) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            if (!this->condition.wait_for(lock, rel_time, [this]() { return this->count > 0; })) return false;
+            this->count--;
+            return true;
+        }
+        osStatus release() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->count >= this->max_count) return osErrorResource;
+            this->count++;
+            this->condition.notify_one();
+            return osOK;
+        }
+    };
+
+    // Thread on std::thread. Stack parameters are only kept for reporting.
+    class Thread {
+        std::thread worker;
+        uint32_t stack_bytes;
+        const char *name;
+        mbed_host::ThreadStack stack;
+    public:
+        Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = OS_STACK_SIZE, unsigned char *stack_mem = nullptr, const char *name = nullptr): stack_bytes(stack_size), name(name) {}
+        ~Thread() {
+            // Threads of the firmware run forever, let them end with the process.
+            if (this->worker.joinable()) this->worker.detach();
+        }
+
+        osStatus start(mbed::Callback<void()> task) {
+            mbed_host::ShimAllocation shim;
+            mbed_host::ThreadStack *stack = &this->stack;
+            this->worker = std::thread([task, stack]() {
+                mbed_host::currentThreadStack() = stack;
+                mbed_host::paintStack(stack);
+                task();
+            });
+            return osOK;
+        }
+        osStatus join() {
+            if (this->worker.joinable()) this->worker.join();
+            return osOK;
+        }
+        osStatus set_priority(osPriority priority) {
+            return osOK;
+        }
+        uint32_t stack_size() const {
+            return this->stack_bytes;
+        }
+        const char *get_name() const {
+            return this->name;
+        }
+        osThreadId_t get_id() const {
+            return const_cast<mbed_host::ThreadStack*>(&this->stack);
+        }
+    };
+
+    namespace ThisThread {
+        inline void sleep_for(Kernel::Clock::duration_u32 rel_time) {
+            if (mbed_host::isSleepSkipped()) return;
+            std::this_thread::sleep_for(rel_time);
+        }
+        inline void yield() {
+            std::this_thread::yield();
+        }
+        inline osThreadId_t get_id() {
+            return mbed_host::currentThreadStack();
+        }
+    }
+
+    // Fixed size pool of T with a FIFO of allocated blocks, T is not constructed like in Mbed OS.
+    template<typename T, uint32_t queue_sz>
+    class Mail {
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type pool[queue_sz];
+        T *free_blocks[queue_sz];
+        uint32_t free_count = queue_sz;
+        T *fifo[queue_sz];
+        uint32_t fifo_head = 0;
+        uint32_t fifo_count = 0;
+        std::mutex mutex;
+        std::condition_variable condition;
+    public:
+        Mail() {
+            for (uint32_t i = 0; i < queue_sz; i++) this->free_blocks[i] = reinterpret_cast<T*>(&this->pool[i]);
+        }
+
+        T *try_alloc() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->free_count == 0) return nullptr;
+            return this->free_blocks[--this->free_count];
+        }
+        T *try_alloc_for(Kernel::Clock::duration_u32 rel_time) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            if (!this->condition.wait_for(lock, rel_time, [this]() { return this->free_count > 0; })) return nullptr;
+            return this->free_blocks[--this->free_count];
+        }
+        T *try_calloc() {
+            T *mail = this->try_alloc();
+            if (mail != nullptr) std::memset(static_cast<void*>(mail), 0, sizeof(T));
+            return mail;
+        }
+        osStatus put(T *mail) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->fifo[(this->fifo_head + this->fifo_count) % queue_sz] = mail;
+            this->fifo_count++;
+            this->condition.notify_all();
+            return osOK;
+        }
+        T *try_get() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->fifo_count == 0) return nullptr;
+            T *mail = this->fifo[this->fifo_head];
+            this->fifo_head = (this->fifo_head + 1) % queue_sz;
+            this->fifo_count--;
+            return mail;
+        }
+        T *try_get_for(Kernel::Clock::duration_u32 rel_time) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            auto ready = [this]() { return this->fifo_count > 0; };
+            if (rel_time == Kernel::wait_for_u32_forever) this->condition.wait(lock, ready);
+            else if (!this->condition.wait_for(lock, rel_time, ready)) return nullptr;
+            T *mail = this->fifo[this->fifo_head];
+            this->fifo_head = (this->fifo_head + 1) % queue_sz;
+            this->fifo_count--;
+            return mail;
+        }
+        osStatus free(T *mail) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->free_blocks[this->free_count++] = mail;
+            this->condition.notify_all();
+            return osOK;
+        }
+        bool empty() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->fifo_count == 0;
+        }
+        bool full() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->free_count == 0;
+        }
+        uint32_t count() {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->fifo_count;
+        }
+    };
+}
+
+using namespace mbed;
+using namespace rtos;
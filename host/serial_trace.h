@@ -0,0 +1,365 @@
+/* Serial traces of the host build
+ * Records every chunk returned by BufferedSerial::read, exactly as it was split, and every write into a compact binary
+ * trace, and replays a trace in place of stdin through the same receive loop. Selected with environment variables read by
+ * BufferedSerial: EC_SERIAL_RECORD=<file> records, EC_SERIAL_REPLAY=<file> replays at the recorded pace, or as fast as the
+ * firmware reads with EC_SERIAL_REPLAY_FAST=1. A replay ends with a report on stderr: throughput, response latencies and
+ * responses that differ from the recording. With several channels, each one replays the trace on its own serial and the
+ * process ends once every replay is reported, with the total throughput. The process exits with 1 if any differs.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Responses printed by the replay report when they differ from the recording.
+#define SERIAL_TRACE_MAX_SHOWN_DIFFERENCES 5
+
+// Silence after the last write, once the trace is over, before the replay is reported.
+#define SERIAL_TRACE_END_SILENCE_MS 1000
+
+namespace mbed_host {
+    // Set on the thread reading a fast replay: its sleeps return at once, messages are delimited by the recorded empty reads.
+    inline bool& isSleepSkipped() {
+        static thread_local bool isSkipped = false;
+        return isSkipped;
+    }
+
+    namespace SerialTrace {
+        // A trace starts with the magic, followed by records: type, microseconds since the previous record and, except for
+        // empty reads, length and bytes. Integers are unsigned LEB128.
+        static const char MAGIC[] = "ECST1";
+
+        enum RecordType : uint8_t {
+            // Bytes returned by a read.
+            READ = 'R',
+            // Non-blocking read without data, closes a message in the receive loop.
+            EMPTY_READ = 'E',
+            // Bytes written.
+            WRITE = 'W',
+        };
+
+        struct Record {
+            RecordType type;
+            // Microseconds since the start of the trace.
+            uint64_t time_us;
+            std::string data;
+        };
+
+        // Replays of every channel, reported together once the last one is over.
+        struct ReplayTotals {
+            std::mutex mutex;
+            size_t replays = 0;
+            size_t active = 0;
+            bool isFailed = false;
+            uint64_t bytes_in = 0;
+            uint64_t responses = 0;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::time_point::max();
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::time_point::min();
+        };
+        inline ReplayTotals& replayTotals() {
+            static ReplayTotals totals;
+            return totals;
+        }
+
+        class Recorder {
+            FILE *file;
+            std::mutex mutex;
+            std::chrono::steady_clock::time_point last;
+
+            void writeVarint(uint64_t value) {
+                do {
+                    uint8_t byte = value & 0x7F;
+                    value >>= 7;
+                    if (value != 0) byte |= 0x80;
+                    std::fputc(byte, this->file);
+                } while (value != 0);
+            }
+        public:
+            /** Constructor of Recorder.
+            *
+            * @param path trace file, overwritten.
+            */
+            Recorder(const char *path): file(std::fopen(path, "wb")), last(std::chrono::steady_clock::now()) {
+                if (this->file == NULL) {
+                    std::fprintf(stderr, "Can't create serial trace %s!\n", path);
+                    std::exit(1);
+                }
+                std::fwrite(MAGIC, 1, sizeof(MAGIC) - 1, this->file);
+            }
+            ~Recorder() {
+                std::fclose(this->file);
+            }
+
+            // Append a record. Flushed at once, the firmware never ends by itself.
+            void record(RecordType type, const void *data, size_t length) {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                std::fputc(type, this->file);
+                this->writeVarint(std::chrono::duration_cast<std::chrono::microseconds>(now - this->last).count());
+                if (type != RecordType::EMPTY_READ) {
+                    this->writeVarint(length);
+                    std::fwrite(data, 1, length, this->file);
+                }
+                std::fflush(this->file);
+                this->last = now;
+            }
+        };
+
+        class Replayer {
+            // Read records, empty ones included, and the time each one was replayed.
+            std::vector<Record> reads;
+            std::vector<std::chrono::steady_clock::time_point> read_times;
+            size_t next_read = 0;
+            // Bytes of the next read already returned, when the caller buffer was smaller than the chunk.
+            size_t read_offset = 0;
+            bool isFast;
+            // Index of the serial replaying the trace, shown in the report.
+            int index;
+            bool isStarted = false;
+            // Set once reported while other channels still replay, reads then return nothing.
+            bool isFinished = false;
+            std::chrono::steady_clock::time_point start;
+
+            // Recorded responses split in lines, with the index of the last read before each one.
+            std::vector<std::string> expected_lines;
+            std::vector<size_t> expected_reads;
+
+            std::mutex mutex;
+            std::string line;
+            size_t line_count = 0;
+            size_t difference_count = 0;
+            std::vector<std::string> shown_differences;
+            std::vector<uint64_t> latencies_us;
+            uint64_t bytes_in = 0;
+            uint64_t bytes_out = 0;
+            std::chrono::steady_clock::time_point last_write;
+
+            static bool readVarint(FILE *file, uint64_t *value) {
+                *value = 0;
+                for (int shift = 0; shift < 64; shift += 7) {
+                    int byte = std::fgetc(file);
+                    if (byte == EOF) return false;
+                    *value |= (uint64_t)(byte & 0x7F) << shift;
+                    if ((byte & 0x80) == 0) return true;
+                }
+                return false;
+            }
+
+            static void trimLine(std::string *text) {
+                if (!text->empty() && text->back() == '\r') text->pop_back();
+            }
+
+            void load(const char *path) {
+                FILE *file = std::fopen(path, "rb");
+                char magic[sizeof(MAGIC) - 1];
+                if (file == NULL || std::fread(magic, 1, sizeof(magic), file) != sizeof(magic) || std::memcmp(magic, MAGIC, sizeof(magic)) != 0) {
+                    std::fprintf(stderr, "Can't read serial trace %s!\n", path);
+                    std::exit(1);
+                }
+                uint64_t time_us = 0;
+                size_t last_read = SIZE_MAX;
+                std::string text;
+                int type;
+                while ((type = std::fgetc(file)) != EOF) {
+                    Record record;
+                    uint64_t delta_us, length = 0;
+                    record.type = (RecordType)type;
+                    if (!readVarint(file, &delta_us) || (type != RecordType::EMPTY_READ && !readVarint(file, &length))) break;
+                    time_us += delta_us;
+                    record.time_us = time_us;
+                    record.data.resize(length);
+                    if (length > 0 && std::fread(&record.data[0], 1, length, file) != length) break;
+
+                    if (type == RecordType::WRITE) {
+                        for (char c : record.data) {
+                            if (c != '\n') {
+                                text += c;
+                                continue;
+                            }
+                            trimLine(&text);
+                            this->expected_lines.push_back(text);
+                            this->expected_reads.push_back(last_read);
+                            text.clear();
+                        }
+                    } else {
+                        if (type == RecordType::READ) last_read = this->reads.size();
+                        this->reads.push_back(record);
+                    }
+                }
+                std::fclose(file);
+                this->read_times.resize(this->reads.size());
+                this->latencies_us.reserve(this->expected_lines.size());
+            }
+
+            static uint64_t percentile(const std::vector<uint64_t>& sorted, size_t percent) {
+                if (sorted.empty()) return 0;
+                size_t rank = (sorted.size() * percent + 99) / 100;
+                return sorted[(rank > 0 ? rank : 1) - 1];
+            }
+
+            // Wait for the responses of the last messages and report the replay. The last replay over ends the process.
+            void finish() {
+                while (true) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    if (this->line_count >= this->expected_lines.size()) break;
+                    if (std::chrono::steady_clock::now() - this->last_write > std::chrono::milliseconds(SERIAL_TRACE_END_SILENCE_MS)) break;
+                }
+
+                ReplayTotals& totals = replayTotals();
+                std::lock_guard<std::mutex> totals_lock(totals.mutex);
+                std::lock_guard<std::mutex> lock(this->mutex);
+                double seconds = std::chrono::duration_cast<std::chrono::microseconds>(this->last_write - this->start).count() / 1e6;
+                if (seconds <= 0.0) seconds = 1e-6;
+                std::vector<uint64_t> sorted = this->latencies_us;
+                std::sort(sorted.begin(), sorted.end());
+                size_t missing = (this->line_count < this->expected_lines.size()) ? this->expected_lines.size() - this->line_count : 0;
+
+                std::fprintf(stderr, "Replay #%d (%s): %lu bytes read in %.3f s (%.1f KB/s), %lu bytes written, %lu responses (%.1f/s)\n",
+                    this->index, this->isFast ? "fast" : "recorded pace", (unsigned long)this->bytes_in, seconds, this->bytes_in / seconds / 1024.0,
+                    (unsigned long)this->bytes_out, (unsigned long)this->line_count, this->line_count / seconds);
+                std::fprintf(stderr, "Latency from request to response: n = %lu | p50 = %lu us | p90 = %lu us | p99 = %lu us | max = %lu us\n",
+                    (unsigned long)sorted.size(), (unsigned long)percentile(sorted, 50), (unsigned long)percentile(sorted, 90),
+                    (unsigned long)percentile(sorted, 99), (unsigned long)(sorted.empty() ? 0 : sorted.back()));
+                std::fprintf(stderr, "Differences: %lu of %lu recorded responses, %lu missing\n",
+                    (unsigned long)this->difference_count, (unsigned long)this->expected_lines.size(), (unsigned long)missing);
+                for (const std::string& difference : this->shown_differences) std::fprintf(stderr, "%s", difference.c_str());
+
+                totals.isFailed = totals.isFailed || this->difference_count > 0 || missing > 0;
+                totals.bytes_in += this->bytes_in;
+                totals.responses += this->line_count;
+                totals.start = std::min(totals.start, this->start);
+                totals.end = std::max(totals.end, this->last_write);
+                this->isFinished = true;
+                if (--totals.active > 0) return;
+                if (totals.replays > 1) {
+                    double total_seconds = std::chrono::duration_cast<std::chrono::microseconds>(totals.end - totals.start).count() / 1e6;
+                    if (total_seconds <= 0.0) total_seconds = 1e-6;
+                    std::fprintf(stderr, "All %lu replays: %lu bytes read in %.3f s (%.1f KB/s), %lu responses (%.1f/s)\n",
+                        (unsigned long)totals.replays, (unsigned long)totals.bytes_in, total_seconds, totals.bytes_in / total_seconds / 1024.0,
+                        (unsigned long)totals.responses, totals.responses / total_seconds);
+                }
+                std::fflush(stderr);
+                // Firmware threads never end, leave without running destructors under them.
+                std::_Exit(totals.isFailed ? 1 : 0);
+            }
+
+            // Compare a replayed response with the recording.
+            void checkLine(std::chrono::steady_clock::time_point now) {
+                trimLine(&this->line);
+                size_t index = this->line_count++;
+                if (index >= this->expected_lines.size() || this->line != this->expected_lines[index]) {
+                    this->difference_count++;
+                    if (this->shown_differences.size() < SERIAL_TRACE_MAX_SHOWN_DIFFERENCES) {
+                        const char *expected = (index < this->expected_lines.size()) ? this->expected_lines[index].c_str() : "(nothing)";
+                        char header[64];
+                        std::snprintf(header, sizeof(header), "  #%lu\n", (unsigned long)index);
+                        this->shown_differences.push_back(std::string(header) + "    expected: " + expected + "\n    got:      " + this->line + "\n");
+                    }
+                }
+                if (index < this->expected_reads.size()) {
+                    size_t read = this->expected_reads[index];
+                    if (read != SIZE_MAX && read < this->next_read)
+                        this->latencies_us.push_back(std::chrono::duration_cast<std::chrono::microseconds>(now - this->read_times[read]).count());
+                }
+                this->line.clear();
+            }
+        public:
+            /** Constructor of Replayer.
+            *
+            * @param path trace file.
+            * @param isFast ignore the recorded times and return each read as soon as it is requested.
+            * @param index index of the serial replaying the trace.
+            */
+            Replayer(const char *path, bool isFast, int index): isFast(isFast), index(index) {
+                this->load(path);
+                ReplayTotals& totals = replayTotals();
+                std::lock_guard<std::mutex> lock(totals.mutex);
+                totals.replays++;
+                totals.active++;
+            }
+
+            ssize_t read(void *buffer, size_t length, bool isBlocking) {
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                while (true) {
+                    // Position is only changed by the reading thread, under the lock for the writes checking latencies.
+                    std::unique_lock<std::mutex> lock(this->mutex);
+                    if (this->isFinished) {
+                        // Idle until the other channels are over.
+                        lock.unlock();
+                        if (isBlocking) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                        return -EAGAIN;
+                    }
+                    if (!this->isStarted) {
+                        this->isStarted = true;
+                        this->start = now;
+                        this->last_write = now;
+                        if (this->isFast) isSleepSkipped() = true;
+                    }
+                    if (this->next_read >= this->reads.size()) {
+                        // Let the receive loop close the last message, the next blocking read means it is idle.
+                        if (!isBlocking) return -EAGAIN;
+                        break;
+                    }
+                    const Record& record = this->reads[this->next_read];
+                    if (record.type == RecordType::EMPTY_READ) {
+                        this->next_read++;
+                        // At the recorded pace the gaps come from the times, a blocking read waits for the next data anyway.
+                        if (this->isFast && !isBlocking) return -EAGAIN;
+                        continue;
+                    }
+                    if (!this->isFast) {
+                        std::chrono::steady_clock::time_point due = this->start + std::chrono::microseconds(record.time_us - this->reads[0].time_us);
+                        if (now < due) {
+                            if (!isBlocking) return -EAGAIN;
+                            lock.unlock();
+                            std::this_thread::sleep_until(due);
+                            now = std::chrono::steady_clock::now();
+                            continue;
+                        }
+                    }
+                    size_t count = std::min(length, record.data.size() - this->read_offset);
+                    std::memcpy(buffer, record.data.data() + this->read_offset, count);
+                    if (this->read_offset == 0) this->read_times[this->next_read] = now;
+                    this->read_offset += count;
+                    if (this->read_offset == record.data.size()) {
+                        this->next_read++;
+                        this->read_offset = 0;
+                    }
+                    this->bytes_in += count;
+                    return count;
+                }
+                this->finish();
+                return -EAGAIN;
+            }
+
+            void write(const void *buffer, size_t length) {
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->bytes_out += length;
+                this->last_write = now;
+                const char *chars = static_cast<const char*>(buffer);
+                for (size_t i = 0; i < length; i++) {
+                    if (chars[i] == '\n') this->checkLine(now);
+                    else this->line += chars[i];
+                }
+            }
+
+            bool readable() {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                return this->next_read < this->reads.size();
+            }
+        };
+    }
+}
@@ -6,6 +6,7 @@
  */
 #include "json_parser.hpp"
 #include <algorithm>
+#include <cstring>
 #include <vector>
 
 JSONLexer::LexerResult JSONLexer::LexBuffer(char* buffer, int buffer_length) {
@@ -189,6 +190,42 @@ end_of_loop:
     };
 }
 
+JSONLexer::ChunkLexer::ChunkLexer(char *buffer, size_t capacity): buffer(buffer), capacity(capacity) {};
+
+bool JSONLexer::ChunkLexer::feed(const char *chunk, size_t length, std::list<JSONToken> *tokens) {
+    size_t offset = 0;
+    while (offset < length) {
+        // Merge the chunk after the characters left by the previous one, as much as the buffer holds.
+        size_t count = std::min(length - offset, this->capacity - this->pending_length);
+        std::memcpy(this->buffer + this->pending_length, chunk + offset, count);
+        this->pending_length += count;
+        offset += count;
+
+        LexerResult result = LexBuffer(this->buffer, this->pending_length);
+        if (result.isLastTokenFinishLexing) {
+            this->pending_length = 0;
+        } else if (result.lastTokenStartIndex == 0 && this->pending_length == this->capacity) {
+            // Unfinished token fills the whole buffer.
+            this->pending_length = 0;
+            return false;
+        } else {
+            // Shift the unfinished token to the beginning of the buffer.
+            this->pending_length -= result.lastTokenStartIndex;
+            std::memmove(this->buffer, this->buffer + result.lastTokenStartIndex, this->pending_length);
+        }
+        tokens->splice(tokens->end(), result.tokens);
+    }
+    return true;
+}
+
+size_t JSONLexer::ChunkLexer::getPendingLength() const {
+    return this->pending_length;
+}
+
+void JSONLexer::ChunkLexer::reset() {
+    this->pending_length = 0;
+}
+
 JSONParser::JSONValue::JSONValue() {
     this->type = JSONParser::JSONValueType::Null;
     this->value = { 0 };
@@ -220,6 +257,10 @@ JSONParser::JSONValue::JSONValue(std::vector<JSONParser::JSONValue> *vec) {
     this->value.arrayValue = new std::vector<JSONParser::JSONValue>(*vec);
 }
 
+JSONParser::JSONValueType JSONParser::JSONValue::getType() const {
+    return this->type;
+}
+
 bool JSONParser::JSONValue::isBoolean() {
     return this->type == JSONParser::JSONValueType::Boolean;
 }
@@ -361,96 +402,163 @@ std::string JSONParser::JSONValue::Serialize() const {
     return "";
 }
 
+// Expected next token of Deserialize.
+enum DeserializeState {
+    // Any value.
+    VALUE,
+    // Any value or the end of the current array.
+    VALUE_OR_END,
+    // Key of the current object.
+    KEY,
+    // Key or the end of the current object.
+    KEY_OR_END,
+    // Comma or the end of the current container.
+    AFTER_VALUE,
+};
+
 JSONParser::JSONValue JSONParser::JSONValue::Deserialize(std::list<JSONLexer::JSONToken> *tokens, bool isRoot) {
-    JSONParser::JSONValue value = JSONParser::JSONValue();
     // If there is no tokens then return an empty JSONValue
-    if (tokens->empty()) return value;
-
-    // If we are parsing an object
-    switch (tokens->front().type) {
-        case JSONLexer::JSONTokenType::StartObject:{
-            std::map<std::string, JSONParser::JSONValue> map;
-            tokens->pop_front();
-
-            std::string key;
-            while(tokens->front().type != JSONLexer::JSONTokenType::EndObject) {
-                // Check if key is a string (should be)
-                if (tokens->front().type != JSONLexer::JSONTokenType::String) {
-                    Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Expected key token should be string !");
-                    return JSONParser::JSONValue();
-                }
-                // Save key value for later
-                key = tokens->front().stringValue;
-                tokens->pop_front();
+    if (tokens->empty()) return JSONParser::JSONValue();
+    if (isRoot && tokens->front().type != JSONLexer::JSONTokenType::StartObject && tokens->front().type != JSONLexer::JSONTokenType::StartArray) {
+        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Expected object or array as root!");
+        return JSONParser::JSONValue();
+    }
 
-                // Expect a Colon separator between key and value (JSON format)
-                if (tokens->front().type != JSONLexer::JSONTokenType::Colon) {
-                    Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Expected Colon between key and value!");
-                    return JSONParser::JSONValue();
-                }
-                tokens->pop_front();
+    // Containers being filled. The stack is bounded so that nesting never recurses on the thread stack.
+    struct Frame {
+        JSONParser::JSONValue container;
+        std::string key;
+    };
+    Frame stack[JSON_MAX_DEPTH];
+    size_t depth = 0;
+    size_t elements = 0;
+    DeserializeState state = DeserializeState::VALUE;
+    JSONParser::JSONValue root;
+    const char* error = NULL;
 
-                // Recursively get value (can be another map, array or standard type)
-                map[key] = JSONParser::JSONValue::Deserialize(tokens);
+    while (error == NULL) {
+        // Root value is done.
+        if (depth == 0 && state == DeserializeState::AFTER_VALUE) break;
+        if (tokens->empty()) {
+            error = "Unexpected end of message!";
+            break;
+        }
+        JSONLexer::JSONToken& token = tokens->front();
+        Frame* frame = (depth > 0) ? &stack[depth - 1] : NULL;
+        bool isInObject = frame != NULL && frame->container.isMap();
 
-                if (tokens->front().type != JSONLexer::JSONTokenType::EndObject) {
-                    // After, we expect either an EndObject token or a comma (meaning that there is more entries)
-                    if (tokens->front().type == JSONLexer::JSONTokenType::Comma){
-                        tokens->pop_front();
-                    } else {
-                        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Expected Comma between entries!");
-                        return JSONParser::JSONValue();
-                    }
-                }
+        JSONParser::JSONValue value;
+        if ((token.type == JSONLexer::JSONTokenType::EndObject && (state == DeserializeState::KEY_OR_END || (state == DeserializeState::AFTER_VALUE && isInObject))) ||
+            (token.type == JSONLexer::JSONTokenType::EndArray && (state == DeserializeState::VALUE_OR_END || (state == DeserializeState::AFTER_VALUE && !isInObject)))) {
+            // End of the current container, it becomes a value of its parent.
+            value = frame->container;
+            depth--;
+        } else if (state == DeserializeState::AFTER_VALUE) {
+            // After a value, we expect either the end of the container or a comma (meaning that there is more entries)
+            if (token.type != JSONLexer::JSONTokenType::Comma) {
+                error = "Expected Comma between entries!";
+                break;
             }
-
-            value = JSONParser::JSONValue(&map);
-        };break;
-        case JSONLexer::JSONTokenType::StartArray: {
-            std::vector<JSONParser::JSONValue> vec;
+            tokens->pop_front();
+            state = isInObject ? DeserializeState::KEY : DeserializeState::VALUE;
+            continue;
+        } else if (state == DeserializeState::KEY || state == DeserializeState::KEY_OR_END) {
+            // Check if key is a string (should be)
+            if (token.type != JSONLexer::JSONTokenType::String) {
+                error = "Expected key token should be string !";
+                break;
+            }
+            if (token.stringValue.length() > JSON_MAX_STRING_LENGTH) {
+                error = "String too long!";
+                break;
+            }
+            // Save key value for later
+            frame->key.swap(token.stringValue);
             tokens->pop_front();
 
-            while(tokens->front().type != JSONLexer::JSONTokenType::EndArray) {
-                // Recursively get value (can be another array, map or standard type)
-                vec.push_back(JSONParser::JSONValue::Deserialize(tokens));
-
-                if (tokens->front().type != JSONLexer::JSONTokenType::EndArray) {
-                    // After, we expect either an EndArray token or a comma (meaning that there is more entries)
-                    if (tokens->front().type == JSONLexer::JSONTokenType::Comma) {
-                        tokens->pop_front();
+            // Expect a Colon separator between key and value (JSON format)
+            if (tokens->empty() || tokens->front().type != JSONLexer::JSONTokenType::Colon) {
+                error = "Expected Colon between key and value!";
+                break;
+            }
+            tokens->pop_front();
+            state = DeserializeState::VALUE;
+            continue;
+        } else {
+            if (++elements > JSON_MAX_ELEMENTS) {
+                error = "Too many elements!";
+                break;
+            }
+            switch (token.type) {
+                case JSONLexer::JSONTokenType::StartObject:
+                case JSONLexer::JSONTokenType::StartArray:{
+                    if (depth >= JSON_MAX_DEPTH) {
+                        error = "Too deeply nested!";
+                        break;
+                    }
+                    // Empty container, filled through its pointer.
+                    if (token.type == JSONLexer::JSONTokenType::StartObject) {
+                        std::map<std::string, JSONParser::JSONValue> map;
+                        stack[depth].container = JSONParser::JSONValue(&map);
+                        state = DeserializeState::KEY_OR_END;
                     } else {
-                        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Expected Comma between entries!");
-                        return JSONParser::JSONValue();
+                        std::vector<JSONParser::JSONValue> vec;
+                        stack[depth].container = JSONParser::JSONValue(&vec);
+                        state = DeserializeState::VALUE_OR_END;
                     }
-                }
+                    depth++;
+                };break;
+                case JSONLexer::JSONTokenType::String: {
+                    if (token.stringValue.length() > JSON_MAX_STRING_LENGTH) {
+                        error = "String too long!";
+                        break;
+                    }
+                    value.type = JSONValueType::String;
+                    value.value.stringValue = new std::string();
+                    value.value.stringValue->swap(token.stringValue);
+                };break;
+                case JSONLexer::JSONTokenType::Boolean: {
+                    value.type = JSONValueType::Boolean;
+                    value.value.boolValue = token.boolValue;
+                };break;
+                case JSONLexer::JSONTokenType::Null: {
+                    value.type = JSONValueType::Null;
+                    value.value = { 0 };
+                };break;
+                case JSONLexer::JSONTokenType::Integer: {
+                    value.type = JSONValueType::Integer;
+                    value.value.intValue = token.intValue;
+                };break;
+                case JSONLexer::JSONTokenType::Float: {
+                    value.type = JSONValueType::Float;
+                    value.value.floatValue = token.floatValue;
+                };break;
+                default:{
+                    error = "Couldn't create JSONValue from this token !";
+                };break;
+            }
+            if (error != NULL) break;
+            if (token.type == JSONLexer::JSONTokenType::StartObject || token.type == JSONLexer::JSONTokenType::StartArray) {
+                tokens->pop_front();
+                continue;
             }
+        }
+        tokens->pop_front();
 
-            value = JSONParser::JSONValue(&vec);
-        };break;
-        case JSONLexer::JSONTokenType::String: {
-            value.type = JSONValueType::String;
-            value.value.stringValue = new std::string(tokens->front().stringValue);
-        };break;
-        case JSONLexer::JSONTokenType::Boolean: {
-            value.type = JSONValueType::Boolean;
-            value.value.boolValue = tokens->front().boolValue;
-        };break;
-        case JSONLexer::JSONTokenType::Null: {
-            value.type = JSONValueType::Null;
-            value.value = { 0 };
-        };break;
-        case JSONLexer::JSONTokenType::Integer: {
-            value.type = JSONValueType::Integer;
-            value.value.intValue = tokens->front().intValue;
-        };break;
-        case JSONLexer::JSONTokenType::Float: {
-            value.type = JSONValueType::Float;
-            value.value.floatValue = tokens->front().floatValue;
-        };break;
-        default:{
-            Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Couldn't create JSONValue from this token !");
+        // Attach the finished value to its container.
+        if (depth == 0) {
+            root = value;
+        } else if (stack[depth - 1].container.isMap()) {
+            (*stack[depth - 1].container.getMap())[stack[depth - 1].key] = value;
+        } else {
+            stack[depth - 1].container.getArray()->push_back(value);
         }
+        state = DeserializeState::AFTER_VALUE;
+    }
+
+    if (error != NULL) {
+        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "%s", error);
+        return JSONParser::JSONValue();
     }
-    tokens->pop_front();
-    return value;
+    return root;
 }
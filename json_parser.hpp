@@ -14,6 +14,31 @@
 #include <sstream>
 #include "logger.hpp"
 
+// Maximum nesting of objects and arrays accepted by Deserialize. Can be overridden with "json-max-depth" in mbed_app.json.
+#ifdef MBED_CONF_APP_JSON_MAX_DEPTH
+#define JSON_MAX_DEPTH MBED_CONF_APP_JSON_MAX_DEPTH
+#else
+#define JSON_MAX_DEPTH 8
+#endif
+
+// Maximum number of values of a message, containers included. Can be overridden with "json-max-elements" in mbed_app.json.
+#ifdef MBED_CONF_APP_JSON_MAX_ELEMENTS
+#define JSON_MAX_ELEMENTS MBED_CONF_APP_JSON_MAX_ELEMENTS
+#else
+#define JSON_MAX_ELEMENTS 512
+#endif
+
+// Maximum length of a string or key in bytes. Can be overridden with "json-max-string-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_JSON_MAX_STRING_LENGTH
+#define JSON_MAX_STRING_LENGTH MBED_CONF_APP_JSON_MAX_STRING_LENGTH
+#else
+#define JSON_MAX_STRING_LENGTH 128
+#endif
+
+// Maximum number of tokens of a message within the limits above: at most a key, a colon, a comma and two brackets per value.
+// Lexed tokens waiting for the end of a message are capped to it, so that a stream without gap can't exhaust the heap.
+#define JSON_MAX_TOKENS (JSON_MAX_ELEMENTS * 5)
+
 namespace JSONLexer {
     //Enum type of tokens possible for the Lexer.
     enum JSONTokenType { 
@@ -54,6 +79,35 @@ namespace JSONLexer {
     *  @param buffer_length Size of input buffer.
     */
     LexerResult LexBuffer(char* buffer, int buffer_length);
+
+    // Lexer of a message received in chunks. The characters of the last unfinished token are kept in a fixed buffer and lexed again with the next chunk.
+    class ChunkLexer {
+        char *buffer;
+        size_t capacity;
+        size_t pending_length = 0;
+    public:
+        /** Constructor of ChunkLexer.
+        *
+        * @param buffer storage of the characters lexed at once, tokens longer than it can't be lexed.
+        * @param capacity buffer size in bytes.
+        */
+        ChunkLexer(char *buffer, size_t capacity);
+
+        /** Lex a chunk, merging it with the characters left by the previous one.
+        *
+        * @param chunk received characters.
+        * @param length number of characters.
+        * @param tokens list the finished tokens are appended to.
+        * @return false if a token fills the whole buffer, the rest of the message can't be lexed.
+        */
+        bool feed(const char *chunk, size_t length, std::list<JSONToken> *tokens);
+
+        // Number of characters of the unfinished token kept for the next chunk.
+        size_t getPendingLength() const;
+
+        // Drop the unfinished token, at the end of a message.
+        void reset();
+    };
 }
 
 namespace JSONParser {
@@ -135,6 +189,9 @@ namespace JSONParser {
         */
         JSONValue(std::vector<JSONParser::JSONValue> *vec);
 
+        // Type of the stored value.
+        JSONValueType getType() const;
+
         bool isBoolean();
         bool isInt();
         bool isFloat();
@@ -191,10 +248,11 @@ namespace JSONParser {
         */
         std::string Serialize() const;
         /** Deserialize JSON message from list of tokens from the lexer.
+        * Parsing is iterative with a stack of JSON_MAX_DEPTH containers, and bounded by JSON_MAX_ELEMENTS and JSON_MAX_STRING_LENGTH.
         *
         * @param tokens reference to list of tokens. List will be consummed by the function.
         * @param isRoot (optional) toggle the check if message is an array or an object and so can be used as a root. This requirements is imposed by JSON format.
-        * @return JSONValue with nested values from the list of tokens.
+        * @return JSONValue with nested values from the list of tokens, Null if the message is invalid or exceeds a limit.
         */
         static JSONValue Deserialize(std::list<JSONLexer::JSONToken> *tokens, bool isRoot = true);
     };
@@ -0,0 +1,194 @@
+/* JSON path query
+ * Resolve a few JSON Pointers of a request at once, skipping every member no path goes into.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "json_query.hpp"
+
+#include <cstring>
+#include <string>
+
+using namespace JSONQuery;
+
+// Compare a reference token, where "~1" stands for '/' and "~0" for '~', with an unescaped key.
+static bool segmentEquals(const char *segment, size_t segment_length, const char *key, size_t key_length) {
+    size_t i = 0;
+    size_t j = 0;
+    while (i < segment_length && j < key_length) {
+        char c = segment[i];
+        if (c == '~' && i + 1 < segment_length) {
+            c = (segment[i + 1] == '1') ? '/' : '~';
+            i += 2;
+        } else {
+            i++;
+        }
+        if (c != key[j++]) return false;
+    }
+    return i == segment_length && j == key_length;
+}
+
+Query::Query(std::initializer_list<const char*> paths) {
+    size_t used_segments = 0;
+    for (const char* path: paths) {
+        if (this->path_count >= JSON_QUERY_MAX_PATHS) break;
+        size_t i = this->path_count++;
+        this->paths[i] = path;
+        this->first_segment[i] = used_segments;
+        this->segment_count[i] = 0;
+
+        size_t path_length = std::strlen(path);
+        if (path_length == 0) {
+            this->valid_paths |= 1u << i;
+            continue;
+        }
+        if (path[0] != '/' || path_length > UINT16_MAX) continue;
+
+        bool isValid = true;
+        size_t start = 1;
+        while (true) {
+            const char *end = std::strchr(path + start, '/');
+            size_t length = (end != NULL) ? end - (path + start) : path_length - start;
+            if (this->segment_count[i] >= JSON_TAPE_MAX_DEPTH || used_segments >= JSON_QUERY_MAX_SEGMENTS) {
+                isValid = false;
+                break;
+            }
+            Segment& segment = this->segments[used_segments++];
+            this->segment_count[i]++;
+            segment.start = start;
+            segment.length = length;
+
+            // Array index: digits without leading zero.
+            segment.index = -1;
+            if (length > 0 && length <= 9 && (path[start] != '0' || length == 1)) {
+                segment.index = 0;
+                for (size_t c = start; c < start + length && segment.index >= 0; c++) {
+                    if (path[c] < '0' || path[c] > '9') segment.index = -1;
+                    else segment.index = segment.index * 10 + (path[c] - '0');
+                }
+            }
+            if (end == NULL) break;
+            start += length + 1;
+        }
+        if (isValid) {
+            this->valid_paths |= 1u << i;
+        } else {
+            // Segments of an invalid path are given back to the next ones.
+            used_segments = this->first_segment[i];
+            this->segment_count[i] = 0;
+        }
+    }
+}
+
+size_t Query::getPathCount() const {
+    return this->path_count;
+}
+
+uint32_t Query::matchKey(uint32_t alive, size_t depth, const char *key, size_t key_length) const {
+    uint32_t matched = 0;
+    for (size_t i = 0; i < this->path_count; i++) {
+        if (!(alive & (1u << i))) continue;
+        const Segment& segment = this->segments[this->first_segment[i] + depth];
+        if (segmentEquals(this->paths[i] + segment.start, segment.length, key, key_length)) matched |= 1u << i;
+    }
+    return matched;
+}
+
+uint32_t Query::matchIndex(uint32_t alive, size_t depth, size_t index) const {
+    uint32_t matched = 0;
+    for (size_t i = 0; i < this->path_count; i++) {
+        if (!(alive & (1u << i))) continue;
+        if (this->segments[this->first_segment[i] + depth].index == (int32_t)index) matched |= 1u << i;
+    }
+    return matched;
+}
+
+void Query::resolve(JSONTape::Value root, JSONTape::Value *values) const {
+    // Containers being walked: next member, members left and paths still looking for one of them.
+    struct Frame {
+        JSONTape::Value member;
+        size_t remaining;
+        size_t index;
+        bool isObject;
+        uint32_t alive;
+    };
+    Frame stack[JSON_TAPE_MAX_DEPTH];
+    size_t depth = 0;
+
+    uint32_t alive = 0;
+    for (size_t i = 0; i < this->path_count; i++) {
+        values[i] = JSONTape::Value();
+        if (!(this->valid_paths & (1u << i))) continue;
+        if (this->segment_count[i] == 0) values[i] = root;
+        else alive |= 1u << i;
+    }
+    if (alive == 0 || !(root.isMap() || root.isArray())) return;
+    stack[depth++] = Frame { root.first(), root.size(), 0, root.isMap(), alive };
+
+    char key_buffer[JSON_QUERY_MAX_KEY_LENGTH];
+    while (depth > 0) {
+        Frame& frame = stack[depth - 1];
+        // Members after the last one a path needs are never visited.
+        if (frame.remaining == 0 || frame.alive == 0) {
+            depth--;
+            continue;
+        }
+
+        JSONTape::Value member = frame.member;
+        uint32_t matched = 0;
+        if (frame.isObject) {
+            size_t key_length = 0;
+            const char *key = member.getRaw(&key_length);
+            if (key != NULL && member.hasEscape()) key = member.copyString(key_buffer, sizeof(key_buffer), &key_length) ? key_buffer : NULL;
+            if (key != NULL) matched = this->matchKey(frame.alive, depth - 1, key, key_length);
+            member = member.next();
+        } else {
+            matched = this->matchIndex(frame.alive, depth - 1, frame.index);
+        }
+        // Next member, skipping this one and its nested values in O(1).
+        frame.member = member.next();
+        frame.remaining--;
+        frame.index++;
+        if (matched == 0) continue;
+        // The first member matching a path is the one find() and at() would return.
+        frame.alive &= ~matched;
+
+        uint32_t deeper = 0;
+        for (size_t i = 0; i < this->path_count; i++) {
+            if (!(matched & (1u << i))) continue;
+            if (this->segment_count[i] == depth) values[i] = member;
+            else deeper |= 1u << i;
+        }
+        if (deeper != 0 && (member.isMap() || member.isArray()) && depth < JSON_TAPE_MAX_DEPTH)
+            stack[depth++] = Frame { member.first(), member.size(), 0, member.isMap(), deeper };
+    }
+}
+
+void Query::resolve(JSONParser::JSONValue *root, JSONParser::JSONValue **values) const {
+    // The message is already a tree, each path is a lookup per segment.
+    for (size_t i = 0; i < this->path_count; i++) {
+        values[i] = NULL;
+        if (!(this->valid_paths & (1u << i))) continue;
+        JSONParser::JSONValue *value = root;
+        for (size_t s = 0; s < this->segment_count[i] && value != NULL; s++) {
+            const Segment& segment = this->segments[this->first_segment[i] + s];
+            if (value->isMap()) {
+                std::string key;
+                const char *segment_chars = this->paths[i] + segment.start;
+                for (size_t c = 0; c < segment.length; c++) {
+                    if (segment_chars[c] == '~' && c + 1 < segment.length) {
+                        key.push_back(segment_chars[++c] == '1' ? '/' : '~');
+                    } else {
+                        key.push_back(segment_chars[c]);
+                    }
+                }
+                std::map<std::string, JSONParser::JSONValue>::iterator member = value->getMap()->find(key);
+                value = (member != value->getMap()->end()) ? &member->second : NULL;
+            } else if (value->isArray() && segment.index >= 0 && (size_t)segment.index < value->getArray()->size()) {
+                value = &(*value->getArray())[segment.index];
+            } else {
+                value = NULL;
+            }
+        }
+        values[i] = value;
+    }
+}
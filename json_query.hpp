@@ -0,0 +1,70 @@
+/* JSON path query
+ * Resolve a few JSON Pointers (RFC 6901, e.g. "/mode" or "/seq/0") of a request at once. On a tape document every
+ * container on the way to a queried value is walked a single time for all the paths, and every member no path goes
+ * into is skipped through its end index without being read. The walk stops as soon as every path is resolved.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <initializer_list>
+#include "json_parser.hpp"
+#include "json_tape.hpp"
+
+// Maximum number of paths of a query.
+#define JSON_QUERY_MAX_PATHS 8
+// Maximum number of segments of all the paths of a query.
+#define JSON_QUERY_MAX_SEGMENTS 16
+// Longest object key with escape sequences that can be matched, keys without escape sequences have no limit.
+#define JSON_QUERY_MAX_KEY_LENGTH 32
+
+namespace JSONQuery {
+    // Compiled paths, immutable once built so that a single query can be resolved by every channel at the same time.
+    class Query {
+        // Reference token of a path, pointing into the path string. Index is -1 if it can't be an array index.
+        struct Segment {
+            uint16_t start;
+            uint16_t length;
+            int32_t index;
+        };
+
+        const char* paths[JSON_QUERY_MAX_PATHS];
+        // Segments of path i are segments[first_segment[i]] to segments[first_segment[i] + segment_count[i] - 1].
+        Segment segments[JSON_QUERY_MAX_SEGMENTS];
+        uint8_t first_segment[JSON_QUERY_MAX_PATHS];
+        // Number of segments of each path, 0 for the whole document. Invalid paths never match.
+        uint8_t segment_count[JSON_QUERY_MAX_PATHS];
+        uint32_t valid_paths = 0;
+        size_t path_count = 0;
+
+        // Paths of alive whose segment at depth is the object key or the array index.
+        uint32_t matchKey(uint32_t alive, size_t depth, const char *key, size_t key_length) const;
+        uint32_t matchIndex(uint32_t alive, size_t depth, size_t index) const;
+    public:
+        /** Constructor of Query, meant to be built once as a constant.
+        *
+        * @param paths JSON Pointers, at most JSON_QUERY_MAX_PATHS. Strings are not copied and must outlive the query.
+        *        "" is the whole document. Paths not starting with '/', deeper than JSON_TAPE_MAX_DEPTH or past
+        *        JSON_QUERY_MAX_SEGMENTS never match.
+        */
+        Query(std::initializer_list<const char*> paths);
+
+        size_t getPathCount() const;
+
+        /** Resolve the paths in a tape document.
+        *
+        * @param root root of the document.
+        * @param values one value per path in the constructor order, does not exist if the path is not found.
+        */
+        void resolve(JSONTape::Value root, JSONTape::Value *values) const;
+
+        /** Resolve the paths in a deserialized message.
+        *
+        * @param root root of the message.
+        * @param values one value per path in the constructor order, NULL if the path is not found.
+        */
+        void resolve(JSONParser::JSONValue *root, JSONParser::JSONValue **values) const;
+    };
+}
@@ -0,0 +1,535 @@
+/* JSON tape document
+ * Alternative to JSONValue::Deserialize: the message is parsed into a flat tape of typed entries, stored with a copy
+ * of the message in a single allocation.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "json_tape.hpp"
+#include "logger.hpp"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+using namespace JSONTape;
+
+#define TAPE_NO_INDEX UINT32_MAX
+
+// Write the UTF-8 encoding of a code point, return its number of bytes.
+static size_t encodeUTF8(char *out, uint32_t code_point) {
+    if (code_point < 0x80) {
+        out[0] = code_point;
+        return 1;
+    } else if (code_point < 0x800) {
+        out[0] = 0xc0 | (code_point >> 6);
+        out[1] = 0x80 | (code_point & 0x3f);
+        return 2;
+    } else if (code_point < 0x10000) {
+        out[0] = 0xe0 | (code_point >> 12);
+        out[1] = 0x80 | ((code_point >> 6) & 0x3f);
+        out[2] = 0x80 | (code_point & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (code_point >> 18);
+    out[1] = 0x80 | ((code_point >> 12) & 0x3f);
+    out[2] = 0x80 | ((code_point >> 6) & 0x3f);
+    out[3] = 0x80 | (code_point & 0x3f);
+    return 4;
+}
+
+// Value of the 4 hexadecimal digits of a \u escape, -1 if they are not valid.
+static int32_t parseHex4(const char *hex) {
+    int32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = hex[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else return -1;
+    }
+    return value;
+}
+
+/** Decode the character at position i of a string of the source, escape sequences were checked by the parser.
+*
+* @param str string characters, without quotes.
+* @param length length of the string.
+* @param i position of the character, moved after it.
+* @param out decoded bytes, up to 4.
+* @return number of decoded bytes.
+*/
+static size_t decodeChar(const char *str, size_t length, size_t *i, char *out) {
+    if (str[*i] != '\\') {
+        out[0] = str[(*i)++];
+        return 1;
+    }
+    (*i)++;
+    char c = str[(*i)++];
+    switch (c) {
+        case 'b': out[0] = '\b'; return 1;
+        case 'f': out[0] = '\f'; return 1;
+        case 'n': out[0] = '\n'; return 1;
+        case 'r': out[0] = '\r'; return 1;
+        case 't': out[0] = '\t'; return 1;
+        case 'u':{
+            uint32_t code_point = parseHex4(str + *i);
+            *i += 4;
+            // Surrogate pair.
+            if (code_point >= 0xd800 && code_point <= 0xdbff && *i + 6 <= length && str[*i] == '\\' && str[*i + 1] == 'u') {
+                int32_t low = parseHex4(str + *i + 2);
+                if (low >= 0xdc00 && low <= 0xdfff) {
+                    code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+                    *i += 6;
+                }
+            }
+            return encodeUTF8(out, code_point);
+        };
+        // '"', '\\' and '/' stand for themselves.
+        default: out[0] = c; return 1;
+    }
+}
+
+// Unescape a string of the source.
+static std::string unescape(const char *str, size_t length) {
+    std::string out;
+    out.reserve(length);
+    char decoded[4];
+    for (size_t i = 0; i < length;) {
+        size_t decoded_length = decodeChar(str, length, &i, decoded);
+        out.append(decoded, decoded_length);
+    }
+    return out;
+}
+
+Value::Value(): document(NULL), index(TAPE_NO_INDEX) {};
+Value::Value(const Document *document, uint32_t index): document(document), index(index) {};
+
+bool Value::exists() const {
+    return this->document != NULL && this->document->isValid && this->index < this->document->tape_length;
+}
+
+uint32_t Value::skip() const {
+    const TapeEntry& entry = this->document->tape[this->index];
+    if (entry.type == JSONParser::JSONValueType::Object || entry.type == JSONParser::JSONValueType::Array) return entry.value;
+    return this->index + 1;
+}
+
+JSONParser::JSONValueType Value::getType() const {
+    if (!this->exists()) return JSONParser::JSONValueType::Null;
+    return (JSONParser::JSONValueType)this->document->tape[this->index].type;
+}
+
+bool Value::isBoolean() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Boolean; }
+bool Value::isInt() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Integer; }
+bool Value::isFloat() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Float; }
+bool Value::isString() const { return this->exists() && this->getType() == JSONParser::JSONValueType::String; }
+bool Value::isNull() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Null; }
+bool Value::isMap() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Object; }
+bool Value::isArray() const { return this->exists() && this->getType() == JSONParser::JSONValueType::Array; }
+
+bool Value::getBoolean() const {
+    if (!this->isBoolean()) return false;
+    return this->document->tape[this->index].value != 0;
+}
+
+int Value::getInt() const {
+    if (!this->isInt()) return 0;
+    return (int)this->document->tape[this->index].value;
+}
+
+float Value::getFloat() const {
+    if (!this->isFloat()) return 0.0f;
+    float f;
+    std::memcpy(&f, &this->document->tape[this->index].value, sizeof(f));
+    return f;
+}
+
+std::string Value::getString() const {
+    if (!this->isString()) return "";
+    const TapeEntry& entry = this->document->tape[this->index];
+    const char *str = this->document->source + entry.value;
+    if (!entry.hasEscape) return std::string(str, entry.length);
+    return unescape(str, entry.length);
+}
+
+const char* Value::getRaw(size_t *length) const {
+    if (!this->isString()) return NULL;
+    const TapeEntry& entry = this->document->tape[this->index];
+    *length = entry.length;
+    return this->document->source + entry.value;
+}
+
+bool Value::hasEscape() const {
+    return this->isString() && this->document->tape[this->index].hasEscape;
+}
+
+bool Value::copyString(char *buffer, size_t capacity, size_t *length) const {
+    if (!this->isString()) return false;
+    const TapeEntry& entry = this->document->tape[this->index];
+    const char *str = this->document->source + entry.value;
+    size_t written = 0;
+    char decoded[4];
+    for (size_t i = 0; i < entry.length;) {
+        size_t decoded_length = decodeChar(str, entry.length, &i, decoded);
+        if (written + decoded_length > capacity) return false;
+        std::memcpy(buffer + written, decoded, decoded_length);
+        written += decoded_length;
+    }
+    *length = written;
+    return true;
+}
+
+bool Value::equals(const char *str) const {
+    if (!this->isString()) return false;
+    const TapeEntry& entry = this->document->tape[this->index];
+    const char *source = this->document->source + entry.value;
+    if (!entry.hasEscape) return std::strlen(str) == entry.length && std::memcmp(source, str, entry.length) == 0;
+
+    // Decode one character at a time, so that comparing allocates nothing.
+    size_t j = 0;
+    char decoded[4];
+    for (size_t i = 0; i < entry.length;) {
+        size_t decoded_length = decodeChar(source, entry.length, &i, decoded);
+        for (size_t k = 0; k < decoded_length; k++) {
+            if (str[j] == '\0' || str[j] != decoded[k]) return false;
+            j++;
+        }
+    }
+    return str[j] == '\0';
+}
+
+size_t Value::size() const {
+    if (!this->isMap() && !this->isArray()) return 0;
+    return this->document->tape[this->index].length;
+}
+
+Value Value::first() const {
+    if (this->size() == 0) return Value();
+    return Value(this->document, this->index + 1);
+}
+
+Value Value::next() const {
+    if (!this->exists()) return Value();
+    return Value(this->document, this->skip());
+}
+
+Value Value::at(size_t i) const {
+    if (!this->isArray() || i >= this->size()) return Value();
+    Value element = this->first();
+    while (i-- > 0) element.index = element.skip();
+    return element;
+}
+
+Value Value::find(const char *key) const {
+    if (!this->isMap()) return Value();
+    uint32_t end = this->document->tape[this->index].value;
+    uint32_t i = this->index + 1;
+    while (i < end) {
+        Value entry_key(this->document, i);
+        Value entry_value(this->document, i + 1);
+        if (entry_key.equals(key)) return entry_value;
+        i = entry_value.skip();
+    }
+    return Value();
+}
+
+JSONParser::JSONValue Value::toJSONValue() const {
+    switch (this->getType()) {
+        case JSONParser::JSONValueType::Boolean: return JSONParser::JSONValue(this->getBoolean());
+        case JSONParser::JSONValueType::Integer: return JSONParser::JSONValue(this->getInt());
+        case JSONParser::JSONValueType::Float: return JSONParser::JSONValue(this->getFloat());
+        case JSONParser::JSONValueType::String: return JSONParser::JSONValue(new std::string(this->getString()));
+        case JSONParser::JSONValueType::Array:{
+            std::vector<JSONParser::JSONValue> vec;
+            uint32_t end = this->skip();
+            for (Value element(this->document, this->index + 1); element.index < end; element.index = element.skip())
+                vec.push_back(element.toJSONValue());
+            return JSONParser::JSONValue(&vec);
+        };
+        case JSONParser::JSONValueType::Object:{
+            std::map<std::string, JSONParser::JSONValue> map;
+            uint32_t end = this->skip();
+            for (uint32_t i = this->index + 1; i < end;) {
+                Value entry_value(this->document, i + 1);
+                map[Value(this->document, i).getString()] = entry_value.toJSONValue();
+                i = entry_value.skip();
+            }
+            return JSONParser::JSONValue(&map);
+        };
+        default: return JSONParser::JSONValue();
+    }
+}
+
+Document::Document() {};
+
+Document::Document(TapeEntry *tape, size_t tape_capacity, char *source, size_t source_capacity):
+    external_tape(tape), external_tape_capacity(tape_capacity), external_source(source), external_source_capacity(source_capacity) {};
+
+Document::~Document() {
+    this->clear();
+}
+
+void Document::clear() {
+    delete[] this->memory;
+    this->memory = NULL;
+    this->tape = NULL;
+    this->source = NULL;
+    this->tape_length = 0;
+    this->isValid = false;
+}
+
+bool Document::valid() const {
+    return this->isValid;
+}
+
+Value Document::root() const {
+    return Value(this, 0);
+}
+
+size_t Document::getTapeLength() const {
+    return this->tape_length;
+}
+
+// Every entry is preceded by one of "{[,:", except the root. So the tape size is known before parsing.
+static size_t countEntries(const char *buffer, size_t buffer_length) {
+    size_t max_entries = 1;
+    bool isInString = false;
+    for (size_t i = 0; i < buffer_length; i++) {
+        char c = buffer[i];
+        if (isInString) {
+            if (c == '\\') i++;
+            else if (c == '"') isInString = false;
+        } else if (c == '"') {
+            isInString = true;
+        } else if (c == '{' || c == '[' || c == ',' || c == ':') {
+            max_entries++;
+        }
+    }
+    return max_entries;
+}
+
+// Parser states, what is expected after the whitespaces.
+enum ParseState {
+    // Any value.
+    VALUE,
+    // Any value or the end of the current array.
+    VALUE_OR_END,
+    // Key of the current object.
+    KEY,
+    // Key or the end of the current object.
+    KEY_OR_END,
+    // Comma or the end of the current container.
+    AFTER_VALUE,
+};
+
+bool Document::parse(const char *buffer, size_t buffer_length, bool isRoot) {
+    this->clear();
+
+    size_t max_entries;
+    char *source;
+    if (this->external_tape != NULL) {
+        // Fixed storage, an overflow of the tape is found while parsing.
+        if (buffer_length >= this->external_source_capacity) {
+            Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Message longer than %d characters!", (int)this->external_source_capacity - 1);
+            return false;
+        }
+        max_entries = this->external_tape_capacity;
+        this->tape = this->external_tape;
+        source = this->external_source;
+    } else {
+        max_entries = countEntries(buffer, buffer_length);
+        if (max_entries >= TAPE_NO_INDEX || buffer_length >= UINT32_MAX) return false;
+        this->memory = new char[max_entries * sizeof(TapeEntry) + buffer_length + 1];
+        this->tape = reinterpret_cast<TapeEntry*>(this->memory);
+        source = this->memory + max_entries * sizeof(TapeEntry);
+    }
+    std::memcpy(source, buffer, buffer_length);
+    source[buffer_length] = '\0';
+    this->source = source;
+
+    // Tape index of the open containers.
+    uint32_t stack[JSON_TAPE_MAX_DEPTH];
+    size_t depth = 0;
+    ParseState state = ParseState::VALUE;
+    size_t pos = 0;
+    const char *error = NULL;
+    while (error == NULL) {
+        while (pos < buffer_length && (source[pos] == ' ' || source[pos] == '\t' || source[pos] == '\r' || source[pos] == '\n')) pos++;
+        if (state == ParseState::AFTER_VALUE && depth == 0) {
+            if (pos != buffer_length) error = "Unexpected character after root";
+            break;
+        }
+        if (pos >= buffer_length) {
+            error = "Unexpected end of message";
+            break;
+        }
+        char c = source[pos];
+        TapeEntry& parent = this->tape[(depth > 0) ? stack[depth - 1] : 0];
+
+        // Close the current container, it becomes a finished value of its own parent.
+        if ((c == '}' && (state == ParseState::KEY_OR_END || (state == ParseState::AFTER_VALUE && parent.type == JSONParser::JSONValueType::Object))) ||
+            (c == ']' && (state == ParseState::VALUE_OR_END || (state == ParseState::AFTER_VALUE && parent.type == JSONParser::JSONValueType::Array)))) {
+            parent.value = this->tape_length;
+            depth--;
+            pos++;
+            if (depth > 0) this->tape[stack[depth - 1]].length++;
+            state = ParseState::AFTER_VALUE;
+            continue;
+        }
+        if (state == ParseState::AFTER_VALUE) {
+            if (c != ',') {
+                error = "Expected comma between entries";
+                break;
+            }
+            pos++;
+            state = (parent.type == JSONParser::JSONValueType::Object) ? ParseState::KEY : ParseState::VALUE;
+            continue;
+        }
+        if ((state == ParseState::KEY || state == ParseState::KEY_OR_END) && c != '"') {
+            error = "Expected key token should be string";
+            break;
+        }
+        if (isRoot && depth == 0 && c != '{' && c != '[') {
+            error = "Root should be an object or an array";
+            break;
+        }
+
+        if (this->tape_length >= max_entries) {
+            error = "Tape overflow";
+            break;
+        }
+        TapeEntry& entry = this->tape[this->tape_length];
+        entry.hasEscape = false;
+        entry.length = 0;
+        entry.value = 0;
+        switch (c) {
+            case '{':
+            case '[':{
+                if (depth >= JSON_TAPE_MAX_DEPTH) {
+                    error = "Too deeply nested";
+                    break;
+                }
+                entry.type = (c == '{') ? JSONParser::JSONValueType::Object : JSONParser::JSONValueType::Array;
+                stack[depth++] = this->tape_length;
+                pos++;
+            };break;
+            case '"':{
+                entry.type = JSONParser::JSONValueType::String;
+                size_t start = ++pos;
+                while (pos < buffer_length && source[pos] != '"') {
+                    if (source[pos] == '\\') {
+                        entry.hasEscape = true;
+                        pos++;
+                        if (pos < buffer_length && source[pos] == 'u') {
+                            if (pos + 4 >= buffer_length || parseHex4(source + pos + 1) < 0) {
+                                error = "Invalid unicode escape";
+                                break;
+                            }
+                            pos += 4;
+                        } else if (pos >= buffer_length || source[pos] == '\0' || std::strchr("\"\\/bfnrt", source[pos]) == NULL) {
+                            error = "Invalid escape sequence";
+                            break;
+                        }
+                    }
+                    pos++;
+                }
+                if (error != NULL) break;
+                if (pos >= buffer_length) {
+                    error = "Unterminated string";
+                    break;
+                }
+                entry.value = start;
+                entry.length = pos - start;
+                pos++;
+            };break;
+            case 't':
+            case 'f':
+            case 'n':{
+                const char *keyword = (c == 't') ? "true" : ((c == 'f') ? "false" : "null");
+                size_t keyword_length = std::strlen(keyword);
+                if (buffer_length - pos < keyword_length || std::memcmp(source + pos, keyword, keyword_length) != 0) {
+                    error = "Invalid keyword";
+                    break;
+                }
+                entry.type = (c == 'n') ? JSONParser::JSONValueType::Null : JSONParser::JSONValueType::Boolean;
+                entry.value = (c == 't');
+                pos += keyword_length;
+            };break;
+            default:{
+                if (c != '-' && (c < '0' || c > '9')) {
+                    error = "Unexpected character";
+                    break;
+                }
+                // Numbers with a fraction or an exponent are floats, like the lexer.
+                size_t start = pos;
+                bool isFloat = false;
+                if (source[pos] == '-') pos++;
+                size_t digits = pos;
+                while (pos < buffer_length && source[pos] >= '0' && source[pos] <= '9') pos++;
+                if (pos == digits) {
+                    error = "Invalid number";
+                    break;
+                }
+                if (pos < buffer_length && source[pos] == '.') {
+                    isFloat = true;
+                    pos++;
+                    while (pos < buffer_length && source[pos] >= '0' && source[pos] <= '9') pos++;
+                }
+                if (pos < buffer_length && (source[pos] == 'e' || source[pos] == 'E')) {
+                    isFloat = true;
+                    pos++;
+                    if (pos < buffer_length && (source[pos] == '+' || source[pos] == '-')) pos++;
+                    while (pos < buffer_length && source[pos] >= '0' && source[pos] <= '9') pos++;
+                }
+
+                long long integer = 0;
+                if (!isFloat) {
+                    char *end;
+                    integer = std::strtoll(source + start, &end, 10);
+                    // Integers too large for an int are kept as floats.
+                    if (integer > INT_MAX || integer < INT_MIN) isFloat = true;
+                }
+                if (isFloat) {
+                    float f = std::strtof(source + start, NULL);
+                    entry.type = JSONParser::JSONValueType::Float;
+                    std::memcpy(&entry.value, &f, sizeof(f));
+                } else {
+                    entry.type = JSONParser::JSONValueType::Integer;
+                    entry.value = (uint32_t)(int)integer;
+                }
+            };break;
+        }
+        if (error != NULL) break;
+        this->tape_length++;
+
+        if (entry.type == JSONParser::JSONValueType::Object) {
+            state = ParseState::KEY_OR_END;
+        } else if (entry.type == JSONParser::JSONValueType::Array) {
+            state = ParseState::VALUE_OR_END;
+        } else if (state == ParseState::KEY || state == ParseState::KEY_OR_END) {
+            // Key, expect its value after a colon.
+            while (pos < buffer_length && (source[pos] == ' ' || source[pos] == '\t' || source[pos] == '\r' || source[pos] == '\n')) pos++;
+            if (pos >= buffer_length || source[pos] != ':') {
+                error = "Expected Colon between key and value";
+                break;
+            }
+            pos++;
+            state = ParseState::VALUE;
+        } else {
+            // A scalar root is a whole document.
+            if (depth > 0) this->tape[stack[depth - 1]].length++;
+            state = ParseState::AFTER_VALUE;
+        }
+    }
+
+    if (error != NULL) {
+        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "%s at character %d!", error, (int)pos);
+        this->clear();
+        return false;
+    }
+    this->isValid = true;
+    return true;
+}
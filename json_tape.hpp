@@ -0,0 +1,170 @@
+/* JSON tape document
+ * Alternative to JSONValue::Deserialize: the message is parsed into a flat tape of typed entries, stored with a copy
+ * of the message in a single allocation or in fixed storage. Containers know where they end so unused subtrees are skipped in O(1),
+ * and strings are only unescaped when read.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "json_parser.hpp"
+
+// Maximum nesting of objects and arrays, the same as Deserialize so that both builds accept the same messages ("json-max-depth").
+#define JSON_TAPE_MAX_DEPTH JSON_MAX_DEPTH
+
+namespace JSONTape {
+    // Entry of the tape. Object entries are followed by their key and value entries, array entries by their elements.
+    struct TapeEntry {
+        // JSONParser::JSONValueType of the entry.
+        uint8_t type;
+        // Strings only, true if the string has escape sequences to decode.
+        bool hasEscape;
+        // Object or Array: index of the entry after its last element. String: offset in the source. Integer or Boolean: value. Float: bits.
+        uint32_t value;
+        // Object: number of key/value pairs. Array: number of elements. String: length in bytes.
+        uint32_t length;
+    };
+
+    class Document;
+
+    // Handle to an entry of a Document, cheap to copy. Only valid while its document is alive and not parsed again.
+    class Value {
+        const Document *document;
+        uint32_t index;
+
+        // Index of the entry following this value and its nested entries.
+        uint32_t skip() const;
+    public:
+        // Handle to nothing, exists() returns false.
+        Value();
+        Value(const Document *document, uint32_t index);
+
+        // False for missing keys, out of range indexes and invalid documents.
+        bool exists() const;
+
+        // Type of the value, Null if it does not exist.
+        JSONParser::JSONValueType getType() const;
+        bool isBoolean() const;
+        bool isInt() const;
+        bool isFloat() const;
+        bool isString() const;
+        bool isNull() const;
+        bool isMap() const;
+        bool isArray() const;
+
+        // Values are returned without warning, 0, 0.0f, false or "" when the type does not match.
+        bool getBoolean() const;
+        int getInt() const;
+        float getFloat() const;
+        // String unescaped on each call.
+        std::string getString() const;
+
+        /** Characters of a string as written in the message, escape sequences included. Nothing is copied.
+        *
+        * @param length number of characters, only set for strings.
+        * @return first character, NULL if the value is not a string.
+        */
+        const char* getRaw(size_t *length) const;
+
+        // True if the value is a string with escape sequences.
+        bool hasEscape() const;
+
+        /** Unescape a string into a buffer, without allocation.
+        *
+        * @param buffer output buffer, not null terminated.
+        * @param capacity size of the output buffer.
+        * @param length number of bytes written.
+        * @return false if the value is not a string or does not fit.
+        */
+        bool copyString(char *buffer, size_t capacity, size_t *length) const;
+
+        /** Compare a string value with a null terminated string, without unescaping when the value has no escape sequence.
+        *
+        * @param str string to compare with.
+        * @return true if the value is a string equal to str.
+        */
+        bool equals(const char *str) const;
+
+        // Number of elements of an array or pairs of an object, 0 for other types.
+        size_t size() const;
+
+        // First element of an array or first key of an object, does not exist if the container is empty.
+        Value first() const;
+
+        // Entry after this value and its nested values: next element of an array, value of a key or key after a value. Count with size() to stay in the container.
+        Value next() const;
+
+        /** Element of an array.
+        *
+        * @param i index of the element, previous elements are skipped without being read.
+        * @return element, or a Value that does not exist.
+        */
+        Value at(size_t i) const;
+
+        /** Value of an object key.
+        *
+        * @param key key to look for, values of other keys are skipped without being read.
+        * @return value, or a Value that does not exist.
+        */
+        Value find(const char *key) const;
+
+        // Eager copy of the value and its nested values, for code working with JSONValue.
+        JSONParser::JSONValue toJSONValue() const;
+
+        friend class Document;
+    };
+
+    class Document {
+        // Single allocation holding the tape followed by the null terminated copy of the source.
+        char *memory = NULL;
+        TapeEntry *tape = NULL;
+        const char *source = NULL;
+        uint32_t tape_length = 0;
+        bool isValid = false;
+        // Fixed storage used instead of the allocation when given.
+        TapeEntry *external_tape = NULL;
+        size_t external_tape_capacity = 0;
+        char *external_source = NULL;
+        size_t external_source_capacity = 0;
+
+        // Release the memory and mark the document invalid.
+        void clear();
+    public:
+        Document();
+
+        /** Constructor of Document parsing into fixed storage, nothing is allocated.
+        *
+        * @param tape storage of the tape entries.
+        * @param tape_capacity number of entries of the storage, longer messages are not valid.
+        * @param source storage of the copy of the message.
+        * @param source_capacity size of the source storage, the null terminator included.
+        */
+        Document(TapeEntry *tape, size_t tape_capacity, char *source, size_t source_capacity);
+        ~Document();
+        // Values point into the document, so it can't be copied.
+        Document(const Document&) = delete;
+        Document& operator=(const Document&) = delete;
+
+        /** Parse a whole JSON message.
+        *
+        * @param buffer JSON text, copied into the document.
+        * @param buffer_length size of the text.
+        * @param isRoot (optional) check that the message is an object or an array, like Deserialize. Disable it to parse a single value.
+        * @return false if the text is not valid JSON, an ERROR is logged.
+        */
+        bool parse(const char *buffer, size_t buffer_length, bool isRoot = true);
+
+        bool valid() const;
+
+        // Root value, does not exist if the document is not valid.
+        Value root() const;
+
+        // Number of entries of the tape.
+        size_t getTapeLength() const;
+
+        friend class Value;
+    };
+}
@@ -0,0 +1,150 @@
+/* LED controller
+ * Single long-lived controller for the built-in LED. Effects are precomputed duty cycle tables played
+ * by a Ticker interrupt, switching mode only updates the controller state and never creates a thread.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "led_controller.hpp"
+#include <cmath>
+
+using namespace Led;
+
+LedController::LedController(PwmOut *pwm): pwm(pwm) {};
+
+void LedController::writeValue(float value) {
+    this->pwm->write(value);
+    this->value = value;
+}
+
+void LedController::stopEffect() {
+    // Detach is safe to call even if the ticker is not running, no interrupt fires after it returns.
+    this->ticker.detach();
+    this->playing = false;
+    this->generation++;
+}
+
+void LedController::onWaveformTick() {
+    // Only a table lookup here, every sample is computed when the effect is set.
+    this->writeValue(this->table[this->table_index]);
+    this->table_index++;
+    if (this->table_index >= this->table_length) {
+        if (this->table_loop) {
+            this->table_index = 0;
+        } else {
+            this->ticker.detach();
+            this->playing = false;
+        }
+    }
+}
+
+void LedController::playTable(size_t length, std::chrono::microseconds step, bool loop) {
+    if (step < std::chrono::microseconds(LED_MIN_STEP_US))
+        step = std::chrono::microseconds(LED_MIN_STEP_US);
+
+    this->table_length = length;
+    this->table_loop = loop;
+    // Write the first sample now, as the first tick only comes after a full step.
+    this->writeValue(this->table[0]);
+    this->table_index = 1;
+    if (length > 1 || loop) {
+        this->playing = true;
+        this->ticker.attach(callback(this, &LedController::onWaveformTick), step);
+    }
+}
+
+bool LedController::isValidDuration(float seconds) {
+    return std::isfinite(seconds) && seconds >= 0.0f && seconds <= LED_MAX_DURATION_S;
+}
+
+float LedController::clampDuration(float seconds) {
+    // Checked before any conversion to an integer, NaN and out of range values would be undefined.
+    if (!(seconds > 0.0f)) return 0.0f;
+    if (seconds > LED_MAX_DURATION_S) seconds = LED_MAX_DURATION_S;
+    return seconds * 1000000.0f;
+}
+
+size_t LedController::samplesFor(float duration_seconds, std::chrono::microseconds *step) {
+    float duration_us = LedController::clampDuration(duration_seconds);
+    if (duration_us < LED_WAVEFORM_UPDATE_US) duration_us = LED_WAVEFORM_UPDATE_US;
+
+    size_t samples = duration_us / LED_WAVEFORM_UPDATE_US;
+    *step = std::chrono::microseconds(LED_WAVEFORM_UPDATE_US);
+    if (samples > LED_WAVEFORM_MAX_SAMPLES) {
+        // Long effects use fewer updates per second to fit in the table.
+        samples = LED_WAVEFORM_MAX_SAMPLES;
+        *step = std::chrono::microseconds(static_cast<int64_t>(duration_us / LED_WAVEFORM_MAX_SAMPLES));
+    }
+    return samples;
+}
+
+void LedController::setOn(bool on) {
+    this->stopEffect();
+    this->writeValue(on ? 1.0f : 0.0f);
+    this->mode = LedMode::ON_OFF;
+}
+
+void LedController::setPwm(float value) {
+    this->stopEffect();
+    this->writeValue(value);
+    this->mode = LedMode::PWM;
+}
+
+void LedController::setBlink(float delay_seconds) {
+    this->stopEffect();
+    // Blinking is a two samples looping table.
+    this->table[0] = 1.0f;
+    this->table[1] = 0.0f;
+    this->mode = LedMode::BLINK;
+    this->playTable(2, std::chrono::microseconds(static_cast<int64_t>(LedController::clampDuration(delay_seconds))), true);
+}
+
+void LedController::setFade(float from, float to, float duration_seconds) {
+    this->stopEffect();
+    std::chrono::microseconds step;
+    size_t samples = LedController::samplesFor(duration_seconds, &step);
+    // Last sample is exactly the target value.
+    for (size_t i = 0; i < samples; i++) {
+        this->table[i] = from + (to - from) * (i + 1) / samples;
+    }
+    this->mode = LedMode::FADE;
+    this->playTable(samples, step, false);
+}
+
+void LedController::setBreathe(float period_seconds) {
+    this->stopEffect();
+    std::chrono::microseconds step;
+    size_t samples = LedController::samplesFor(period_seconds, &step);
+    for (size_t i = 0; i < samples; i++) {
+        // Raised cosine from 0 to 1 and back, then gamma corrected.
+        float linear = 0.5f - 0.5f * std::cos(2.0f * static_cast<float>(M_PI) * i / samples);
+        this->table[i] = std::pow(linear, LED_BREATHE_GAMMA);
+    }
+    this->mode = LedMode::BREATHE;
+    this->playTable(samples, step, true);
+}
+
+bool LedController::setSequence(const float *samples, size_t count, float step_seconds, bool loop) {
+    if (count == 0 || count > LED_WAVEFORM_MAX_SAMPLES) return false;
+
+    this->stopEffect();
+    std::memcpy(this->table, samples, count * sizeof(float));
+    this->mode = LedMode::SEQUENCE;
+    this->playTable(count, std::chrono::microseconds(static_cast<int64_t>(LedController::clampDuration(step_seconds))), loop);
+    return true;
+}
+
+LedMode LedController::getMode() {
+    return this->mode;
+}
+
+bool LedController::isPlaying() {
+    return this->playing;
+}
+
+uint32_t LedController::getGeneration() {
+    return this->generation;
+}
+
+float LedController::getValue() {
+    return this->value;
+}
\ No newline at end of file
@@ -0,0 +1,143 @@
+/* LED controller
+ * Single long-lived controller for the built-in LED. Effects are precomputed duty cycle tables played
+ * by a Ticker interrupt, switching mode only updates the controller state and never creates a thread.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+#include "mbed.h"
+
+// Maximum number of samples of a waveform table. Can be overridden with "led-waveform-max-samples" in mbed_app.json.
+#ifdef MBED_CONF_APP_LED_WAVEFORM_MAX_SAMPLES
+#define LED_WAVEFORM_MAX_SAMPLES MBED_CONF_APP_LED_WAVEFORM_MAX_SAMPLES
+#else
+#define LED_WAVEFORM_MAX_SAMPLES 256
+#endif
+
+// Delay between two samples of generated waveforms (fade and breathe), in microseconds. Stretched if the table would not fit.
+#ifdef MBED_CONF_APP_LED_WAVEFORM_UPDATE_US
+#define LED_WAVEFORM_UPDATE_US MBED_CONF_APP_LED_WAVEFORM_UPDATE_US
+#else
+#define LED_WAVEFORM_UPDATE_US 4000
+#endif
+
+// Shortest delay between two samples, in microseconds.
+#define LED_MIN_STEP_US 1000
+// Longest duration of an effect or delay between two samples, in seconds.
+#define LED_MAX_DURATION_S 3600
+// Gamma applied to the breathing curve so that the perceived brightness is smooth.
+#define LED_BREATHE_GAMMA 2.2f
+
+namespace Led {
+    // Modes of the LED, values match the "mode" key of the serial commands.
+    enum LedMode {
+        ON_OFF = 0,
+        PWM = 1,
+        BLINK = 2,
+        FADE = 3,
+        BREATHE = 4,
+        SEQUENCE = 5,
+    };
+
+    class LedController {
+        PwmOut *pwm;
+        Ticker ticker;
+        volatile LedMode mode = LedMode::ON_OFF;
+        // Last duty cycle written, read from any thread.
+        volatile float value = 0.0f;
+
+        // Waveform currently played by the ticker interrupt.
+        float table[LED_WAVEFORM_MAX_SAMPLES];
+        volatile size_t table_length = 0;
+        volatile size_t table_index = 0;
+        volatile bool table_loop = false;
+        // True while the ticker plays the table.
+        volatile bool playing = false;
+        // Incremented each time the effect is changed.
+        volatile uint32_t generation = 0;
+
+        // Ticker interrupt handler, write the next sample of the table.
+        void onWaveformTick();
+        // Stop any running effect. Must be called before changing the table.
+        void stopEffect();
+        void writeValue(float value);
+        /** Start playing the first length samples of the table.
+        *
+        * @param length number of samples.
+        * @param step delay between two samples, clamped to LED_MIN_STEP_US.
+        * @param loop restart from the first sample at the end, else the last sample is kept.
+        */
+        void playTable(size_t length, std::chrono::microseconds step, bool loop);
+        // Number of samples and delay between them to cover duration at LED_WAVEFORM_UPDATE_US.
+        static size_t samplesFor(float duration_seconds, std::chrono::microseconds *step);
+        // Duration in microseconds, clamped to [0, LED_MAX_DURATION_S] and 0 if not finite.
+        static float clampDuration(float seconds);
+    public:
+        /** Constructor of LedController.
+        *
+        * @param pwm reference to the PwmOut driving the LED.
+        */
+        LedController(PwmOut *pwm);
+
+        /** True if a duration can be given to an effect as is, durations are clamped otherwise.
+        *
+        * @param seconds duration or delay in seconds.
+        * @return false if it is not finite, negative or longer than LED_MAX_DURATION_S.
+        */
+        static bool isValidDuration(float seconds);
+
+        /** Switch the LED fully on or off.
+        *
+        * @param on true to switch on.
+        */
+        void setOn(bool on);
+
+        /** Set a constant brightness.
+        *
+        * @param value duty cycle between 0.0 and 1.0.
+        */
+        void setPwm(float value);
+
+        /** Blink the LED.
+        *
+        * @param delay_seconds delay between on and off state in seconds, rounded to the microsecond and clamped to [LED_MIN_STEP_US, LED_MAX_DURATION_S].
+        */
+        void setBlink(float delay_seconds);
+
+        /** Linear fade between two brightness, the final brightness is kept at the end.
+        *
+        * @param from starting duty cycle between 0.0 and 1.0.
+        * @param to final duty cycle between 0.0 and 1.0.
+        * @param duration_seconds duration of the fade in seconds, clamped to LED_MAX_DURATION_S.
+        */
+        void setFade(float from, float to, float duration_seconds);
+
+        /** Gamma corrected breathing effect, looping forever.
+        *
+        * @param period_seconds duration of one full breath in seconds, clamped to LED_MAX_DURATION_S.
+        */
+        void setBreathe(float period_seconds);
+
+        /** Play custom steps.
+        *
+        * @param samples duty cycles between 0.0 and 1.0.
+        * @param count number of samples, at most LED_WAVEFORM_MAX_SAMPLES.
+        * @param step_seconds delay between two steps in seconds, clamped to [LED_MIN_STEP_US, LED_MAX_DURATION_S].
+        * @param loop restart from the first step at the end, else the last step is kept.
+        * @return false if there is no sample or too many samples, the current effect is then left unchanged.
+        */
+        bool setSequence(const float *samples, size_t count, float step_seconds, bool loop);
+
+        // Current mode of the LED.
+        LedMode getMode();
+
+        // True while an effect is being played. Looping effects play until the mode changes.
+        bool isPlaying();
+
+        // Identifier of the current effect, changes every time a mode is set.
+        uint32_t getGeneration();
+
+        // Current duty cycle of the LED.
+        float getValue();
+    };
+}
\ No newline at end of file
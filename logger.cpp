@@ -1,50 +1,416 @@
 #include "logger.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+#include <cerrno>
 
 using namespace Log;
 Logger* Logger::instance = NULL;
 
-Logger::Logger(BufferedSerial *pbs): pbs(pbs), log_level(LogFrameType::ERROR) {
+// Prefix written before the message of a frame for each level. RELEASE and BINARY frames are left unformatted.
+static const char* const LOG_LEVEL_PREFIX[LOG_LEVEL_COUNT] = {"[DEBUG] -> ", "[INFO] -> ", "[WARNING] -> ", "[ERROR] -> ", "", ""};
+
+LogSink::LogSink(LogFrameType level): level(level) {};
+
+LogFrameType LogSink::getLevel() const {
+    return this->level;
+}
+void LogSink::setLevel(LogFrameType level) {
+    this->level = level;
+}
+bool LogSink::isImmediate() const {
+    return false;
+}
+bool LogSink::writable() {
+    return true;
+}
+void LogSink::writeFrame(Timestamp::Ticks timestamp, LogFrameType type, const char* msg, size_t length) {
+#if LOG_TIMESTAMPS
+    if (type < LogFrameType::RELEASE) {
+        // Seconds with microseconds precision, or nanoseconds if the source is precise enough.
+        char time_prefix[32];
+        uint64_t ns = Timestamp::toNanoseconds(timestamp);
+        int time_length;
+        if (Timestamp::ticksPerSecond() > 1000000)
+            time_length = std::snprintf(time_prefix, sizeof(time_prefix), "[%lu.%09lu]", (unsigned long)(ns / 1000000000ULL), (unsigned long)(ns % 1000000000ULL));
+        else
+            time_length = std::snprintf(time_prefix, sizeof(time_prefix), "[%lu.%06lu]", (unsigned long)(ns / 1000000000ULL), (unsigned long)(ns % 1000000000ULL / 1000));
+        if (time_length > 0)
+            this->write(time_prefix, std::min<size_t>(time_length, sizeof(time_prefix) - 1));
+    }
+#else
+    (void)timestamp;
+#endif
+    const char* prefix = LOG_LEVEL_PREFIX[type];
+    this->write(prefix, std::strlen(prefix));
+    this->write(msg, length);
+    // Binary messages delimit themselves.
+    if (type != LogFrameType::BINARY)
+        this->write("\r\n", 2);
+}
+void LogSink::flush() {}
+
+BatchingLogSink::BatchingLogSink(LogFrameType level, size_t batch_threshold): LogSink(level), batch_threshold(std::min<size_t>(batch_threshold, LOG_SINK_BATCH_LENGTH)) {};
+
+void BatchingLogSink::write(const char* data, size_t length) {
+    // Make room in the batch if the new data does not fit.
+    if (this->batch_length + length > this->batch_threshold)
+        this->flush();
+    // Data bigger than the batch is written directly.
+    if (length > this->batch_threshold) {
+        this->writeOut(data, length);
+        return;
+    }
+    std::memcpy(this->batch + this->batch_length, data, length);
+    this->batch_length += length;
+}
+void BatchingLogSink::flush() {
+    if (this->batch_length > 0) {
+        this->writeOut(this->batch, this->batch_length);
+        this->batch_length = 0;
+    }
+}
+
+SerialLogSink::SerialLogSink(BufferedSerial *pbs, LogFrameType level, size_t batch_threshold): BatchingLogSink(level, batch_threshold), pbs(pbs) {};
+
+bool SerialLogSink::writable() {
+    return this->pbs->writable();
+}
+void SerialLogSink::writeOut(const char* data, size_t length) {
+    // The receive loop of a channel switches its serial to non-blocking, writes may then be partial.
+    while (length > 0) {
+        ssize_t written = this->pbs->write(data, length);
+        if (written > 0) {
+            Metrics::count(Metrics::Counter::BYTES_OUT, written);
+            data += written;
+            length -= written;
+        } else if (written == 0 || written == -EAGAIN) {
+            // Transmit buffer is full, let the serial interrupt drain it.
+            ThisThread::sleep_for(std::chrono::milliseconds(LOG_SINK_WRITE_RETRY_MS));
+        } else {
+            // Serial error, the rest of the data is lost.
+            return;
+        }
+    }
+}
+
+FileLogSink::FileLogSink(FILE *file, LogFrameType level, size_t batch_threshold): BatchingLogSink(level, batch_threshold), file(file) {};
+
+void FileLogSink::writeOut(const char* data, size_t length) {
+    std::fwrite(data, 1, length, this->file);
+}
+void FileLogSink::flush() {
+    BatchingLogSink::flush();
+    std::fflush(this->file);
+}
+
+RamLogSink::RamLogSink(LogFrameType level): LogSink(level) {};
+
+bool RamLogSink::isImmediate() const {
+    return true;
+}
+void RamLogSink::write(const char* data, size_t length) {
+    // Only the end of data bigger than the ring can be kept.
+    if (length > LOG_CRASH_BUFFER_LENGTH) {
+        data += length - LOG_CRASH_BUFFER_LENGTH;
+        length = LOG_CRASH_BUFFER_LENGTH;
+    }
+    size_t first_part = std::min(length, LOG_CRASH_BUFFER_LENGTH - this->ring_head);
+    std::memcpy(this->ring + this->ring_head, data, first_part);
+    std::memcpy(this->ring, data + first_part, length - first_part);
+    if (this->ring_head + length >= LOG_CRASH_BUFFER_LENGTH) this->wrapped = true;
+    this->ring_head = (this->ring_head + length) % LOG_CRASH_BUFFER_LENGTH;
+}
+void RamLogSink::writeFrame(Timestamp::Ticks timestamp, LogFrameType type, const char* msg, size_t length) {
+    // Frames are written from any thread, lock so that frames are not interleaved.
+    this->ring_mutex.lock();
+    LogSink::writeFrame(timestamp, type, msg, length);
+    this->ring_mutex.unlock();
+}
+void RamLogSink::dumpTo(LogSink *sink) {
+    this->ring_mutex.lock();
+    if (this->wrapped)
+        sink->write(this->ring + this->ring_head, LOG_CRASH_BUFFER_LENGTH - this->ring_head);
+    sink->write(this->ring, this->ring_head);
+    this->ring_mutex.unlock();
+    sink->flush();
+}
+void RamLogSink::clear() {
+    this->ring_mutex.lock();
+    this->ring_head = 0;
+    this->wrapped = false;
+    this->ring_mutex.unlock();
+}
+
+Logger::Logger(): serial_sink(NULL, LogFrameType::RELEASE) {
     Logger::instance = this;
 };
-Logger::Logger(BufferedSerial *pbs, LogFrameType log_level): pbs(pbs), log_level(log_level) {
+Logger::Logger(BufferedSerial *pbs): serial_sink(pbs, LogFrameType::ERROR) {
     Logger::instance = this;
+    this->addSink(&this->serial_sink);
+};
+Logger::Logger(BufferedSerial *pbs, LogFrameType log_level): serial_sink(pbs, log_level) {
+    Logger::instance = this;
+    this->addSink(&this->serial_sink);
 };
 
+bool Logger::addSink(LogSink *sink) {
+    if (this->sink_count >= LOG_MAX_SINKS) return false;
+    this->sinks[this->sink_count++] = sink;
 
-void Logger::flushLogToSerial() {
-    while (!log_queue.empty()) {
-        if (this->pbs->writable()) {
-            std::string bufToWrite;
-            Log::LoggerFrame log = this->log_queue.front();
-
-            if (log.type < LogFrameType::RELEASE)
-                bufToWrite.append("[");
-            switch (log.type) {
-                case LogFrameType::DEBUG:
-                    bufToWrite.append("DEBUG");
-                    break;
-                case LogFrameType::INFO:
-                    bufToWrite.append("INFO");
-                    break;
-                case LogFrameType::WARNING:
-                    bufToWrite.append("WARNING");
-                    break;
-                case LogFrameType::ERROR:
-                    bufToWrite.append("ERROR");
-                    break;
-                default:break;
+    // Update filters so that frames are only formatted if at least one sink needs them.
+    if (sink->isImmediate())
+        this->immediate_level.store(std::min<int>(this->immediate_level.load(), sink->getLevel()));
+    else
+        this->queued_level.store(std::min<int>(this->queued_level.load(), sink->getLevel()));
+    return true;
+}
+
+void Logger::writeImmediate(Timestamp::Ticks timestamp, LogFrameType type, const char* msg, size_t length) {
+    for (size_t i = 0; i < this->sink_count; i++) {
+        if (this->sinks[i]->isImmediate() && type >= this->sinks[i]->getLevel())
+            this->sinks[i]->writeFrame(timestamp, type, msg, length);
+    }
+}
+
+void Logger::dumpToSinks(RamLogSink *ram) {
+    this->flush_mutex.lock();
+    for (size_t i = 0; i < this->sink_count; i++) {
+        if (!this->sinks[i]->isImmediate())
+            ram->dumpTo(this->sinks[i]);
+    }
+    this->flush_mutex.unlock();
+}
+
+bool Logger::reserveSlot(LogFrameType type, bool dry_run) {
+    size_t limit = LOG_QUEUE_CAPACITY;
+    if (this->overflow_policy == LogOverflowPolicy::PRIORITY) {
+        // Slots reserved for higher levels are not available for this frame.
+        for (int level = type + 1; level < LOG_LEVEL_COUNT; level++) {
+            limit = (this->reserved_slots[level] < limit) ? limit - this->reserved_slots[level] : 0;
+        }
+    }
+    if (this->queue_count < limit) return true;
+
+    switch (this->overflow_policy) {
+        case LogOverflowPolicy::DROP_OLDEST:{
+            if (this->queue_count == 0) break;
+            if (!dry_run) {
+                this->dropped_total[this->log_queue[this->queue_head].type]++;
+                this->dropped_since_summary[this->log_queue[this->queue_head].type]++;
+                Metrics::count(Metrics::Counter::LOG_DROPS);
+                this->eraseFrame(0);
             }
-            if (log.type < LogFrameType::RELEASE)
-                bufToWrite.append("] -> ");
-            bufToWrite.append(log.msg);
-            bufToWrite.append("\r\n");
+            return true;
+        };break;
+        case LogOverflowPolicy::PRIORITY:{
+            // Only ERROR, RELEASE and BINARY frames can evict lower level frames.
+            if (type < LogFrameType::ERROR || this->queue_count < LOG_QUEUE_CAPACITY) break;
+            for (size_t i = 0; i < this->queue_count; i++) {
+                LoggerFrame& frame = this->log_queue[(this->queue_head + i) % LOG_QUEUE_CAPACITY];
+                if (frame.type < LogFrameType::ERROR) {
+                    if (!dry_run) {
+                        this->dropped_total[frame.type]++;
+                        this->dropped_since_summary[frame.type]++;
+                        Metrics::count(Metrics::Counter::LOG_DROPS);
+                        this->eraseFrame(i);
+                    }
+                    return true;
+                }
+            }
+        };break;
+        default:break;
+    }
 
-            this->pbs->write(bufToWrite.c_str(), bufToWrite.size());
-            this->log_queue.pop_front();
-        } else {
-            break;
+    // No room for the frame.
+    this->dropped_total[type]++;
+    this->dropped_since_summary[type]++;
+    Metrics::count(Metrics::Counter::LOG_DROPS);
+    return false;
+}
+
+void Logger::pushFrame(LogFrameType type, Timestamp::Ticks timestamp, const char* msg, size_t length) {
+    LoggerFrame& frame = this->log_queue[(this->queue_head + this->queue_count) % LOG_QUEUE_CAPACITY];
+    if (this->queue_count == 0) {
+        // No frame to chain with: restart from the time of this one, so that a gap saturated by an idle period is not carried over.
+        if (timestamp > this->last_push_ticks) this->last_push_ticks = timestamp;
+        this->queue_base_ticks = this->last_push_ticks;
+    }
+    // Frames of different threads may be pushed slightly out of order, never store negative deltas.
+    Timestamp::Ticks delta = (timestamp > this->last_push_ticks) ? timestamp - this->last_push_ticks : 0;
+    if (delta > UINT32_MAX) delta = UINT32_MAX;
+    this->last_push_ticks += delta;
+    frame.timestamp_delta = delta;
+    frame.type = type;
+#if NO_HEAP
+    frame.length = std::min<size_t>(length, LOG_FRAME_LENGTH);
+    std::memcpy(frame.msg, msg, frame.length);
+#else
+    // Assign keep the already allocated capacity of the slot.
+    frame.msg.assign(msg, length);
+#endif
+    this->queue_count++;
+}
+
+void Logger::eraseFrame(size_t position) {
+    LoggerFrame& erased = this->log_queue[(this->queue_head + position) % LOG_QUEUE_CAPACITY];
+    if (position + 1 < this->queue_count) {
+        // Keep following frames times by moving the erased delta to the next frame.
+        LoggerFrame& next = this->log_queue[(this->queue_head + position + 1) % LOG_QUEUE_CAPACITY];
+        uint64_t delta = (uint64_t)next.timestamp_delta + erased.timestamp_delta;
+        next.timestamp_delta = (delta > UINT32_MAX) ? UINT32_MAX : delta;
+    } else if (position == 0) {
+        this->queue_base_ticks += erased.timestamp_delta;
+    } else {
+        // Erased frame was the last one, the next pushed frame will carry its delta.
+        this->last_push_ticks -= erased.timestamp_delta;
+    }
+    if (position == 0) {
+        // Removing the oldest frame only moves the head.
+        this->queue_head = (this->queue_head + 1) % LOG_QUEUE_CAPACITY;
+        this->queue_count--;
+        return;
+    }
+    // Shift following frames one slot toward the head, swapping strings avoid any copy.
+    for (size_t i = position; i + 1 < this->queue_count; i++) {
+        LoggerFrame& current = this->log_queue[(this->queue_head + i) % LOG_QUEUE_CAPACITY];
+        LoggerFrame& next = this->log_queue[(this->queue_head + i + 1) % LOG_QUEUE_CAPACITY];
+        current.timestamp_delta = next.timestamp_delta;
+        current.type = next.type;
+#if NO_HEAP
+        current.length = next.length;
+        std::memcpy(current.msg, next.msg, next.length);
+#else
+        current.msg.swap(next.msg);
+#endif
+    }
+    this->queue_count--;
+}
+
+void Logger::writeDropSummary() {
+    std::chrono::milliseconds now = Kernel::Clock::now().time_since_epoch();
+    if (now - this->last_summary_timestamp < std::chrono::milliseconds(LOG_DROP_SUMMARY_PERIOD_MS)) return;
+
+    this->queue_mutex.lock();
+    uint32_t dropped[LOG_LEVEL_COUNT];
+    uint32_t dropped_sum = 0;
+    for (int level = 0; level < LOG_LEVEL_COUNT; level++) {
+        dropped[level] = this->dropped_since_summary[level];
+        dropped_sum += dropped[level];
+        this->dropped_since_summary[level] = 0;
+    }
+    this->queue_mutex.unlock();
+
+    if (dropped_sum == 0) return;
+    this->last_summary_timestamp = now;
+
+    int length = std::snprintf(this->log_buffer, LOG_BUFFER_LENGTH, "Log queue full, dropped frames: DEBUG=%lu INFO=%lu WARNING=%lu ERROR=%lu RELEASE=%lu BINARY=%lu",
+        (unsigned long)dropped[LogFrameType::DEBUG], (unsigned long)dropped[LogFrameType::INFO], (unsigned long)dropped[LogFrameType::WARNING],
+        (unsigned long)dropped[LogFrameType::ERROR], (unsigned long)dropped[LogFrameType::RELEASE], (unsigned long)dropped[LogFrameType::BINARY]);
+    if (length <= 0) return;
+    length = std::min(length, LOG_BUFFER_LENGTH - 1);
+    for (size_t i = 0; i < this->sink_count; i++) {
+        if (!this->sinks[i]->isImmediate())
+            this->sinks[i]->writeFrame(Timestamp::now(), LogFrameType::WARNING, this->log_buffer, length);
+    }
+}
+
+bool Logger::sinksWritable() {
+    for (size_t i = 0; i < this->sink_count; i++) {
+        if (!this->sinks[i]->isImmediate() && !this->sinks[i]->writable())
+            return false;
+    }
+    return true;
+}
+
+void Logger::addFrame(LogFrameType type, bool toImmediate, bool toQueue, const char* msg, size_t length) {
+    Timestamp::Ticks timestamp = Timestamp::now();
+    if (toImmediate)
+        this->writeImmediate(timestamp, type, msg, length);
+    if (!toQueue) return;
+
+    // Push frame to queue waiting to be flush. Space is checked again as another thread may have filled the queue meanwhile.
+    this->queue_mutex.lock();
+    if (this->reserveSlot(type, false))
+        this->pushFrame(type, timestamp, msg, length);
+    this->queue_mutex.unlock();
+}
+
+void Logger::addRawToQueue(LogFrameType type, const char* msg, size_t length) {
+    bool toImmediate = type >= this->immediate_level.load(std::memory_order_relaxed);
+    bool toQueue = type >= this->queued_level.load(std::memory_order_relaxed);
+    if ((!toImmediate && !toQueue) || length == 0) return;
+    this->addFrame(type, toImmediate, toQueue, msg, length);
+}
+
+void Logger::flushLogToSerial() {
+    this->flush_mutex.lock();
+    Timestamp::Ticks start = Timestamp::now();
+    bool isFlushing = this->getQueueSize() > 0;
+    this->writeDropSummary();
+
+    Log::LoggerFrame log;
+    // Frames are kept in the queue while a sink can't accept them.
+    while (this->getQueueSize() > 0 && this->sinksWritable()) {
+        // Take front frame out of the ring so that the lock is not held while writing.
+        this->queue_mutex.lock();
+        LoggerFrame& front = this->log_queue[this->queue_head];
+        this->queue_base_ticks += front.timestamp_delta;
+        Timestamp::Ticks timestamp = this->queue_base_ticks;
+        log.type = front.type;
+#if NO_HEAP
+        log.length = front.length;
+        std::memcpy(log.msg, front.msg, front.length);
+#else
+        log.msg.swap(front.msg);
+#endif
+        this->queue_head = (this->queue_head + 1) % LOG_QUEUE_CAPACITY;
+        this->queue_count--;
+        this->queue_mutex.unlock();
+
+        for (size_t i = 0; i < this->sink_count; i++) {
+            if (!this->sinks[i]->isImmediate() && log.type >= this->sinks[i]->getLevel())
+#if NO_HEAP
+                this->sinks[i]->writeFrame(timestamp, log.type, log.msg, log.length);
+#else
+                this->sinks[i]->writeFrame(timestamp, log.type, log.msg.data(), log.msg.size());
+#endif
         }
     }
+
+    // Output what is left in the sinks batches.
+    for (size_t i = 0; i < this->sink_count; i++) {
+        if (!this->sinks[i]->isImmediate())
+            this->sinks[i]->flush();
+    }
+    // Idle flushes would hide the cost of the real ones.
+    if (isFlushing) Metrics::record(Metrics::Probe::LOG_FLUSH, start);
+    this->flush_mutex.unlock();
+}
+
+void Logger::setOverflowPolicy(LogOverflowPolicy policy) {
+    this->queue_mutex.lock();
+    this->overflow_policy = policy;
+    this->queue_mutex.unlock();
+}
+
+void Logger::setReservedSlots(LogFrameType type, size_t slots) {
+    this->queue_mutex.lock();
+    this->reserved_slots[type] = slots;
+    this->queue_mutex.unlock();
+}
+
+uint32_t Logger::getDroppedCount(LogFrameType type) {
+    this->queue_mutex.lock();
+    uint32_t count = this->dropped_total[type];
+    this->queue_mutex.unlock();
+    return count;
+}
+
+size_t Logger::getQueueSize() {
+    this->queue_mutex.lock();
+    size_t count = this->queue_count;
+    this->queue_mutex.unlock();
+    return count;
 }
 
 Logger* Logger::getInstance() {
@@ -1,35 +1,277 @@
 #pragma once
 #include "mbed.h"
+#include "timestamp.hpp"
+#include "heap_guard.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
 #include <string>
 #include <list>
 #include <vector>
 
 #define LOG_BUFFER_LENGTH 256
 
+// Maximum number of frames waiting to be flushed. Can be overridden with "log-queue-capacity" in mbed_app.json.
+#ifdef MBED_CONF_APP_LOG_QUEUE_CAPACITY
+#define LOG_QUEUE_CAPACITY MBED_CONF_APP_LOG_QUEUE_CAPACITY
+#else
+#define LOG_QUEUE_CAPACITY 32
+#endif
+
+// Number of queue slots kept for ERROR (RELEASE and BINARY) frames when using the PRIORITY overflow policy.
+#ifdef MBED_CONF_APP_LOG_QUEUE_RESERVED_SLOTS
+#define LOG_QUEUE_RESERVED_SLOTS MBED_CONF_APP_LOG_QUEUE_RESERVED_SLOTS
+#else
+#define LOG_QUEUE_RESERVED_SLOTS 8
+#endif
+
+// Minimal delay in milliseconds between two dropped frames summary lines.
+#ifdef MBED_CONF_APP_LOG_DROP_SUMMARY_PERIOD_MS
+#define LOG_DROP_SUMMARY_PERIOD_MS MBED_CONF_APP_LOG_DROP_SUMMARY_PERIOD_MS
+#else
+#define LOG_DROP_SUMMARY_PERIOD_MS 5000
+#endif
+
+// Size in bytes of the in-RAM post-mortem log ring. Can be overridden with "log-crash-buffer-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_LOG_CRASH_BUFFER_LENGTH
+#define LOG_CRASH_BUFFER_LENGTH MBED_CONF_APP_LOG_CRASH_BUFFER_LENGTH
+#else
+#define LOG_CRASH_BUFFER_LENGTH 2048
+#endif
+
+// Capacity in bytes of the message of a frame in the no-heap build, longer messages are truncated. Can be overridden with "log-frame-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_LOG_FRAME_LENGTH
+#define LOG_FRAME_LENGTH MBED_CONF_APP_LOG_FRAME_LENGTH
+#else
+#define LOG_FRAME_LENGTH 256
+#endif
+
+// Size in bytes of the batch buffer of each buffered sink.
+#define LOG_SINK_BATCH_LENGTH 128
+// Delay before writing again to a non-blocking serial whose transmit buffer is full, in milliseconds.
+#define LOG_SINK_WRITE_RETRY_MS 1
+// Maximum number of sinks attached to a Logger.
+#define LOG_MAX_SINKS 4
+
+// Prefix formatted frames with their timestamp. Can be disabled with "log-timestamps" in mbed_app.json.
+#ifdef MBED_CONF_APP_LOG_TIMESTAMPS
+#define LOG_TIMESTAMPS MBED_CONF_APP_LOG_TIMESTAMPS
+#else
+#define LOG_TIMESTAMPS 1
+#endif
+
+#define LOG_LEVEL_COUNT 6
+
 namespace Log {
-    // Log frame possible types. Level of logs affect displayed informations and filters. Note that RELEASE is the only flag that provides no formatting at all and leave the ouput unchanged. 
+    // Log frame possible types. Level of logs affect displayed informations and filters. Note that RELEASE and BINARY are the only flags that provide no formatting at all and leave the ouput unchanged. 
     enum LogFrameType {
         DEBUG = 0,
         INFO = 1,
         WARNING = 2,
         ERROR = 3,
         RELEASE = 4,
+        // Binary responses, written without line return.
+        BINARY = 5,
+    };
+
+    // Behaviour of the queue when a new frame is added while it is full.
+    enum LogOverflowPolicy {
+        // Incoming frame is discarded.
+        DROP_NEWEST = 0,
+        // Oldest waiting frame is discarded to make room for the incoming one.
+        DROP_OLDEST = 1,
+        // Each level can only use the slots not reserved for higher levels. When the queue is full, ERROR, RELEASE and BINARY frames evict the oldest lower level frame so they are never lost to lower level traffic.
+        PRIORITY = 2,
     };
 
     // Struct that represent a log frame. A frame is generated when using the addLogToQueue function. This struct is not meant to be use externally.
     struct LoggerFrame {
-        std::chrono::milliseconds timestamp;
+        // Ticks elapsed since the previous frame of the queue (see Timestamp). Saturated if the gap does not fit, the next push to an empty queue resyncs.
+        uint32_t timestamp_delta;
         LogFrameType type;
+#if NO_HEAP
+        char msg[LOG_FRAME_LENGTH];
+        size_t length;
+#else
         std::string msg;
+#endif
     };
 
-    class Logger {
-        std::list<LoggerFrame> log_queue;
-        LogFrameType log_level;
+    /** Output of the Logger. A sink receive every frame with a level equal or above its own level.
+    * Sinks are either flushed by the Logger flush thread (default) or written immediately from the thread adding the frame when isImmediate() is true.
+    */
+    class LogSink {
+    protected:
+        LogFrameType level;
+    public:
+        /** Constructor of LogSink.
+        *
+        * @param level minimal level below which frames will not be written to this sink.
+        */
+        LogSink(LogFrameType level);
+        virtual ~LogSink() {}
+
+        LogFrameType getLevel() const;
+        void setLevel(LogFrameType level);
+
+        // Immediate sinks are written when the frame is added, so they receive frames even if they never reach the queue.
+        virtual bool isImmediate() const;
+
+        // Return false if the sink can't accept data right now, frames are then kept in the queue.
+        virtual bool writable();
+
+        /** Write raw bytes to the sink.
+        *
+        * @param data bytes to write.
+        * @param length number of bytes.
+        */
+        virtual void write(const char* data, size_t length) = 0;
+
+        /** Write a frame formatted with its level prefix and line return.
+        *
+        * @param timestamp time at which the frame was added.
+        * @param type frame level.
+        * @param msg frame message.
+        * @param length message length.
+        */
+        virtual void writeFrame(Timestamp::Ticks timestamp, LogFrameType type, const char* msg, size_t length);
+
+        // Output any data kept in the sink batch.
+        virtual void flush();
+    };
+
+    // Sink that group small writes in a fixed size batch before handing them to writeOut.
+    class BatchingLogSink : public LogSink {
+        char batch[LOG_SINK_BATCH_LENGTH];
+        size_t batch_length = 0;
+        size_t batch_threshold;
+    protected:
+        // Output bytes to the underlying stream.
+        virtual void writeOut(const char* data, size_t length) = 0;
+    public:
+        /** Constructor of BatchingLogSink.
+        *
+        * @param level minimal level of frames written to this sink.
+        * @param batch_threshold number of bytes to accumulate before writing, 0 disables batching. Capped to LOG_SINK_BATCH_LENGTH.
+        */
+        BatchingLogSink(LogFrameType level, size_t batch_threshold);
+
+        void write(const char* data, size_t length) override;
+        void flush() override;
+    };
+
+    // Sink writing to a serial communication. Every byte is written even if the serial is non-blocking, waiting for room in its transmit buffer.
+    class SerialLogSink : public BatchingLogSink {
         BufferedSerial *pbs;
+    protected:
+        void writeOut(const char* data, size_t length) override;
+    public:
+        /** Constructor of SerialLogSink.
+        *
+        * @param pbs reference to a BufferedSerial communication where frames will be written.
+        * @param level minimal level of frames written to this sink.
+        * @param batch_threshold number of bytes to accumulate before writing, 0 disables batching.
+        */
+        SerialLogSink(BufferedSerial *pbs, LogFrameType level, size_t batch_threshold = LOG_SINK_BATCH_LENGTH);
+
+        bool writable() override;
+    };
+
+    // Sink writing to a C stream, for example stdout or a file on the host.
+    class FileLogSink : public BatchingLogSink {
+        FILE *file;
+    protected:
+        void writeOut(const char* data, size_t length) override;
+    public:
+        /** Constructor of FileLogSink.
+        *
+        * @param file opened stream, not closed by the sink.
+        * @param level minimal level of frames written to this sink.
+        * @param batch_threshold number of bytes to accumulate before writing, 0 disables batching.
+        */
+        FileLogSink(FILE *file, LogFrameType level, size_t batch_threshold = LOG_SINK_BATCH_LENGTH);
+
+        void flush() override;
+    };
+
+    // Immediate sink keeping the last LOG_CRASH_BUFFER_LENGTH bytes of logs in RAM. The oldest data is overwritten, content can be dumped on request for post-mortem analysis.
+    class RamLogSink : public LogSink {
+        char ring[LOG_CRASH_BUFFER_LENGTH];
+        size_t ring_head = 0;
+        bool wrapped = false;
+        Mutex ring_mutex;
+    public:
+        /** Constructor of RamLogSink.
+        *
+        * @param level minimal level of frames kept in RAM.
+        */
+        RamLogSink(LogFrameType level);
+
+        bool isImmediate() const override;
+        void write(const char* data, size_t length) override;
+        void writeFrame(Timestamp::Ticks timestamp, LogFrameType type, const char* msg, size_t length) override;
+
+        /** Write the content of the ring, oldest byte first, to another sink.
+        *
+        * @param sink destination sink. Flushed once the dump is written.
+        */
+        void dumpTo(LogSink *sink);
+
+        // Discard the content of the ring.
+        void clear();
+    };
+
+    class Logger {
+        // Fixed size ring buffer of frames, frames strings are reused between pushes.
+        LoggerFrame log_queue[LOG_QUEUE_CAPACITY];
+        size_t queue_head = 0;
+        size_t queue_count = 0;
+        // Time of the frame before the head and of the last pushed frame, frames only store deltas.
+        Timestamp::Ticks queue_base_ticks = 0;
+        Timestamp::Ticks last_push_ticks = 0;
+        Mutex queue_mutex;
+
+        LogOverflowPolicy overflow_policy = LogOverflowPolicy::PRIORITY;
+        // Number of slots reserved for each level (and so unusable by lower levels) with the PRIORITY policy.
+        size_t reserved_slots[LOG_LEVEL_COUNT] = {0, 0, 0, LOG_QUEUE_RESERVED_SLOTS, 0, 0};
+        // Dropped frames per level since boot and since last summary line.
+        uint32_t dropped_total[LOG_LEVEL_COUNT] = {0};
+        uint32_t dropped_since_summary[LOG_LEVEL_COUNT] = {0};
+        std::chrono::milliseconds last_summary_timestamp{0};
+
+        // Attached sinks. The level of a kind of sinks is the lowest level of these sinks, LOG_LEVEL_COUNT when there is none.
+        LogSink *sinks[LOG_MAX_SINKS] = {NULL};
+        size_t sink_count = 0;
+        // Read without lock by every thread adding a frame, so that filtered frames never wait for another thread.
+        std::atomic<int> queued_level{LOG_LEVEL_COUNT};
+        std::atomic<int> immediate_level{LOG_LEVEL_COUNT};
+        SerialLogSink serial_sink;
+        // Held while sinks are written by the flush thread.
+        Mutex flush_mutex;
+
         char log_buffer[LOG_BUFFER_LENGTH] = {0};
         static Logger* instance;
+
+        // Check if a frame of the given level can be queued, may evict an older frame depending on the policy when dry_run is false. Rejected frames are counted as dropped. Must be called with queue_mutex locked.
+        bool reserveSlot(LogFrameType type, bool dry_run);
+        // Store frame at the end of the ring. Must be called with queue_mutex locked and a slot reserved.
+        void pushFrame(LogFrameType type, Timestamp::Ticks timestamp, const char* msg, size_t length);
+        // Remove the frame at the given position (from head) by shifting the following ones. Must be called with queue_mutex locked.
+        void eraseFrame(size_t position);
+        // Write the dropped frames summary line if any frame was dropped during the last period. Must be called with flush_mutex locked.
+        void writeDropSummary();
+        // Check that every queued sink can accept data.
+        bool sinksWritable();
+        // Write a frame to every immediate sink accepting its level.
+        void writeImmediate(Timestamp::Ticks timestamp, LogFrameType type, const char* msg, size_t length);
+        // Write a formatted message to the immediate sinks and push it to the queue if requested.
+        void addFrame(LogFrameType type, bool toImmediate, bool toQueue, const char* msg, size_t length);
     public:
+        /** Constructor of Logger without any sink. The current instance will be use to populate singleton reference.
+        * Every frame is filtered out before formatting and without lock, host tools parsing from several threads use it to mute the parser.
+        */
+        Logger();
+
         /** Constructor of Logger. The current instance will be use to populate singleton reference.
         *
         * @param pbs reference to a BufferedSerial communication where frames will be flush.
@@ -39,10 +281,23 @@ namespace Log {
         /** Constructor of Logger. The current instance will be use to populate singleton reference.
         *
         * @param pbs reference to a BufferedSerial communication where frames will be flush.
-        * @param log_level minimal level below which log entries will be ignored. Log with level equal to log_level will be kept.
+        * @param log_level minimal level below which log entries will not be written to the serial. Log with level equal to log_level will be kept.
         */
         Logger(BufferedSerial *pbs, LogFrameType log_level);
 
+        /** Attach a new sink. Should be called before logging from several threads.
+        *
+        * @param sink sink to attach, must outlive the Logger.
+        * @return false if LOG_MAX_SINKS sinks are already attached.
+        */
+        bool addSink(LogSink *sink);
+
+        /** Dump a RAM sink to every queued sink, without level filtering.
+        *
+        * @param ram RAM sink to dump.
+        */
+        void dumpToSinks(RamLogSink *ram);
+
     
         /** Create log frame from parameters and push it to the queue. This function act like printf.
         *
@@ -51,33 +306,73 @@ namespace Log {
         * @param args are the arguments that need to be provided to format the string. 
         */
         template<typename ... Args>
-        void addLogToQueue(LogFrameType type, const std::string& format, Args ... args);
+        void addLogToQueue(LogFrameType type, const char* format, Args ... args);
 
-        // Empty the log queue by outputting all waiting frames to the define output stream.
+        /** Push an already formatted message to the queue, without going through printf.
+        *
+        * @param type is the log level. Any log below the defined filter will be ignored.
+        * @param msg message bytes, no null terminator needed.
+        * @param length number of bytes of the message.
+        */
+        void addRawToQueue(LogFrameType type, const char* msg, size_t length);
+
+        // Empty the log queue by outputting all waiting frames to the attached sinks.
         void flushLogToSerial();
 
+        /** Set what to do when a frame is added to a full queue.
+        *
+        * @param policy overflow policy, default is PRIORITY.
+        */
+        void setOverflowPolicy(LogOverflowPolicy policy);
+
+        /** Reserve queue slots for a level when using PRIORITY policy. Reserved slots can only be used by frames of this level or above.
+        *
+        * @param type level owning the slots.
+        * @param slots number of slots, sum of all reservations should stay below LOG_QUEUE_CAPACITY.
+        */
+        void setReservedSlots(LogFrameType type, size_t slots);
+
+        /** Number of frames of the given level dropped since boot because the queue was full.
+        *
+        * @param type log level.
+        */
+        uint32_t getDroppedCount(LogFrameType type);
+
+        // Number of frames currently waiting to be flushed.
+        size_t getQueueSize();
+
         // Singleton to the current Logger instance. Be carefull when using it, pointer may be undefined or dangling.
         static Logger* getInstance();
     };
     template<typename ... Args>
-    void Logger::addLogToQueue(LogFrameType type, const std::string& format, Args ... args) {
-        if (type >= this->log_level) {
+    void Logger::addLogToQueue(LogFrameType type, const char* format, Args ... args) {
+        bool toImmediate = type >= this->immediate_level.load(std::memory_order_relaxed);
+        bool toQueue = type >= this->queued_level.load(std::memory_order_relaxed);
+        if (toQueue) {
+            // Check for space first so that dropped frames are never formatted.
+            this->queue_mutex.lock();
+            toQueue = this->reserveSlot(type, true);
+            this->queue_mutex.unlock();
+        }
+        if (toImmediate || toQueue) {
+#if NO_HEAP
+            // Format on the stack, longer messages are truncated to the frame capacity.
+            char buf[LOG_FRAME_LENGTH];
+            int size_s = std::snprintf(buf, sizeof(buf), format, args ...);
+            if (size_s >= (int)sizeof(buf)) size_s = sizeof(buf) - 1;
+            if (size_s > 0)
+                this->addFrame(type, toImmediate, toQueue, buf, size_s);
+#else
             // snprintf without output buffer to precomputed necessary space.
-            int size_s = std::snprintf(nullptr, 0, format.c_str(), args ...);
+            int size_s = std::snprintf(nullptr, 0, format, args ...);
             if (size_s > 0) {
                 // Creating temp buffer with right size. Note +1 for null terminator
                 std::vector<char> buf(size_s + 1); 
                 // Insert formatted string inside buffer
-                std::sprintf(buf.data(), format.c_str(), args ...);
-
-                LoggerFrame frame;
-                frame.timestamp = Kernel::Clock::now().time_since_epoch();
-                frame.type = type;
-                frame.msg = std::string(buf.data(), buf.size());
-
-                // Push frame to queue waiting to be flush.
-                this->log_queue.push_back(frame);
+                std::sprintf(buf.data(), format, args ...);
+                this->addFrame(type, toImmediate, toQueue, buf.data(), size_s);
             }
+#endif
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,147 @@
+/* Memory stats
+ * Heap allocations made for each processed message and stack high-water marks of the watched threads.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "memory_stats.hpp"
+
+#if !defined(__MBED__)
+#include <atomic>
+#endif
+
+namespace {
+    // Counters of a watched thread, only written by the thread itself.
+    struct WatchedThread {
+        const char *name;
+        osThreadId_t id;
+        volatile uint32_t allocations;
+        volatile uint32_t frees;
+        volatile uint32_t bytes;
+    };
+    WatchedThread watched[MEMORY_STATS_MAX_THREADS];
+    // Entries are filled before being counted, so the allocator hook never reads a partial one.
+    volatile size_t watched_count = 0;
+    Mutex watch_mutex;
+
+    MemoryStats::MessageStats message_stats;
+    Mutex message_mutex;
+
+#if !defined(__MBED__)
+    // Mbed OS heap stats are not available on host, the hook gives the size of every operation.
+    std::atomic<uint32_t> heap_current(0);
+    std::atomic<uint32_t> heap_peak(0);
+#endif
+
+    WatchedThread* findThread(osThreadId_t id) {
+        size_t count = watched_count;
+        for (size_t i = 0; i < count; i++) {
+            if (watched[i].id == id) return &watched[i];
+        }
+        return NULL;
+    }
+}
+
+void MemoryStats::watchThread(const char *name) {
+    osThreadId_t id = ThisThread::get_id();
+    watch_mutex.lock();
+    if (findThread(id) == NULL && watched_count < MEMORY_STATS_MAX_THREADS) {
+        WatchedThread& thread = watched[watched_count];
+        thread.name = name;
+        thread.id = id;
+        thread.allocations = 0;
+        thread.frees = 0;
+        thread.bytes = 0;
+        watched_count = watched_count + 1;
+    }
+    watch_mutex.unlock();
+}
+
+MemoryStats::Usage MemoryStats::getThreadUsage() {
+    Usage usage;
+    WatchedThread *thread = findThread(ThisThread::get_id());
+    if (thread == NULL) return usage;
+    usage.allocations = thread->allocations;
+    usage.frees = thread->frees;
+    usage.bytes = thread->bytes;
+    return usage;
+}
+
+void MemoryStats::addSince(Usage *usage, const Usage& mark) {
+    Usage now = getThreadUsage();
+    usage->allocations += now.allocations - mark.allocations;
+    usage->frees += now.frees - mark.frees;
+    usage->bytes += now.bytes - mark.bytes;
+}
+
+void MemoryStats::recordMessage(const Usage& usage) {
+    message_mutex.lock();
+    message_stats.count++;
+    message_stats.total.allocations += usage.allocations;
+    message_stats.total.frees += usage.frees;
+    message_stats.total.bytes += usage.bytes;
+    if (usage.allocations > message_stats.max_allocations) message_stats.max_allocations = usage.allocations;
+    if (usage.bytes > message_stats.max_bytes) message_stats.max_bytes = usage.bytes;
+    message_mutex.unlock();
+}
+
+MemoryStats::MessageStats MemoryStats::getMessageStats() {
+    message_mutex.lock();
+    MessageStats stats = message_stats;
+    message_mutex.unlock();
+    return stats;
+}
+
+MemoryStats::HeapUsage MemoryStats::getHeapUsage() {
+    HeapUsage usage;
+#if defined(__MBED__)
+    // Needs the heap stats of profiles/stats.json, zero otherwise.
+    mbed_stats_heap_t heap_stats;
+    mbed_stats_heap_get(&heap_stats);
+    usage.current = heap_stats.current_size;
+    usage.peak = heap_stats.max_size;
+#else
+    usage.current = heap_current.load();
+    usage.peak = heap_peak.load();
+#endif
+    return usage;
+}
+
+size_t MemoryStats::getThreadCount() {
+    return watched_count;
+}
+
+MemoryStats::StackUsage MemoryStats::getStackUsage(size_t index) {
+    // Stack space is measured on the fill pattern, it needs the stack stats of profiles/stats.json on the board.
+    StackUsage usage;
+    usage.name = watched[index].name;
+    usage.size = osThreadGetStackSize(watched[index].id);
+    uint32_t space = osThreadGetStackSpace(watched[index].id);
+    usage.used = (space < usage.size) ? usage.size - space : 0;
+    return usage;
+}
+
+void MemoryStats::reset() {
+    message_mutex.lock();
+    message_stats = MessageStats();
+    message_mutex.unlock();
+}
+
+void MemoryStats::onHeapOperation(bool isAllocation, size_t size) {
+#if !defined(__MBED__)
+    if (isAllocation) {
+        uint32_t current = heap_current.fetch_add(size) + size;
+        uint32_t peak = heap_peak.load();
+        while (current > peak && !heap_peak.compare_exchange_weak(peak, current)) {}
+    } else {
+        heap_current.fetch_sub(size);
+    }
+#endif
+    WatchedThread *thread = findThread(ThisThread::get_id());
+    if (thread == NULL) return;
+    if (isAllocation) {
+        thread->allocations = thread->allocations + 1;
+        thread->bytes = thread->bytes + size;
+    } else {
+        thread->frees = thread->frees + 1;
+    }
+}
@@ -0,0 +1,89 @@
+/* Memory stats
+ * Heap allocations made for each processed message and stack high-water marks of the watched threads.
+ * Allocations are counted per thread by the allocator hook of heap_guard.cpp, each pipeline stage adds the
+ * allocations it made for a message to the message. Queried and reset through the memory request.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mbed.h"
+
+// Maximum number of threads whose allocations and stack are watched.
+#define MEMORY_STATS_MAX_THREADS 16
+
+namespace MemoryStats {
+    // Allocations made by a thread, or for a message.
+    struct Usage {
+        uint32_t allocations = 0;
+        uint32_t frees = 0;
+        // Bytes requested by the allocations, frees excluded.
+        uint32_t bytes = 0;
+    };
+
+    // Aggregate of the messages recorded since boot or the last reset.
+    struct MessageStats {
+        uint32_t count = 0;
+        Usage total;
+        // Highest allocations and bytes of a single message.
+        uint32_t max_allocations = 0;
+        uint32_t max_bytes = 0;
+    };
+
+    // Heap in use by every thread, in bytes.
+    struct HeapUsage {
+        uint32_t current = 0;
+        uint32_t peak = 0;
+    };
+
+    struct StackUsage {
+        const char *name;
+        // Highest stack used since the start of the thread, and stack size.
+        uint32_t used;
+        uint32_t size;
+    };
+
+    /** Watch the calling thread: count its allocations and report its stack. Should be called first by the thread.
+    *
+    * @param name short name of the thread, used as key of the memory response.
+    */
+    void watchThread(const char *name);
+
+    // Allocations of the calling thread since it is watched, zero if it is not.
+    Usage getThreadUsage();
+
+    /** Add the allocations of the calling thread since a mark.
+    *
+    * @param usage usage to increase.
+    * @param mark value of getThreadUsage() at the start of the work.
+    */
+    void addSince(Usage *usage, const Usage& mark);
+
+    // Add the allocations made for a message, once its response is sent.
+    void recordMessage(const Usage& usage);
+
+    MessageStats getMessageStats();
+
+    HeapUsage getHeapUsage();
+
+    // Number of watched threads.
+    size_t getThreadCount();
+
+    /** Stack usage of a watched thread.
+    *
+    * @param index thread index, lower than getThreadCount().
+    */
+    StackUsage getStackUsage(size_t index);
+
+    // Clear the message aggregate.
+    void reset();
+
+    /** Count a heap operation of the calling thread, called by the allocator hook.
+    *
+    * @param isAllocation true for an allocation, false for a free.
+    * @param size bytes allocated or freed, 0 when unknown.
+    */
+    void onHeapOperation(bool isAllocation, size_t size);
+}
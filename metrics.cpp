@@ -0,0 +1,96 @@
+/* Metrics
+ * Counters and fixed-bucket latency histograms of each step of command processing, shared by every thread.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "metrics.hpp"
+#include "mbed.h"
+
+static const char* const PROBE_NAME[METRICS_PROBE_COUNT] = {"rx", "lex", "parse", "dispatch", "serialize", "flush"};
+static const char* const COUNTER_NAME[METRICS_COUNTER_COUNT] = {"bytes_in", "bytes_out", "messages", "parse_errors", "log_drops"};
+
+namespace {
+    Metrics::Histogram histograms[METRICS_PROBE_COUNT];
+    uint32_t counters[METRICS_COUNTER_COUNT] = {0};
+    Timestamp::Ticks reset_ticks = 0;
+    Mutex metrics_mutex;
+}
+
+void Metrics::record(Probe probe, Timestamp::Ticks start) {
+    uint64_t us = Timestamp::toMicroseconds(Timestamp::now() - start);
+    metrics_mutex.lock();
+    addSample(&histograms[probe], us);
+    metrics_mutex.unlock();
+}
+
+void Metrics::addSample(Histogram *histogram, uint64_t us) {
+    // Index of the highest bit gives the power of two bucket.
+    size_t bucket = 0;
+    while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && (us >> bucket) > 0) bucket++;
+    uint32_t us32 = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+
+    histogram->count++;
+    histogram->total_us += us32;
+    if (us32 > histogram->max_us) histogram->max_us = us32;
+    histogram->buckets[bucket]++;
+}
+
+void Metrics::count(Counter counter, uint32_t amount) {
+    metrics_mutex.lock();
+    counters[counter] += amount;
+    metrics_mutex.unlock();
+}
+
+Metrics::Histogram Metrics::getHistogram(Probe probe) {
+    metrics_mutex.lock();
+    Histogram histogram = histograms[probe];
+    metrics_mutex.unlock();
+    return histogram;
+}
+
+uint32_t Metrics::getCounter(Counter counter) {
+    metrics_mutex.lock();
+    uint32_t value = counters[counter];
+    metrics_mutex.unlock();
+    return value;
+}
+
+uint32_t Metrics::percentile(const Histogram& histogram, uint32_t percent) {
+    if (histogram.count == 0) return 0;
+    // Rank of the percentile, rounded up.
+    uint64_t rank = ((uint64_t)histogram.count * percent + 99) / 100;
+    if (rank == 0) rank = 1;
+    uint64_t cumulated = 0;
+    for (size_t bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+        cumulated += histogram.buckets[bucket];
+        if (cumulated >= rank) {
+            if (bucket == METRICS_HISTOGRAM_BUCKETS - 1) break;
+            uint32_t upper_bound = 1u << bucket;
+            return (upper_bound < histogram.max_us) ? upper_bound : histogram.max_us;
+        }
+    }
+    return histogram.max_us;
+}
+
+const char* Metrics::getProbeName(Probe probe) {
+    return PROBE_NAME[probe];
+}
+
+const char* Metrics::getCounterName(Counter counter) {
+    return COUNTER_NAME[counter];
+}
+
+uint64_t Metrics::getElapsedMicroseconds() {
+    metrics_mutex.lock();
+    Timestamp::Ticks start = reset_ticks;
+    metrics_mutex.unlock();
+    return Timestamp::toMicroseconds(Timestamp::now() - start);
+}
+
+void Metrics::reset() {
+    metrics_mutex.lock();
+    for (size_t i = 0; i < METRICS_PROBE_COUNT; i++) histograms[i] = Histogram();
+    for (size_t i = 0; i < METRICS_COUNTER_COUNT; i++) counters[i] = 0;
+    reset_ticks = Timestamp::now();
+    metrics_mutex.unlock();
+}
@@ -0,0 +1,99 @@
+/* Metrics
+ * Counters and fixed-bucket latency histograms of each step of command processing, shared by every thread.
+ * Queried and reset through the stats request, on the board and in the host build alike.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include "timestamp.hpp"
+
+// Number of latency buckets. Bucket 0 holds durations under 1 us, bucket i durations in [2^(i-1), 2^i) us, the last one everything above.
+#define METRICS_HISTOGRAM_BUCKETS 16
+
+namespace Metrics {
+    // Timed steps.
+    enum Probe {
+        // Serial read of a chunk, from the end of the read to its queuing.
+        RECEIVE = 0,
+        // Lexing of a chunk.
+        LEX = 1,
+        // Deserialization of a message, or MessagePack decoding.
+        PARSE = 2,
+        // Command dispatch and handler.
+        DISPATCH = 3,
+        // Response serialization and queuing.
+        SERIALIZE = 4,
+        // Logger flush to the sinks.
+        LOG_FLUSH = 5,
+    };
+    #define METRICS_PROBE_COUNT 6
+
+    enum Counter {
+        // Bytes read from the serial.
+        BYTES_IN = 0,
+        // Bytes written to the serial, logs included.
+        BYTES_OUT = 1,
+        // Requests sent to the execute stage.
+        MESSAGES = 2,
+        // Requests that could not be parsed.
+        PARSE_ERRORS = 3,
+        // Log frames dropped because the queue was full.
+        LOG_DROPS = 4,
+    };
+    #define METRICS_COUNTER_COUNT 5
+
+    struct Histogram {
+        uint32_t count = 0;
+        uint64_t total_us = 0;
+        uint32_t max_us = 0;
+        uint32_t buckets[METRICS_HISTOGRAM_BUCKETS] = {0};
+    };
+
+    /** Add a duration to the histogram of a step.
+    *
+    * @param probe timed step.
+    * @param start ticks at the start of the step, the step ends now.
+    */
+    void record(Probe probe, Timestamp::Ticks start);
+
+    /** Add a duration to a histogram that is not one of the steps. Not thread safe, the caller owns the histogram.
+    *
+    * @param histogram histogram to update.
+    * @param us duration in microseconds.
+    */
+    void addSample(Histogram *histogram, uint64_t us);
+
+    /** Increment a counter.
+    *
+    * @param counter counter to increment.
+    * @param amount value to add.
+    */
+    void count(Counter counter, uint32_t amount = 1);
+
+    // Copy of the histogram of a step.
+    Histogram getHistogram(Probe probe);
+
+    uint32_t getCounter(Counter counter);
+
+    /** Estimate a percentile from the buckets of a histogram.
+    *
+    * @param histogram histogram to read.
+    * @param percent percentile between 0 and 100.
+    * @return upper bound of the bucket holding the percentile in microseconds, capped by the maximum.
+    */
+    uint32_t percentile(const Histogram& histogram, uint32_t percent);
+
+    // Short name of a step, used as key of the stats response.
+    const char* getProbeName(Probe probe);
+
+    // Short name of a counter, used as key of the stats response.
+    const char* getCounterName(Counter counter);
+
+    // Time since boot or the last reset in microseconds.
+    uint64_t getElapsedMicroseconds();
+
+    // Clear every histogram and counter.
+    void reset();
+}
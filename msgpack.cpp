@@ -0,0 +1,263 @@
+/* MessagePack codec
+ * Compact binary encoding of the JSON model, decoded into and encoded from JSONParser::JSONValue.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "msgpack.hpp"
+
+#include <climits>
+#include <cstring>
+
+// Read a big endian unsigned value of the given number of bytes.
+static uint64_t readBigEndian(const uint8_t* data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value = (value << 8) | data[i];
+    return value;
+}
+
+/** Decode one value starting at offset, or only skip it when value is NULL.
+*
+* @param buffer input buffer.
+* @param buffer_length size of input buffer.
+* @param offset position of the value, moved after it when complete.
+* @param value decoded value or NULL.
+* @param depth current nesting depth.
+*/
+static MsgPack::DecodeStatus decodeValue(const uint8_t* buffer, size_t buffer_length, size_t* offset, JSONParser::JSONValue* value, int depth) {
+    if (*offset >= buffer_length) return MsgPack::DecodeStatus::INCOMPLETE;
+    uint8_t head = buffer[*offset];
+    size_t pos = *offset + 1;
+
+    // Size of the header argument (length or number) following the type byte.
+    int argument_bytes = 0;
+    switch (head) {
+        case 0xcc: case 0xd0: case 0xd9: argument_bytes = 1; break;
+        case 0xcd: case 0xd1: case 0xda: case 0xdc: case 0xde: argument_bytes = 2; break;
+        case 0xca: case 0xce: case 0xd2: case 0xdb: case 0xdd: case 0xdf: argument_bytes = 4; break;
+        case 0xcb: case 0xcf: case 0xd3: argument_bytes = 8; break;
+        default: break;
+    }
+    if (pos + argument_bytes > buffer_length) return MsgPack::DecodeStatus::INCOMPLETE;
+    uint64_t argument = readBigEndian(buffer + pos, argument_bytes);
+    pos += argument_bytes;
+
+    // Fixed size types.
+    if (head <= 0x7f || head >= 0xe0 || (head >= 0xcc && head <= 0xd3) || head == 0xca || head == 0xcb || head == 0xc0 || head == 0xc2 || head == 0xc3) {
+        JSONParser::JSONValue decoded;
+        if (head <= 0x7f) {
+            decoded = JSONParser::JSONValue((int)head);
+        } else if (head >= 0xe0) {
+            decoded = JSONParser::JSONValue((int)(int8_t)head);
+        } else if (head >= 0xcc && head <= 0xcf) {
+            if (argument > INT_MAX) return MsgPack::DecodeStatus::INVALID;
+            decoded = JSONParser::JSONValue((int)argument);
+        } else if (head >= 0xd0 && head <= 0xd3) {
+            // Sign extend from the encoded width.
+            int shift = 64 - argument_bytes * 8;
+            int64_t signed_argument = (int64_t)(argument << shift) >> shift;
+            if (signed_argument > INT_MAX || signed_argument < INT_MIN) return MsgPack::DecodeStatus::INVALID;
+            decoded = JSONParser::JSONValue((int)signed_argument);
+        } else if (head == 0xca) {
+            uint32_t bits = (uint32_t)argument;
+            float f;
+            std::memcpy(&f, &bits, sizeof(f));
+            decoded = JSONParser::JSONValue(f);
+        } else if (head == 0xcb) {
+            double d;
+            std::memcpy(&d, &argument, sizeof(d));
+            decoded = JSONParser::JSONValue((float)d);
+        } else if (head == 0xc2 || head == 0xc3) {
+            decoded = JSONParser::JSONValue(head == 0xc3);
+        }
+        if (value != NULL) *value = decoded;
+        *offset = pos;
+        return MsgPack::DecodeStatus::COMPLETE;
+    }
+
+    // Strings.
+    if ((head >= 0xa0 && head <= 0xbf) || (head >= 0xd9 && head <= 0xdb)) {
+        size_t str_length = (head <= 0xbf) ? (head & 0x1f) : argument;
+        if (str_length > JSON_MAX_STRING_LENGTH) return MsgPack::DecodeStatus::INVALID;
+        if (str_length > buffer_length - pos) return MsgPack::DecodeStatus::INCOMPLETE;
+        if (value != NULL) *value = JSONParser::JSONValue(new std::string((const char*)buffer + pos, str_length));
+        *offset = pos + str_length;
+        return MsgPack::DecodeStatus::COMPLETE;
+    }
+
+    // Arrays and maps.
+    bool isArray = (head >= 0x90 && head <= 0x9f) || head == 0xdc || head == 0xdd;
+    bool isMap = (head >= 0x80 && head <= 0x8f) || head == 0xde || head == 0xdf;
+    if (!isArray && !isMap) return MsgPack::DecodeStatus::INVALID;
+    if (depth >= MSGPACK_MAX_DEPTH) return MsgPack::DecodeStatus::INVALID;
+    size_t count = (head <= 0x9f) ? (head & 0x0f) : argument;
+
+    if (isArray) {
+        std::vector<JSONParser::JSONValue> vec;
+        for (size_t i = 0; i < count; i++) {
+            JSONParser::JSONValue element;
+            MsgPack::DecodeStatus status = decodeValue(buffer, buffer_length, &pos, (value != NULL) ? &element : NULL, depth + 1);
+            if (status != MsgPack::DecodeStatus::COMPLETE) return status;
+            if (value != NULL) vec.push_back(element);
+        }
+        if (value != NULL) *value = JSONParser::JSONValue(&vec);
+    } else {
+        std::map<std::string, JSONParser::JSONValue> map;
+        for (size_t i = 0; i < count; i++) {
+            // Keys must be strings to fit the JSON model.
+            if (pos >= buffer_length) return MsgPack::DecodeStatus::INCOMPLETE;
+            uint8_t key_head = buffer[pos];
+            if (!((key_head >= 0xa0 && key_head <= 0xbf) || (key_head >= 0xd9 && key_head <= 0xdb))) return MsgPack::DecodeStatus::INVALID;
+
+            JSONParser::JSONValue key;
+            MsgPack::DecodeStatus status = decodeValue(buffer, buffer_length, &pos, (value != NULL) ? &key : NULL, depth + 1);
+            if (status != MsgPack::DecodeStatus::COMPLETE) return status;
+            JSONParser::JSONValue element;
+            status = decodeValue(buffer, buffer_length, &pos, (value != NULL) ? &element : NULL, depth + 1);
+            if (status != MsgPack::DecodeStatus::COMPLETE) return status;
+            if (value != NULL) map[key.getString()] = element;
+        }
+        if (value != NULL) *value = JSONParser::JSONValue(&map);
+    }
+    *offset = pos;
+    return MsgPack::DecodeStatus::COMPLETE;
+}
+
+MsgPack::DecodeResult MsgPack::Decode(const uint8_t* buffer, size_t buffer_length, JSONParser::JSONValue* value) {
+    // Check that the value is whole before building it, so partial messages cost no allocation.
+    size_t length = 0;
+    DecodeStatus status = decodeValue(buffer, buffer_length, &length, NULL, 0);
+    if (status != DecodeStatus::COMPLETE) return DecodeResult { status, 0 };
+
+    length = 0;
+    decodeValue(buffer, buffer_length, &length, value, 0);
+    return DecodeResult { status, length };
+}
+
+MsgPack::Writer::Writer(uint8_t* buffer, size_t capacity): buffer(buffer), capacity(capacity) {};
+
+void MsgPack::Writer::writeByte(uint8_t byte) {
+    if (this->length >= this->capacity) {
+        this->overflow = true;
+        return;
+    }
+    this->buffer[this->length++] = byte;
+}
+
+void MsgPack::Writer::writeBigEndian(uint32_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) this->writeByte((value >> (i * 8)) & 0xff);
+}
+
+void MsgPack::Writer::writeNil() {
+    this->writeByte(0xc0);
+}
+
+void MsgPack::Writer::writeBool(bool b) {
+    this->writeByte(b ? 0xc3 : 0xc2);
+}
+
+void MsgPack::Writer::writeInt(int i) {
+    // Smallest encoding holding the value.
+    if (i >= 0 && i <= 0x7f) {
+        this->writeByte(i);
+    } else if (i < 0 && i >= -32) {
+        this->writeByte((uint8_t)(int8_t)i);
+    } else if (i >= INT8_MIN && i <= INT8_MAX) {
+        this->writeByte(0xd0);
+        this->writeBigEndian((uint32_t)i, 1);
+    } else if (i >= INT16_MIN && i <= INT16_MAX) {
+        this->writeByte(0xd1);
+        this->writeBigEndian((uint32_t)i, 2);
+    } else {
+        this->writeByte(0xd2);
+        this->writeBigEndian((uint32_t)i, 4);
+    }
+}
+
+void MsgPack::Writer::writeFloat(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    this->writeByte(0xca);
+    this->writeBigEndian(bits, 4);
+}
+
+void MsgPack::Writer::writeString(const char* str, size_t str_length) {
+    if (str_length <= 31) {
+        this->writeByte(0xa0 | str_length);
+    } else if (str_length <= 0xff) {
+        this->writeByte(0xd9);
+        this->writeBigEndian(str_length, 1);
+    } else if (str_length <= 0xffff) {
+        this->writeByte(0xda);
+        this->writeBigEndian(str_length, 2);
+    } else {
+        this->writeByte(0xdb);
+        this->writeBigEndian(str_length, 4);
+    }
+    for (size_t i = 0; i < str_length; i++) this->writeByte(str[i]);
+}
+
+void MsgPack::Writer::writeArrayHeader(size_t count) {
+    if (count <= 15) {
+        this->writeByte(0x90 | count);
+    } else if (count <= 0xffff) {
+        this->writeByte(0xdc);
+        this->writeBigEndian(count, 2);
+    } else {
+        this->writeByte(0xdd);
+        this->writeBigEndian(count, 4);
+    }
+}
+
+void MsgPack::Writer::writeMapHeader(size_t count) {
+    if (count <= 15) {
+        this->writeByte(0x80 | count);
+    } else if (count <= 0xffff) {
+        this->writeByte(0xde);
+        this->writeBigEndian(count, 2);
+    } else {
+        this->writeByte(0xdf);
+        this->writeBigEndian(count, 4);
+    }
+}
+
+void MsgPack::Writer::writeValue(JSONParser::JSONValue* value) {
+    switch (value->getType()) {
+        case JSONParser::JSONValueType::Null:{
+            this->writeNil();
+        };break;
+        case JSONParser::JSONValueType::Boolean:{
+            this->writeBool(value->getBoolean());
+        };break;
+        case JSONParser::JSONValueType::Integer:{
+            this->writeInt(value->getInt());
+        };break;
+        case JSONParser::JSONValueType::Float:{
+            this->writeFloat(value->getFloat());
+        };break;
+        case JSONParser::JSONValueType::String:{
+            std::string str = value->getString();
+            this->writeString(str.data(), str.size());
+        };break;
+        case JSONParser::JSONValueType::Array:{
+            std::vector<JSONParser::JSONValue>* vec = value->getArray();
+            this->writeArrayHeader(vec->size());
+            for (JSONParser::JSONValue& element: *vec) this->writeValue(&element);
+        };break;
+        case JSONParser::JSONValueType::Object:{
+            std::map<std::string, JSONParser::JSONValue>* map = value->getMap();
+            this->writeMapHeader(map->size());
+            for (std::pair<const std::string, JSONParser::JSONValue>& kv: *map) {
+                this->writeString(kv.first.data(), kv.first.size());
+                this->writeValue(&kv.second);
+            }
+        };break;
+    }
+}
+
+size_t MsgPack::Writer::getLength() const {
+    return this->length;
+}
+
+bool MsgPack::Writer::isOverflow() const {
+    return this->overflow;
+}
@@ -0,0 +1,72 @@
+/* MessagePack codec
+ * Compact binary encoding of the JSON model, decoded into and encoded from JSONParser::JSONValue.
+ * Only the types that have a JSON equivalent are supported: nil, bool, int, float, str, array and map with string keys.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "json_parser.hpp"
+
+// Maximum nesting of arrays and maps accepted by the decoder, same as JSON.
+#define MSGPACK_MAX_DEPTH JSON_MAX_DEPTH
+
+namespace MsgPack {
+    enum DecodeStatus {
+        // A whole value was decoded.
+        COMPLETE = 0,
+        // Buffer ends before the end of the value, retry with more bytes.
+        INCOMPLETE = 1,
+        // Bytes are not a supported MessagePack value.
+        INVALID = 2,
+    };
+
+    // Result of a Decode operation. Length is the number of bytes used by the value when status is COMPLETE.
+    struct DecodeResult {
+        DecodeStatus status;
+        size_t length;
+    };
+
+    /** Decode the first value of the buffer. Nothing is allocated unless the value is complete.
+    *
+    * @param buffer input buffer.
+    * @param buffer_length size of input buffer.
+    * @param value decoded value, only set when status is COMPLETE.
+    */
+    DecodeResult Decode(const uint8_t* buffer, size_t buffer_length, JSONParser::JSONValue* value);
+
+    // Encoder writing values one after the other into a fixed buffer. Bytes past the capacity are lost and isOverflow() becomes true.
+    class Writer {
+        uint8_t* buffer;
+        size_t capacity;
+        size_t length = 0;
+        bool overflow = false;
+
+        void writeByte(uint8_t byte);
+        void writeBigEndian(uint32_t value, int bytes);
+    public:
+        /** Constructor of Writer.
+        *
+        * @param buffer output buffer.
+        * @param capacity size of output buffer.
+        */
+        Writer(uint8_t* buffer, size_t capacity);
+
+        void writeNil();
+        void writeBool(bool b);
+        void writeInt(int i);
+        void writeFloat(float f);
+        void writeString(const char* str, size_t str_length);
+        // Containers are written as a header followed by their elements, maps as key then value.
+        void writeArrayHeader(size_t count);
+        void writeMapHeader(size_t count);
+
+        // Write a JSON value and its nested values.
+        void writeValue(JSONParser::JSONValue* value);
+
+        size_t getLength() const;
+        bool isOverflow() const;
+    };
+}
@@ -0,0 +1,631 @@
+/* Command pipeline
+ * Serial commands go through four stages, each on its own thread and connected by bounded preallocated mails:
+ * receive (raw chunks) -> parse (lexing and deserialization) -> execute (command dispatch) -> transmit (serialization).
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "pipeline.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+
+using namespace Pipeline;
+
+#if NO_HEAP
+static_assert(LOG_FRAME_LENGTH >= PIPELINE_RESPONSE_LENGTH + 2, "log-frame-length must hold a whole response with its braces");
+#endif
+
+static const char* const STAGE_NAME[PIPELINE_STAGE_COUNT] = {"rx", "parse", "exec", "tx"};
+
+static const Response::ResponseTemplate ID_INT_FIELD("\"id\":$i");
+static const Response::ResponseTemplate ID_STRING_FIELD("\"id\":\"$r\"");
+
+CommandPipeline::CommandPipeline(BufferedSerial *pbs, Command::CommandRegistry *registry, const char *name, Log::LogSink *response_sink):
+    pbs(pbs), registry(registry), name(name), response_sink(response_sink),
+    // Names are only read once the threads are started, they are written below.
+    receive_thread(osPriorityNormal, PIPELINE_STACK_SIZE, NULL, thread_names[Stage::RECEIVE]),
+    parse_thread(osPriorityNormal, PIPELINE_STACK_SIZE, NULL, thread_names[Stage::PARSE]),
+    execute_thread(osPriorityNormal, PIPELINE_STACK_SIZE, NULL, thread_names[Stage::EXECUTE]),
+    transmit_thread(osPriorityNormal, PIPELINE_STACK_SIZE, NULL, thread_names[Stage::TRANSMIT])
+#if NO_HEAP
+    , request_document(request_tape, PIPELINE_TAPE_LENGTH, request_source, sizeof(request_source))
+#else
+    , chunk_lexer(previous_read_buffer, READ_BUFFER_LENGTH)
+#endif
+{
+    for (int stage = 0; stage < PIPELINE_STAGE_COUNT; stage++)
+        std::snprintf(this->thread_names[stage], sizeof(this->thread_names[stage]), "%.*s.%s", PIPELINE_NAME_LENGTH, name, STAGE_NAME[stage]);
+};
+
+template<typename T, uint32_t N>
+T* CommandPipeline::allocFrom(Mail<T, N> *mail, Stage stage) {
+    T* block = mail->try_alloc();
+    if (block == NULL) {
+        // Next stage is late, wait for it to release a block.
+        this->stats_mutex.lock();
+        this->stats[stage].full_waits++;
+        this->stats_mutex.unlock();
+        ThreadStats::beginWait();
+        while ((block = mail->try_alloc_for(Kernel::Clock::duration_u32(PIPELINE_MESSAGE_GAP_MS))) == NULL) {}
+        ThreadStats::endWait(0);
+    }
+    return block;
+}
+
+void CommandPipeline::markEnqueued(Stage stage) {
+    this->stats_mutex.lock();
+    StageStats& stats = this->stats[stage];
+    stats.queue_depth++;
+    if (stats.queue_depth > stats.max_queue_depth) stats.max_queue_depth = stats.queue_depth;
+    this->stats_mutex.unlock();
+}
+
+void CommandPipeline::markDequeued(Stage stage) {
+    this->stats_mutex.lock();
+    if (this->stats[stage].queue_depth > 0) this->stats[stage].queue_depth--;
+    this->stats_mutex.unlock();
+}
+
+void CommandPipeline::recordStage(Stage stage, Timestamp::Ticks start) {
+    Timestamp::Ticks end = Timestamp::now();
+    this->stats_mutex.lock();
+    this->stats[stage].items++;
+    this->stats[stage].busy_ticks += end - start;
+    this->stats_mutex.unlock();
+}
+
+void CommandPipeline::start(bool isReceiving) {
+    this->stats_start = Timestamp::now();
+    this->parse_thread.start(callback(this, &CommandPipeline::parseLoop));
+    this->execute_thread.start(callback(this, &CommandPipeline::executeLoop));
+    this->transmit_thread.start(callback(this, &CommandPipeline::transmitLoop));
+    if (isReceiving) this->receive_thread.start(callback(this, &CommandPipeline::receiveLoop));
+}
+
+const char* CommandPipeline::getName() const {
+    return this->name;
+}
+
+void CommandPipeline::receiveLoop() {
+    // Main thread is already watched when it receives for the first channel.
+    MemoryStats::watchThread(this->thread_names[Stage::RECEIVE]);
+    ThreadStats::watchThread(this->thread_names[Stage::RECEIVE]);
+    // Set blocking to serial connection so that its wait for input to be received.
+    this->pbs->set_blocking(true);
+    bool isInMessage = false;
+    while (true) {
+        RxChunk *chunk = this->allocFrom(&this->rx_mail, Stage::PARSE);
+        // Bytes are received under interrupt, the time the thread could run again is unknown.
+        ThreadStats::beginWait();
+        ssize_t read_length = this->pbs->read(chunk->data, READ_BUFFER_LENGTH);
+        ThreadStats::endWait(0);
+        Timestamp::Ticks start = Timestamp::now();
+
+        if (read_length > 0) {
+            Metrics::count(Metrics::Counter::BYTES_IN, read_length);
+            chunk->length = read_length;
+            chunk->isEndOfMessage = false;
+            this->markEnqueued(Stage::PARSE);
+            chunk->queued = Timestamp::now();
+            this->rx_mail.put(chunk);
+            isInMessage = true;
+            this->recordStage(Stage::RECEIVE, start);
+            Metrics::record(Metrics::Probe::RECEIVE, start);
+
+            // Give the host time to send the rest of the message, then check without blocking if there is more data to read.
+            ThreadStats::sleepFor(std::chrono::milliseconds(PIPELINE_MESSAGE_GAP_MS));
+            this->pbs->set_blocking(false);
+        } else if (isInMessage) {
+            // Nothing more to read, close the message.
+            chunk->length = 0;
+            chunk->isEndOfMessage = true;
+            this->markEnqueued(Stage::PARSE);
+            chunk->queued = Timestamp::now();
+            this->rx_mail.put(chunk);
+            isInMessage = false;
+            // Set to blocking to wait for new message.
+            this->pbs->set_blocking(true);
+        } else {
+            this->rx_mail.free(chunk);
+        }
+    }
+}
+
+#if NO_HEAP
+void CommandPipeline::appendChunk(RxChunk *chunk) {
+    Log::Logger *logger = Log::Logger::getInstance();
+    int read_length = chunk->length;
+
+    // Sanitize buffer by removing last \r and \n, like the lexer.
+    while (read_length > 0 && (chunk->data[read_length - 1] == '\r' || chunk->data[read_length - 1] == '\n')) {
+        read_length -= 1;
+    }
+    if (read_length <= 0 || this->isTextDiscarding) return;
+
+    // DEBUG: write readed buffer
+    logger->addLogToQueue(Log::LogFrameType::DEBUG, "buff: %.*s (len: %d)", read_length, chunk->data, read_length);
+
+    if (this->message_length + read_length > PIPELINE_MESSAGE_LENGTH) {
+        // Drop the rest of the message, it is answered like an invalid one.
+        logger->addLogToQueue(Log::LogFrameType::ERROR, "Message longer than %d characters, dropped!", PIPELINE_MESSAGE_LENGTH);
+        this->message_length = 0;
+        this->isTextDiscarding = true;
+        return;
+    }
+    std::memcpy(this->message_text + this->message_length, chunk->data, read_length);
+    this->message_length += read_length;
+}
+
+void CommandPipeline::finishMessage() {
+    Message *message = this->allocFrom(&this->execute_mail, Stage::EXECUTE);
+    std::memcpy(message->text, this->message_text, this->message_length);
+    message->text_length = this->message_length;
+    message->received = this->message_received;
+    message->heap = MemoryStats::Usage();
+    MemoryStats::addSince(&message->heap, this->parse_heap_mark);
+    this->parse_heap_mark = MemoryStats::getThreadUsage();
+    message->format = this->message_format;
+    message->ready = NULL;
+    message->ready_context = NULL;
+
+    this->markEnqueued(Stage::EXECUTE);
+    message->queued = Timestamp::now();
+    this->execute_mail.put(message);
+
+    this->message_length = 0;
+    this->isTextDiscarding = false;
+    this->message_received = 0;
+}
+#else
+void CommandPipeline::lexChunk(RxChunk *chunk) {
+    Log::Logger *logger = Log::Logger::getInstance();
+    int read_length = chunk->length;
+    char *read_buffer = chunk->data;
+
+    // Sanitize buffer by removing last \r and \n
+    while(read_length > 0 && (read_buffer[read_length - 1] == '\r' || read_buffer[read_length - 1] == '\n')) {
+        read_length -= 1;
+    }
+    if (read_length <= 0 || this->isLexDiscarding) return;
+
+    // DEBUG: write readed buffer
+    logger->addLogToQueue(Log::LogFrameType::DEBUG, "buff: %.*s (len: %d)", read_length, read_buffer, read_length);
+
+    size_t token_count = this->lexer_tokens.size();
+    if (!this->chunk_lexer.feed(read_buffer, read_length, &this->lexer_tokens)) {
+        // Drop the rest of the message.
+        logger->addLogToQueue(Log::LogFrameType::ERROR, "Token longer than %d characters, message dropped!", READ_BUFFER_LENGTH);
+        this->lexer_tokens.clear();
+        this->isLexDiscarding = true;
+        return;
+    }
+    if (this->lexer_tokens.size() > JSON_MAX_TOKENS) {
+        // Can't be a valid request, drop the rest of the message instead of growing the token list.
+        logger->addLogToQueue(Log::LogFrameType::ERROR, "Message of more than %d tokens, dropped!", JSON_MAX_TOKENS);
+        this->lexer_tokens.clear();
+        this->chunk_lexer.reset();
+        this->isLexDiscarding = true;
+        return;
+    }
+
+    // DEBUG: Show what is the ouput of the Lexer
+    logger->addLogToQueue(Log::LogFrameType::DEBUG, "Tokens_len = %d | left = %d", (int)(this->lexer_tokens.size() - token_count), (int)this->chunk_lexer.getPendingLength());
+}
+
+void CommandPipeline::pushRequest(JSONParser::JSONValue *request) {
+    Metrics::count(Metrics::Counter::MESSAGES);
+    if (!request->isMap() && !request->isArray()) Metrics::count(Metrics::Counter::PARSE_ERRORS);
+
+    Message *message = this->allocFrom(&this->execute_mail, Stage::EXECUTE);
+    message->request = request;
+    message->response = NULL;
+    message->received = this->message_received;
+    // Lexing and parsing since the previous request.
+    message->heap = MemoryStats::Usage();
+    MemoryStats::addSince(&message->heap, this->parse_heap_mark);
+    this->parse_heap_mark = MemoryStats::getThreadUsage();
+    message->format = this->message_format;
+    message->ready = NULL;
+    message->ready_context = NULL;
+
+    this->markEnqueued(Stage::EXECUTE);
+    message->queued = Timestamp::now();
+    this->execute_mail.put(message);
+}
+
+void CommandPipeline::finishMessage() {
+    Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::DEBUG, "End Lexing: tokens = %d !", this->lexer_tokens.size());
+
+    Timestamp::Ticks start = Timestamp::now();
+    JSONParser::JSONValue *request = new JSONParser::JSONValue(JSONParser::JSONValue::Deserialize(&this->lexer_tokens));
+    Metrics::record(Metrics::Probe::PARSE, start);
+
+    // Clear tokens before sending the request, so that their frees are charged to it.
+    this->lexer_tokens.clear();
+    this->pushRequest(request);
+
+    // Clear left characters for the next input.
+    this->chunk_lexer.reset();
+    this->isLexDiscarding = false;
+    this->message_received = 0;
+}
+
+void CommandPipeline::decodeChunk(RxChunk *chunk) {
+    Log::Logger *logger = Log::Logger::getInstance();
+    if (this->isBinaryDiscarding) return;
+
+    if (this->binary_length + chunk->length > PIPELINE_BINARY_BUFFER_LENGTH) {
+        logger->addLogToQueue(Log::LogFrameType::ERROR, "MessagePack request longer than %d bytes, dropped!", PIPELINE_BINARY_BUFFER_LENGTH);
+        this->binary_length = 0;
+        this->isBinaryDiscarding = true;
+        // Answer it like an invalid JSON message.
+        this->pushRequest(new JSONParser::JSONValue());
+        return;
+    }
+    std::memcpy(this->binary_buffer + this->binary_length, chunk->data, chunk->length);
+    this->binary_length += chunk->length;
+
+    // Values delimit themselves, so a chunk may hold several requests.
+    size_t offset = 0;
+    while (offset < this->binary_length) {
+        JSONParser::JSONValue request;
+        Timestamp::Ticks start = Timestamp::now();
+        MsgPack::DecodeResult result = MsgPack::Decode(this->binary_buffer + offset, this->binary_length - offset, &request);
+        if (result.status == MsgPack::DecodeStatus::COMPLETE) Metrics::record(Metrics::Probe::PARSE, start);
+        if (result.status == MsgPack::DecodeStatus::INCOMPLETE) break;
+        // Like JSON, a request is an object or an array, anything else means the stream is not MessagePack.
+        if (result.status == MsgPack::DecodeStatus::INVALID || !(request.isMap() || request.isArray())) {
+            logger->addLogToQueue(Log::LogFrameType::ERROR, "Invalid MessagePack request, dropped!");
+            offset = this->binary_length;
+            this->isBinaryDiscarding = true;
+            this->pushRequest(new JSONParser::JSONValue());
+            break;
+        }
+        this->pushRequest(new JSONParser::JSONValue(request));
+        offset += result.length;
+    }
+
+    // Keep the beginning of an incomplete value for the next chunk.
+    this->binary_length -= offset;
+    std::memmove(this->binary_buffer, this->binary_buffer + offset, this->binary_length);
+    if (this->binary_length == 0) this->message_received = 0;
+}
+
+void CommandPipeline::finishBinaryMessage() {
+    if (this->binary_length > 0) {
+        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::ERROR, "Incomplete MessagePack request, dropped!");
+        this->pushRequest(new JSONParser::JSONValue());
+    }
+    this->binary_length = 0;
+    this->isBinaryDiscarding = false;
+    this->message_received = 0;
+}
+#endif
+
+void CommandPipeline::parseLoop() {
+    MemoryStats::watchThread(this->thread_names[Stage::PARSE]);
+    ThreadStats::watchThread(this->thread_names[Stage::PARSE]);
+    this->parse_heap_mark = MemoryStats::getThreadUsage();
+    while (true) {
+        ThreadStats::beginWait();
+        RxChunk *chunk = this->rx_mail.try_get_for(Kernel::wait_for_u32_forever);
+        ThreadStats::endWait((chunk != NULL) ? chunk->queued : 0);
+        if (chunk == NULL) continue;
+        this->markDequeued(Stage::PARSE);
+        Timestamp::Ticks start = Timestamp::now();
+
+#if NO_HEAP
+        if (this->message_received == 0) this->message_received = start;
+        if (chunk->isEndOfMessage) {
+            this->finishMessage();
+        } else {
+            this->appendChunk(chunk);
+            Metrics::record(Metrics::Probe::LEX, start);
+        }
+#else
+        // Encoding is only checked at the start of a message, a handshake never switches it in the middle of one.
+        if (!chunk->isEndOfMessage && this->message_received == 0 && this->lexer_tokens.empty() && this->chunk_lexer.getPendingLength() == 0 && this->binary_length == 0 && !this->isBinaryDiscarding && !this->isLexDiscarding)
+            this->message_format = this->wire_format;
+        if (this->message_received == 0) this->message_received = start;
+        if (this->message_format == Command::WireFormat::MSGPACK) {
+            if (chunk->isEndOfMessage) this->finishBinaryMessage();
+            else this->decodeChunk(chunk);
+        } else if (chunk->isEndOfMessage) {
+            this->finishMessage();
+        } else {
+            this->lexChunk(chunk);
+            Metrics::record(Metrics::Probe::LEX, start);
+        }
+#endif
+        this->rx_mail.free(chunk);
+        this->recordStage(Stage::PARSE, start);
+    }
+}
+
+#if NO_HEAP
+void CommandPipeline::dispatchText(Message *message, Command::CommandContext *context) {
+    Timestamp::Ticks start = Timestamp::now();
+    bool isParsed = this->request_document.parse(message->text, message->text_length);
+    Metrics::record(Metrics::Probe::PARSE, start);
+    Metrics::count(Metrics::Counter::MESSAGES);
+    if (!isParsed) Metrics::count(Metrics::Counter::PARSE_ERRORS);
+    Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::INFO, "End Parsing obj: %.*s !", (int)message->text_length, message->text);
+
+    JSONTape::Value root = this->request_document.root();
+    if (!root.isMap()) return;
+    context->request = Command::RequestValue(root);
+
+    // Echo request id first so that the host can match responses sent out of order. Strings are echoed as written, escape sequences included.
+    JSONTape::Value id = root.find("id");
+    size_t id_length = 0;
+    const char *id_chars = id.getRaw(&id_length);
+    if (id.isInt())
+        Command::addFields(context, ID_INT_FIELD, {id.getInt()});
+    else if (id_chars != NULL)
+        Command::addFields(context, ID_STRING_FIELD, {Response::TemplateValue(id_chars, id_length)});
+
+    Timestamp::Ticks dispatch_start = Timestamp::now();
+    this->registry->dispatch(context);
+    Metrics::record(Metrics::Probe::DISPATCH, dispatch_start);
+}
+#else
+void CommandPipeline::dispatchValue(Message *message, Command::CommandContext *context) {
+    // Handling JSON request
+    if (!message->request->isMap()) return;
+    context->request = Command::RequestValue(message->request);
+    Command::JSONMap *request = message->request->getMap();
+
+    // Echo request id first so that the host can match responses sent out of order.
+    Command::JSONMap::iterator id = request->find("id");
+    if (id != request->end()) {
+        bool isRendered = false;
+        if (id->second.isInt())
+            isRendered = Command::addFields(context, ID_INT_FIELD, {id->second.getInt()});
+        else if (id->second.isString())
+            isRendered = Command::addFields(context, ID_STRING_FIELD, {id->second.getString()});
+        if (!isRendered) {
+            JSONParser::JSONValue id_copy = id->second.isString() ? JSONParser::JSONValue(new std::string(id->second.getString())) : id->second;
+            context->response->insert(std::pair<std::string, JSONParser::JSONValue>("id", id_copy));
+        }
+    }
+
+    Timestamp::Ticks dispatch_start = Timestamp::now();
+    this->registry->dispatch(context);
+    Metrics::record(Metrics::Probe::DISPATCH, dispatch_start);
+}
+#endif
+
+void CommandPipeline::executeLoop() {
+    MemoryStats::watchThread(this->thread_names[Stage::EXECUTE]);
+    ThreadStats::watchThread(this->thread_names[Stage::EXECUTE]);
+    while (true) {
+        ThreadStats::beginWait();
+        Message *message = this->execute_mail.try_get_for(Kernel::wait_for_u32_forever);
+        ThreadStats::endWait((message != NULL) ? message->queued : 0);
+        if (message == NULL) continue;
+        this->markDequeued(Stage::EXECUTE);
+        Timestamp::Ticks start = Timestamp::now();
+
+        // Rendered fields are written straight into the transmit block.
+        Message *executed = this->allocFrom(&this->transmit_mail, Stage::TRANSMIT);
+        MemoryStats::Usage heap_mark = MemoryStats::getThreadUsage();
+        this->executeMessage(message, executed);
+        // Counted once executeMessage returned, so that the frees of the response map are included.
+        executed->heap = message->heap;
+        MemoryStats::addSince(&executed->heap, heap_mark);
+        this->execute_mail.free(message);
+        this->markEnqueued(Stage::TRANSMIT);
+        executed->queued = Timestamp::now();
+        this->transmit_mail.put(executed);
+        this->recordStage(Stage::EXECUTE, start);
+    }
+}
+
+void CommandPipeline::executeMessage(Message *message, Message *executed) {
+    Command::CommandContext context;
+#if !NO_HEAP
+    std::map<std::string, JSONParser::JSONValue> response_map;
+    context.response = &response_map;
+#endif
+    // Templates render JSON text, binary responses are only built from the map.
+    bool isJSON = message->format == Command::WireFormat::JSON;
+    context.fields = isJSON ? executed->fields : NULL;
+    context.fields_capacity = isJSON ? PIPELINE_RESPONSE_LENGTH : 0;
+    context.fields_length = 0;
+    context.format = message->format;
+    context.channel = this;
+    context.scratch = this->handler_scratch;
+    context.scratch_capacity = sizeof(this->handler_scratch);
+#if NO_HEAP
+    this->dispatchText(message, &context);
+#else
+    this->dispatchValue(message, &context);
+#endif
+    if (context.format != message->format) this->wire_format = context.format;
+
+#if NO_HEAP
+    // Request text is only needed by the execute stage.
+    executed->text_length = 0;
+#else
+    executed->request = message->request;
+    // Map is only kept for responses with fields that have no template.
+    executed->response = response_map.empty() ? NULL : new JSONParser::JSONValue(&response_map);
+#endif
+    executed->fields_length = context.fields_length;
+    executed->received = message->received;
+    executed->format = message->format;
+    executed->ready = context.ready;
+    executed->ready_context = context.ready_context;
+}
+
+void CommandPipeline::sendResponse(Message *message) {
+    Log::Logger *logger = Log::Logger::getInstance();
+    Timestamp::Ticks start = Timestamp::now();
+    MemoryStats::Usage heap_mark = MemoryStats::getThreadUsage();
+
+#if NO_HEAP
+    // Requests are only JSON without heap.
+    this->sendJSONResponse(message);
+#else
+    if (message->format == Command::WireFormat::MSGPACK) {
+        uint8_t tx[PIPELINE_BINARY_BUFFER_LENGTH];
+        MsgPack::Writer writer(tx, sizeof(tx));
+        if (message->response == NULL) writer.writeMapHeader(0);
+        else writer.writeValue(message->response);
+        if (writer.isOverflow()) {
+            logger->addLogToQueue(Log::LogFrameType::ERROR, "MessagePack response longer than %d bytes!", PIPELINE_BINARY_BUFFER_LENGTH);
+            static const char TOO_LONG[] = "Response too long.";
+            writer = MsgPack::Writer(tx, sizeof(tx));
+            writer.writeMapHeader(1);
+            writer.writeString("err", 3);
+            writer.writeString(TOO_LONG, sizeof(TOO_LONG) - 1);
+        }
+        this->writeResponse(Log::LogFrameType::BINARY, (const char*)tx, writer.getLength());
+    } else {
+        this->sendJSONResponse(message);
+    }
+#endif
+    Metrics::record(Metrics::Probe::SERIALIZE, start);
+#if !NO_HEAP
+    logger->addLogToQueue(Log::LogFrameType::INFO, "End Parsing obj: %s !", message->request->Serialize().c_str());
+#endif
+    logger->addLogToQueue(Log::LogFrameType::DEBUG, "Timing: first chunk to response = %lu us", (unsigned long)Timestamp::toMicroseconds(Timestamp::now() - message->received));
+
+#if !NO_HEAP
+    delete message->request;
+    delete message->response;
+#endif
+    MemoryStats::addSince(&message->heap, heap_mark);
+    MemoryStats::recordMessage(message->heap);
+}
+
+void CommandPipeline::sendJSONResponse(Message *message) {
+    // Output string formatted JSON message, rendered fields first then the map fields without their braces.
+    char tx[PIPELINE_RESPONSE_LENGTH + 2];
+    size_t length = 0;
+    tx[length++] = '{';
+    std::memcpy(tx + length, message->fields, message->fields_length);
+    length += message->fields_length;
+#if !NO_HEAP
+    if (message->response != NULL) {
+        std::string map_fields = message->response->Serialize();
+        std::string output(tx, length);
+        if (map_fields.size() > 2) {
+            if (message->fields_length > 0) output += ',';
+            output.append(map_fields, 1, map_fields.size() - 1);
+        } else {
+            output += '}';
+        }
+        this->writeResponse(Log::LogFrameType::RELEASE, output.data(), output.size());
+        return;
+    }
+#endif
+    tx[length++] = '}';
+    this->writeResponse(Log::LogFrameType::RELEASE, tx, length);
+}
+
+void CommandPipeline::writeResponse(Log::LogFrameType type, const char *data, size_t length) {
+    if (this->response_sink == NULL) {
+        // Responses are interleaved with the logs on the serial of the Logger.
+        Log::Logger::getInstance()->addRawToQueue(type, data, length);
+        return;
+    }
+    // One write per response, not interleaved with status pushes. The sink writes every byte even when the receive loop made the serial non-blocking.
+    this->output_mutex.lock();
+    this->response_sink->writeFrame(Timestamp::now(), type, data, length);
+    this->response_sink->flush();
+    this->output_mutex.unlock();
+}
+
+void CommandPipeline::writePush(Log::LogFrameType type, const char *data, size_t length) {
+    this->writeResponse(type, data, length);
+}
+
+bool CommandPipeline::deferResponse(Message *message) {
+    for (size_t i = 0; i < PIPELINE_MAX_DEFERRED; i++) {
+        if (!this->deferred_used[i]) {
+            this->deferred[i] = *message;
+            this->deferred_used[i] = true;
+            this->deferred_count++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CommandPipeline::sendReadyResponses() {
+    for (size_t i = 0; i < PIPELINE_MAX_DEFERRED && this->deferred_count > 0; i++) {
+        if (this->deferred_used[i] && this->deferred[i].ready(this->deferred[i].ready_context)) {
+            this->sendResponse(&this->deferred[i]);
+            this->deferred_used[i] = false;
+            this->deferred_count--;
+        }
+    }
+}
+
+void CommandPipeline::transmitLoop() {
+    MemoryStats::watchThread(this->thread_names[Stage::TRANSMIT]);
+    ThreadStats::watchThread(this->thread_names[Stage::TRANSMIT]);
+    while (true) {
+        // Only wake up periodically while some responses are deferred.
+        Kernel::Clock::duration_u32 timeout = (this->deferred_count > 0) ? Kernel::Clock::duration_u32(PIPELINE_DEFERRED_POLL_MS) : Kernel::wait_for_u32_forever;
+        Timestamp::Ticks wait_start = ThreadStats::beginWait();
+        Message *message = this->transmit_mail.try_get_for(timeout);
+        // Without message, the thread could run again at the end of the timeout.
+        if (message != NULL) ThreadStats::endWait(message->queued);
+        else if (timeout != Kernel::wait_for_u32_forever) ThreadStats::endWait(wait_start + (Timestamp::Ticks)timeout.count() * Timestamp::ticksPerSecond() / 1000);
+        else ThreadStats::endWait(0);
+        if (message != NULL) {
+            this->markDequeued(Stage::TRANSMIT);
+            Timestamp::Ticks start = Timestamp::now();
+
+            bool isDeferred = false;
+            if (message->ready != NULL && !message->ready(message->ready_context)) {
+                isDeferred = this->deferResponse(message);
+                if (!isDeferred)
+                    Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::WARNING, "Too many deferred responses, sending it now!");
+            }
+            if (!isDeferred) this->sendResponse(message);
+            this->transmit_mail.free(message);
+            this->recordStage(Stage::TRANSMIT, start);
+        }
+        if (this->deferred_count > 0) this->sendReadyResponses();
+    }
+}
+
+StageStats CommandPipeline::getStats(Stage stage) {
+    this->stats_mutex.lock();
+    StageStats stats = this->stats[stage];
+    this->stats_mutex.unlock();
+    return stats;
+}
+
+void CommandPipeline::logStats() {
+    StageStats stats[PIPELINE_STAGE_COUNT];
+    this->stats_mutex.lock();
+    Timestamp::Ticks now = Timestamp::now();
+    Timestamp::Ticks elapsed = now - this->stats_start;
+    for (int stage = 0; stage < PIPELINE_STAGE_COUNT; stage++) {
+        stats[stage] = this->stats[stage];
+        // Counters are per period, except the current queue depth.
+        this->stats[stage].items = 0;
+        this->stats[stage].busy_ticks = 0;
+        this->stats[stage].max_queue_depth = this->stats[stage].queue_depth;
+        this->stats[stage].full_waits = 0;
+    }
+    this->stats_start = now;
+    this->stats_mutex.unlock();
+    if (elapsed == 0) return;
+
+    for (int stage = 0; stage < PIPELINE_STAGE_COUNT; stage++) {
+        // Utilization in tenth of percent.
+        unsigned long utilization = stats[stage].busy_ticks * 1000 / elapsed;
+        Log::Logger::getInstance()->addLogToQueue(Log::LogFrameType::INFO, "Pipeline %s %s: items = %lu | busy = %lu.%lu%% | queue = %lu (max %lu) | full waits = %lu",
+            this->name, STAGE_NAME[stage], (unsigned long)stats[stage].items, utilization / 10, utilization % 10,
+            (unsigned long)stats[stage].queue_depth, (unsigned long)stats[stage].max_queue_depth, (unsigned long)stats[stage].full_waits);
+    }
+}
\ No newline at end of file
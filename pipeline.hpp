@@ -0,0 +1,319 @@
+/* Command pipeline
+ * Serial commands go through four stages, each on its own thread and connected by bounded preallocated mails:
+ * receive (raw chunks) -> parse (lexing and deserialization) -> execute (command dispatch) -> transmit (serialization).
+ * The receive stage only copies bytes so it never waits for a command to be processed.
+ * A pipeline is the channel of one serial: several pipelines can share a registry, each one keeps its own buffers,
+ * framing state and encoding, and writes its responses to its own sink.
+ * In the no-heap build, the parse stage only frames messages and the execute stage parses them into a fixed tape.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include "mbed.h"
+#include "json_parser.hpp"
+#include "json_tape.hpp"
+#include "command_registry.hpp"
+#include "timestamp.hpp"
+#include "msgpack.hpp"
+#include "heap_guard.hpp"
+#include "memory_stats.hpp"
+#include "thread_stats.hpp"
+#include "logger.hpp"
+
+#include <list>
+
+#define READ_BUFFER_LENGTH 64
+
+// Number of received chunks waiting to be parsed. Can be overridden with "pipeline-rx-queue-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_RX_QUEUE_LENGTH
+#define PIPELINE_RX_QUEUE_LENGTH MBED_CONF_APP_PIPELINE_RX_QUEUE_LENGTH
+#else
+#define PIPELINE_RX_QUEUE_LENGTH 16
+#endif
+
+// Number of messages waiting between parse, execute and transmit stages. Can be overridden with "pipeline-queue-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_QUEUE_LENGTH
+#define PIPELINE_QUEUE_LENGTH MBED_CONF_APP_PIPELINE_QUEUE_LENGTH
+#else
+#define PIPELINE_QUEUE_LENGTH 4
+#endif
+
+// Stack size of each stage thread in bytes. Can be overridden with "pipeline-stack-size" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_STACK_SIZE
+#define PIPELINE_STACK_SIZE MBED_CONF_APP_PIPELINE_STACK_SIZE
+#else
+#define PIPELINE_STACK_SIZE 4096
+#endif
+
+// Delay between two pipeline statistics reports in milliseconds. Can be overridden with "pipeline-stats-period-ms" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_STATS_PERIOD_MS
+#define PIPELINE_STATS_PERIOD_MS MBED_CONF_APP_PIPELINE_STATS_PERIOD_MS
+#else
+#define PIPELINE_STATS_PERIOD_MS 10000
+#endif
+
+// Maximum number of responses waiting for a slow operation. Can be overridden with "pipeline-max-deferred" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_MAX_DEFERRED
+#define PIPELINE_MAX_DEFERRED MBED_CONF_APP_PIPELINE_MAX_DEFERRED
+#else
+#define PIPELINE_MAX_DEFERRED 4
+#endif
+
+// Capacity of the response fields rendered from templates, in bytes. Can be overridden with "pipeline-response-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_RESPONSE_LENGTH
+#define PIPELINE_RESPONSE_LENGTH MBED_CONF_APP_PIPELINE_RESPONSE_LENGTH
+#else
+#define PIPELINE_RESPONSE_LENGTH 128
+#endif
+
+// Working memory of the handlers of a channel, in bytes. Must hold the stats, memory and threads objects and the samples of a LED sequence.
+// Can be overridden with "pipeline-scratch-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_SCRATCH_LENGTH
+#define PIPELINE_SCRATCH_LENGTH MBED_CONF_APP_PIPELINE_SCRATCH_LENGTH
+#else
+#define PIPELINE_SCRATCH_LENGTH 1024
+#endif
+
+// Capacity of the buffer of a MessagePack request or response, in bytes. Can be overridden with "pipeline-binary-buffer-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_BINARY_BUFFER_LENGTH
+#define PIPELINE_BINARY_BUFFER_LENGTH MBED_CONF_APP_PIPELINE_BINARY_BUFFER_LENGTH
+#else
+#define PIPELINE_BINARY_BUFFER_LENGTH 256
+#endif
+
+// Capacity of a JSON request in the no-heap build, in bytes. Can be overridden with "pipeline-message-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_MESSAGE_LENGTH
+#define PIPELINE_MESSAGE_LENGTH MBED_CONF_APP_PIPELINE_MESSAGE_LENGTH
+#else
+#define PIPELINE_MESSAGE_LENGTH 256
+#endif
+
+// Number of tape entries (values and keys) of a JSON request in the no-heap build. Can be overridden with "pipeline-tape-length" in mbed_app.json.
+#ifdef MBED_CONF_APP_PIPELINE_TAPE_LENGTH
+#define PIPELINE_TAPE_LENGTH MBED_CONF_APP_PIPELINE_TAPE_LENGTH
+#else
+#define PIPELINE_TAPE_LENGTH 64
+#endif
+
+// Capacity of a channel name, used as prefix of its thread names.
+#define PIPELINE_NAME_LENGTH 12
+
+// Delay between two checks of deferred responses in milliseconds.
+#define PIPELINE_DEFERRED_POLL_MS 10
+
+// Silence after a chunk, in milliseconds, marking the end of a message.
+#define PIPELINE_MESSAGE_GAP_MS 50
+
+namespace Pipeline {
+    enum Stage {
+        RECEIVE = 0,
+        PARSE = 1,
+        EXECUTE = 2,
+        TRANSMIT = 3,
+    };
+    #define PIPELINE_STAGE_COUNT 4
+
+    // Raw bytes read from the serial. A chunk with isEndOfMessage set carries no data and closes the current message.
+    struct RxChunk {
+        char data[READ_BUFFER_LENGTH];
+        int length;
+        bool isEndOfMessage;
+        // Put in the queue, the parse thread could run from then on.
+        Timestamp::Ticks queued;
+    };
+
+    // Message between parse, execute and transmit stages. Values are owned by the message.
+    struct Message {
+#if NO_HEAP
+        // Request text, parsed by the execute stage into its fixed tape.
+        char text[PIPELINE_MESSAGE_LENGTH];
+        size_t text_length;
+#else
+        JSONParser::JSONValue *request;
+        // Fields without template, NULL if there are none.
+        JSONParser::JSONValue *response;
+#endif
+        // Fields rendered from templates, see Command::addFields.
+        char fields[PIPELINE_RESPONSE_LENGTH];
+        size_t fields_length;
+        Timestamp::Ticks received;
+        // Put in the queue of the next stage, its thread could run from then on.
+        Timestamp::Ticks queued;
+        // Allocations made for the message by the stages it went through.
+        MemoryStats::Usage heap;
+        // Encoding of the request and its response.
+        Command::WireFormat format;
+        // Response is only sent once ready returns true, see Command::CommandContext.
+        Command::ReadyCheck ready;
+        void *ready_context;
+    };
+
+    // Counters of a stage. Busy time is the time spent processing, excluding waits on its input queue.
+    struct StageStats {
+        uint32_t items = 0;
+        Timestamp::Ticks busy_ticks = 0;
+        // Current and highest number of items waiting in the input queue of the stage.
+        uint32_t queue_depth = 0;
+        uint32_t max_queue_depth = 0;
+        // Number of times the previous stage had to wait because the input queue was full.
+        uint32_t full_waits = 0;
+    };
+
+    class CommandPipeline : public Command::ResponseChannel {
+        BufferedSerial *pbs;
+        Command::CommandRegistry *registry;
+        const char *name;
+        // Responses are written here by the transmit stage, or queued to the Logger when NULL.
+        Log::LogSink *response_sink;
+        // Held while writing to the response sink, status pushes are written from another thread.
+        Mutex output_mutex;
+        // Name of the thread of each stage, "<channel>.<stage>". Declared before the threads which keep a pointer to them.
+        char thread_names[PIPELINE_STAGE_COUNT][PIPELINE_NAME_LENGTH + 8];
+
+        Mail<RxChunk, PIPELINE_RX_QUEUE_LENGTH> rx_mail;
+        Mail<Message, PIPELINE_QUEUE_LENGTH> execute_mail;
+        Mail<Message, PIPELINE_QUEUE_LENGTH> transmit_mail;
+        // Only started for channels that do not receive on the calling thread, see start().
+        Thread receive_thread;
+        Thread parse_thread;
+        Thread execute_thread;
+        Thread transmit_thread;
+
+        // Parse stage reassembly state.
+        Timestamp::Ticks message_received = 0;
+        Command::WireFormat message_format = Command::WireFormat::JSON;
+        // Allocations of the parse thread when the previous message was sent, the next one is charged with the rest.
+        MemoryStats::Usage parse_heap_mark;
+#if NO_HEAP
+        // Text of the current message. Set to discard the rest of a message longer than the buffer.
+        char message_text[PIPELINE_MESSAGE_LENGTH];
+        size_t message_length = 0;
+        bool isTextDiscarding = false;
+
+        // Execute stage storage of the parsed request.
+        JSONTape::TapeEntry request_tape[PIPELINE_TAPE_LENGTH];
+        char request_source[PIPELINE_MESSAGE_LENGTH + 1];
+        JSONTape::Document request_document;
+#else
+        // Characters of the unfinished token lexed again with the next chunk.
+        char previous_read_buffer[READ_BUFFER_LENGTH] = {0};
+        JSONLexer::ChunkLexer chunk_lexer;
+        std::list<JSONLexer::JSONToken> lexer_tokens;
+        // Set to discard the rest of a message with a token longer than the buffer.
+        bool isLexDiscarding = false;
+        // MessagePack bytes waiting for the end of their value. Set to discard the rest of a message that can't be decoded.
+        uint8_t binary_buffer[PIPELINE_BINARY_BUFFER_LENGTH];
+        size_t binary_length = 0;
+        bool isBinaryDiscarding = false;
+#endif
+
+        // Working memory of the handlers, only used by the execute stage, see Command::CommandContext.
+        alignas(float) char handler_scratch[PIPELINE_SCRATCH_LENGTH];
+
+        // Encoding of the next requests, changed by the execute stage on handshake.
+        volatile Command::WireFormat wire_format = Command::WireFormat::JSON;
+
+        // Transmit stage responses waiting for their ready check.
+        Message deferred[PIPELINE_MAX_DEFERRED];
+        bool deferred_used[PIPELINE_MAX_DEFERRED] = {false};
+        size_t deferred_count = 0;
+
+        StageStats stats[PIPELINE_STAGE_COUNT];
+        Timestamp::Ticks stats_start = 0;
+        Mutex stats_mutex;
+
+        // Allocate a block from a mail, waiting and counting the wait if it is full.
+        template<typename T, uint32_t N>
+        T* allocFrom(Mail<T, N> *mail, Stage stage);
+        // Update the input queue depth of a stage.
+        void markEnqueued(Stage stage);
+        void markDequeued(Stage stage);
+        // Record processing time of an item.
+        void recordStage(Stage stage, Timestamp::Ticks start);
+
+#if NO_HEAP
+        // Append a received chunk to the text of the current message.
+        void appendChunk(RxChunk *chunk);
+        // Send the text of the message to the execute stage.
+        void finishMessage();
+        /** Parse a request into the fixed tape and dispatch it.
+        *
+        * @param message received message.
+        * @param context command context, its request is set when the message is an object.
+        */
+        void dispatchText(Message *message, Command::CommandContext *context);
+#else
+        // Lex a received chunk, merging it with the characters left by the previous one.
+        void lexChunk(RxChunk *chunk);
+        // Deserialize the lexed message and send it to the execute stage.
+        void finishMessage();
+        // Decode every complete MessagePack value of a received chunk and send them to the execute stage.
+        void decodeChunk(RxChunk *chunk);
+        // Drop MessagePack bytes left at the end of a message.
+        void finishBinaryMessage();
+        // Send a request to the execute stage.
+        void pushRequest(JSONParser::JSONValue *request);
+        /** Dispatch a deserialized request.
+        *
+        * @param message received message.
+        * @param context command context, its request is set when the message is an object.
+        */
+        void dispatchValue(Message *message, Command::CommandContext *context);
+#endif
+
+        /** Dispatch a request and fill the transmit block with its response.
+        *
+        * @param message received message.
+        * @param executed transmit block of the response.
+        */
+        void executeMessage(Message *message, Message *executed);
+
+        // Write the response in the encoding of its request, then free the message values and record its allocations.
+        void sendResponse(Message *message);
+        // Write an encoded response to the response sink of the channel.
+        void writeResponse(Log::LogFrameType type, const char *data, size_t length);
+        // Write a JSON response from its rendered and map fields.
+        void sendJSONResponse(Message *message);
+        // Keep a message until it is ready, return false if every deferred slot is used.
+        bool deferResponse(Message *message);
+        // Send deferred responses that became ready.
+        void sendReadyResponses();
+
+        void parseLoop();
+        void executeLoop();
+        void transmitLoop();
+    public:
+        /** Constructor of CommandPipeline.
+        *
+        * @param pbs serial communication to read commands from.
+        * @param registry registry used to execute commands, may be shared with other channels.
+        * @param name short name of the channel, at most PIPELINE_NAME_LENGTH characters, used in thread names and stats logs.
+        * @param response_sink sink the responses and status pushes are written to. NULL to queue them to the Logger with the logs.
+        */
+        CommandPipeline(BufferedSerial *pbs, Command::CommandRegistry *registry, const char *name, Log::LogSink *response_sink = NULL);
+
+        /** Start parse, execute and transmit stage threads.
+        *
+        * @param isReceiving also start the receive stage in its own thread, instead of calling receiveLoop.
+        */
+        void start(bool isReceiving = false);
+
+        // Run the receive stage forever in the calling thread.
+        void receiveLoop();
+
+        const char* getName() const;
+
+        // Write a status push to the response sink of the channel, or queue it to the Logger.
+        void writePush(Log::LogFrameType type, const char *data, size_t length) override;
+
+        /** Copy of the counters of a stage.
+        *
+        * @param stage pipeline stage.
+        */
+        StageStats getStats(Stage stage);
+
+        // Log queue depths and utilization of every stage since the last call at INFO level.
+        void logStats();
+    };
+}
\ No newline at end of file
@@ -0,0 +1,185 @@
+/* Response templates
+ * Fixed shape responses are declared once as a pattern with typed slots. Producing a response only formats
+ * the slot values between the precompiled literal segments, straight into the output buffer, without allocation.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "response_template.hpp"
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+using namespace Response;
+
+TemplateValue::TemplateValue(int i): type(SlotType::INT), intValue(i), floatValue(0.0f), stringValue(NULL), stringLength(0) {};
+TemplateValue::TemplateValue(float f): type(SlotType::FIXED), intValue(0), floatValue(f), stringValue(NULL), stringLength(0) {};
+TemplateValue::TemplateValue(const char* s): type(SlotType::STRING), intValue(0), floatValue(0.0f), stringValue(s), stringLength(std::strlen(s)) {};
+TemplateValue::TemplateValue(const char* s, size_t length): type(SlotType::STRING), intValue(0), floatValue(0.0f), stringValue(s), stringLength(length) {};
+TemplateValue::TemplateValue(const std::string& s): type(SlotType::STRING), intValue(0), floatValue(0.0f), stringValue(s.data()), stringLength(s.size()) {};
+
+ResponseTemplate::ResponseTemplate(const char* pattern) {
+    const char* literal = pattern;
+    const char* c = pattern;
+    while (*c != '\0') {
+        if (c[0] == '$' && (c[1] == 'i' || c[1] == 'f' || c[1] == 's' || c[1] == 'r') && this->slot_count < RESPONSE_TEMPLATE_MAX_SLOTS) {
+            Segment& segment = this->segments[this->slot_count];
+            segment.literal = literal;
+            segment.literal_length = c - literal;
+            segment.slot = (c[1] == 'i') ? SlotType::INT : ((c[1] == 'f') ? SlotType::FIXED : ((c[1] == 's') ? SlotType::STRING : SlotType::RAW));
+            segment.decimals = RESPONSE_TEMPLATE_DEFAULT_DECIMALS;
+            c += 2;
+            if (segment.slot == SlotType::FIXED && *c >= '0' && *c <= '9') {
+                segment.decimals = *c - '0';
+                c++;
+            }
+            this->slot_count++;
+            literal = c;
+        } else {
+            c++;
+        }
+    }
+    Segment& last = this->segments[this->slot_count];
+    last.literal = literal;
+    last.literal_length = c - literal;
+    last.slot = SlotType::STRING;
+    last.decimals = 0;
+}
+
+// Write a string escaped for JSON: quotes, backslashes and control characters. Sets written, false if it does not fit.
+static bool writeEscaped(char* buffer, size_t capacity, const char* s, size_t length, size_t* written) {
+    static const char HEX[] = "0123456789abcdef";
+    size_t out = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = s[i];
+        char escape = 0;
+        switch (c) {
+            case '"': escape = '"'; break;
+            case '\\': escape = '\\'; break;
+            case '\b': escape = 'b'; break;
+            case '\f': escape = 'f'; break;
+            case '\n': escape = 'n'; break;
+            case '\r': escape = 'r'; break;
+            case '\t': escape = 't'; break;
+        }
+        if (escape != 0) {
+            if (out + 2 > capacity) return false;
+            buffer[out++] = '\\';
+            buffer[out++] = escape;
+        } else if (c < 0x20) {
+            if (out + 6 > capacity) return false;
+            std::memcpy(buffer + out, "\\u00", 4);
+            buffer[out + 4] = HEX[c >> 4];
+            buffer[out + 5] = HEX[c & 0xF];
+            out += 6;
+        } else {
+            if (out + 1 > capacity) return false;
+            buffer[out++] = c;
+        }
+    }
+    *written = out;
+    return true;
+}
+
+size_t ResponseTemplate::render(char* buffer, size_t capacity, std::initializer_list<TemplateValue> values) const {
+    if (values.size() != this->slot_count) return 0;
+
+    size_t length = 0;
+    const TemplateValue* value = values.begin();
+    for (size_t i = 0; i <= this->slot_count; i++) {
+        const Segment& segment = this->segments[i];
+        if (length + segment.literal_length > capacity) return 0;
+        std::memcpy(buffer + length, segment.literal, segment.literal_length);
+        length += segment.literal_length;
+        if (i == this->slot_count) break;
+
+        // Patch the slot value right after its literal.
+        size_t written = 0;
+        // Raw slots take string values.
+        if (value->type != ((segment.slot == SlotType::RAW) ? SlotType::STRING : segment.slot)) return 0;
+        switch (segment.slot) {
+            case SlotType::INT:{
+                written = writeInt(buffer + length, capacity - length, value->intValue);
+            };break;
+            case SlotType::FIXED:{
+                written = writeFixed(buffer + length, capacity - length, value->floatValue, segment.decimals);
+            };break;
+            case SlotType::STRING:
+            case SlotType::RAW:{
+                if (segment.slot == SlotType::STRING) {
+                    if (!writeEscaped(buffer + length, capacity - length, value->stringValue, value->stringLength, &written)) return 0;
+                } else {
+                    if (length + value->stringLength > capacity) return 0;
+                    std::memcpy(buffer + length, value->stringValue, value->stringLength);
+                    written = value->stringLength;
+                }
+                // Empty strings are valid values.
+                if (written == 0) {
+                    value++;
+                    continue;
+                }
+            };break;
+        }
+        if (written == 0) return 0;
+        length += written;
+        value++;
+    }
+    return length;
+}
+
+size_t ResponseTemplate::getSlotCount() const {
+    return this->slot_count;
+}
+
+// Write an unsigned value, used for int and both parts of fixed point values.
+static size_t writeUnsigned(char* buffer, size_t capacity, uint64_t value, int min_digits) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = '0' + (value % 10);
+        value /= 10;
+    } while (value > 0 || count < min_digits);
+    if ((size_t)count > capacity) return 0;
+    for (int i = 0; i < count; i++) buffer[i] = digits[count - 1 - i];
+    return count;
+}
+
+size_t Response::writeInt(char* buffer, size_t capacity, int value) {
+    if (capacity == 0) return 0;
+    if (value < 0) {
+        buffer[0] = '-';
+        size_t written = writeUnsigned(buffer + 1, capacity - 1, -(int64_t)value, 1);
+        return written == 0 ? 0 : written + 1;
+    }
+    return writeUnsigned(buffer, capacity, value, 1);
+}
+
+size_t Response::writeFixed(char* buffer, size_t capacity, float value, int decimals) {
+    static const uint32_t POW10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+    if (capacity == 0 || decimals < 0 || decimals > 9) return 0;
+    // JSON has no number for them.
+    if (!std::isfinite(value)) {
+        if (capacity < 4) return 0;
+        std::memcpy(buffer, "null", 4);
+        return 4;
+    }
+
+    size_t length = 0;
+    double magnitude = value;
+    if (magnitude < 0) {
+        buffer[length++] = '-';
+        magnitude = -magnitude;
+    }
+    // Round once on the scaled value so that carries propagate to the integer part. Checked before the cast, larger values are undefined.
+    double rounded = magnitude * POW10[decimals] + 0.5;
+    if (rounded >= 18446744073709551616.0) return 0;
+    uint64_t scaled = (uint64_t)rounded;
+    size_t written = writeUnsigned(buffer + length, capacity - length, scaled / POW10[decimals], 1);
+    if (written == 0) return 0;
+    length += written;
+    if (decimals == 0) return length;
+
+    if (length + 1 + decimals > capacity) return 0;
+    buffer[length++] = '.';
+    length += writeUnsigned(buffer + length, capacity - length, scaled % POW10[decimals], decimals);
+    return length;
+}
\ No newline at end of file
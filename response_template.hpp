@@ -0,0 +1,85 @@
+/* Response templates
+ * Fixed shape responses are declared once as a pattern with typed slots. Producing a response only formats
+ * the slot values between the precompiled literal segments, straight into the output buffer, without allocation.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stddef.h>
+#include <initializer_list>
+#include <string>
+
+// Maximum number of slots of a template.
+#define RESPONSE_TEMPLATE_MAX_SLOTS 6
+// Decimals of fixed point float slots without explicit precision, same as JSONValue::Serialize.
+#define RESPONSE_TEMPLATE_DEFAULT_DECIMALS 6
+
+namespace Response {
+    enum SlotType {
+        // "$i": int.
+        INT = 0,
+        // "$f" or "$f<decimals>": float written in fixed point notation.
+        FIXED = 1,
+        // "$s": string escaped for JSON, quotes are part of the pattern.
+        STRING = 2,
+        // "$r": text already in JSON form copied as is (escaped string, rendered fields), takes a string value.
+        RAW = 3,
+    };
+
+    // Value of a slot, implicitly built from int, float or strings.
+    struct TemplateValue {
+        SlotType type;
+        int intValue;
+        float floatValue;
+        const char* stringValue;
+        size_t stringLength;
+
+        TemplateValue(int i);
+        TemplateValue(float f);
+        TemplateValue(const char* s);
+        TemplateValue(const char* s, size_t length);
+        TemplateValue(const std::string& s);
+    };
+
+    class ResponseTemplate {
+        // Literal text before each slot, the last segment has no slot.
+        struct Segment {
+            const char* literal;
+            size_t literal_length;
+            SlotType slot;
+            int decimals;
+        };
+        Segment segments[RESPONSE_TEMPLATE_MAX_SLOTS + 1];
+        size_t slot_count = 0;
+    public:
+        /** Compile a pattern. "$i", "$f" (optionally followed by a number of decimals), "$s" and "$r" are slots.
+        *
+        * @param pattern template text, must outlive the template as segments point into it.
+        */
+        ResponseTemplate(const char* pattern);
+
+        /** Write the template with the given slot values.
+        *
+        * @param buffer output buffer.
+        * @param capacity size of the output buffer.
+        * @param values one value per slot, in order, matching slots types.
+        * @return number of bytes written, 0 if it does not fit or values do not match slots.
+        */
+        size_t render(char* buffer, size_t capacity, std::initializer_list<TemplateValue> values) const;
+
+        size_t getSlotCount() const;
+    };
+
+    /** Write an int in decimal.
+    *
+    * @return number of bytes written, 0 if it does not fit.
+    */
+    size_t writeInt(char* buffer, size_t capacity, int value);
+
+    /** Write a float in fixed point notation, like printf("%.*f") for values in the int range. NaN and infinities are written as null.
+    *
+    * @return number of bytes written, 0 if it does not fit or the scaled value exceeds uint64_t.
+    */
+    size_t writeFixed(char* buffer, size_t capacity, float value, int decimals);
+}
\ No newline at end of file
@@ -0,0 +1,131 @@
+/* Thread stats
+ * Run time and scheduling latency of the watched threads, measured at their blocking waits.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "thread_stats.hpp"
+
+namespace {
+    // Times of a watched thread, only written by the thread itself and by reset, under the mutex.
+    struct WatchedThread {
+        const char *name;
+        osThreadId_t id;
+        bool isWaiting;
+        // Start of the current run, or of the current wait.
+        Timestamp::Ticks run_start;
+        Timestamp::Ticks wait_start;
+        Timestamp::Ticks run_ticks;
+        Metrics::Histogram latency;
+    };
+    WatchedThread watched[THREAD_STATS_MAX_THREADS];
+    // Entries are filled before being counted, so that the lookup without lock never reads a partial one.
+    volatile size_t watched_count = 0;
+    Mutex stats_mutex;
+
+    // CPU stats at the last reset.
+    mbed_stats_cpu_t reset_cpu = {};
+
+    WatchedThread* findThread(osThreadId_t id) {
+        size_t count = watched_count;
+        for (size_t i = 0; i < count; i++) {
+            if (watched[i].id == id) return &watched[i];
+        }
+        return NULL;
+    }
+}
+
+void ThreadStats::watchThread(const char *name) {
+    osThreadId_t id = ThisThread::get_id();
+    stats_mutex.lock();
+    if (findThread(id) == NULL && watched_count < THREAD_STATS_MAX_THREADS) {
+        WatchedThread& thread = watched[watched_count];
+        thread.name = name;
+        thread.id = id;
+        thread.isWaiting = false;
+        thread.run_start = Timestamp::now();
+        thread.wait_start = 0;
+        thread.run_ticks = 0;
+        thread.latency = Metrics::Histogram();
+        watched_count = watched_count + 1;
+    }
+    stats_mutex.unlock();
+}
+
+Timestamp::Ticks ThreadStats::beginWait() {
+    Timestamp::Ticks now = Timestamp::now();
+    WatchedThread *thread = findThread(ThisThread::get_id());
+    if (thread == NULL) return now;
+    stats_mutex.lock();
+    thread->run_ticks += now - thread->run_start;
+    thread->wait_start = now;
+    thread->isWaiting = true;
+    stats_mutex.unlock();
+    return now;
+}
+
+void ThreadStats::endWait(Timestamp::Ticks ready) {
+    Timestamp::Ticks now = Timestamp::now();
+    WatchedThread *thread = findThread(ThisThread::get_id());
+    if (thread == NULL) return;
+    stats_mutex.lock();
+    if (ready != 0) {
+        if (ready < thread->wait_start) ready = thread->wait_start;
+        Metrics::addSample(&thread->latency, (now > ready) ? Timestamp::toMicroseconds(now - ready) : 0);
+    }
+    thread->run_start = now;
+    thread->isWaiting = false;
+    stats_mutex.unlock();
+}
+
+void ThreadStats::sleepFor(Kernel::Clock::duration_u32 duration) {
+    Timestamp::Ticks start = beginWait();
+    ThisThread::sleep_for(duration);
+    endWait(start + (Timestamp::Ticks)duration.count() * Timestamp::ticksPerSecond() / 1000);
+}
+
+size_t ThreadStats::getThreadCount() {
+    return watched_count;
+}
+
+ThreadStats::ThreadUsage ThreadStats::getThreadUsage(size_t index) {
+    ThreadUsage usage;
+    Timestamp::Ticks now = Timestamp::now();
+    stats_mutex.lock();
+    const WatchedThread& thread = watched[index];
+    Timestamp::Ticks run_ticks = thread.run_ticks;
+    if (!thread.isWaiting && now > thread.run_start) run_ticks += now - thread.run_start;
+    usage.name = thread.name;
+    usage.latency = thread.latency;
+    stats_mutex.unlock();
+    usage.priority = (int)osThreadGetPriority(watched[index].id);
+    usage.run_us = Timestamp::toMicroseconds(run_ticks);
+    return usage;
+}
+
+ThreadStats::CpuUsage ThreadStats::getCpuUsage() {
+    // Needs the CPU stats of profiles/stats.json on the board, emulated from the process CPU clock on host.
+    mbed_stats_cpu_t cpu;
+    mbed_stats_cpu_get(&cpu);
+    stats_mutex.lock();
+    CpuUsage usage;
+    usage.elapsed_us = cpu.uptime - reset_cpu.uptime;
+    usage.idle_us = (cpu.idle_time > reset_cpu.idle_time) ? cpu.idle_time - reset_cpu.idle_time : 0;
+    stats_mutex.unlock();
+    return usage;
+}
+
+void ThreadStats::reset() {
+    mbed_stats_cpu_t cpu;
+    mbed_stats_cpu_get(&cpu);
+    Timestamp::Ticks now = Timestamp::now();
+    stats_mutex.lock();
+    reset_cpu = cpu;
+    size_t count = watched_count;
+    for (size_t i = 0; i < count; i++) {
+        // The current run only counts from the reset.
+        if (!watched[i].isWaiting) watched[i].run_start = now;
+        watched[i].run_ticks = 0;
+        watched[i].latency = Metrics::Histogram();
+    }
+    stats_mutex.unlock();
+}
@@ -0,0 +1,75 @@
+/* Thread stats
+ * Run time and scheduling latency of the watched threads, measured at their blocking waits.
+ * A thread runs from the end of a wait to the start of the next one, preemption by other threads and interrupts included.
+ * Scheduling latency is the delay between the moment a thread could run again (mail put, sleep deadline) and the moment it does.
+ * CPU idle time comes from Mbed OS CPU stats on the board and from the process CPU clock on host. Queried and reset through the threads request.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mbed.h"
+#include "timestamp.hpp"
+#include "metrics.hpp"
+
+// Maximum number of threads whose run time and latency are measured.
+#define THREAD_STATS_MAX_THREADS 16
+
+namespace ThreadStats {
+    struct ThreadUsage {
+        const char *name;
+        int priority;
+        // Time spent out of the measured waits since boot or the last reset.
+        uint64_t run_us;
+        // Delay from ready to running of each wake-up whose ready time is known.
+        Metrics::Histogram latency;
+    };
+
+    // CPU time since boot or the last reset.
+    struct CpuUsage {
+        uint64_t elapsed_us;
+        // Time spent in the idle thread, sleep included. Needs the CPU stats of profiles/stats.json on the board, zero otherwise.
+        uint64_t idle_us;
+    };
+
+    /** Watch the calling thread, it is running from now on. Should be called first by the thread.
+    *
+    * @param name short name of the thread, used as key of the threads response.
+    */
+    void watchThread(const char *name);
+
+    /** Mark the start of a blocking wait of the calling thread. Does nothing if it is not watched.
+    *
+    * @return ticks at the start of the wait.
+    */
+    Timestamp::Ticks beginWait();
+
+    /** Mark the end of a blocking wait of the calling thread and record its scheduling latency.
+    *
+    * @param ready ticks at which the thread could run again, 0 when unknown (no latency is recorded).
+    * Times before the start of the wait are moved to it, an item already queued gives no latency.
+    */
+    void endWait(Timestamp::Ticks ready);
+
+    /** Sleep the calling thread and record the delay between the end of the sleep and its wake-up.
+    *
+    * @param duration duration of the sleep.
+    */
+    void sleepFor(Kernel::Clock::duration_u32 duration);
+
+    // Number of watched threads.
+    size_t getThreadCount();
+
+    /** Run time and latency of a watched thread, the current run of a thread is included.
+    *
+    * @param index thread index, lower than getThreadCount().
+    */
+    ThreadUsage getThreadUsage(size_t index);
+
+    CpuUsage getCpuUsage();
+
+    // Clear run times and latencies, threads stay watched.
+    void reset();
+}
@@ -0,0 +1,128 @@
+/* High resolution timestamps
+ * Monotonic time source used to timestamp logs and measure the duration of short events.
+ *
+ * Author: Nicolas THIERRY
+ */
+#include "timestamp.hpp"
+#include "mbed.h"
+
+#include <chrono>
+
+// DWT is only available from Cortex-M3 and is not part of the host build.
+#if defined(__MBED__) && TIMESTAMP_SOURCE == TIMESTAMP_SOURCE_CYCLES && defined(DWT) && defined(__CORTEX_M) && (__CORTEX_M >= 3)
+#define TIMESTAMP_USE_DWT 1
+#else
+#define TIMESTAMP_USE_DWT 0
+#endif
+
+namespace {
+    uint64_t ticks_per_second = 1000000;
+
+#if TIMESTAMP_USE_DWT
+    // Counter values at the last resync, used to extend the 32 bits cycle counter to 64 bits. Written under critical section,
+    // read without lock: the sequence is odd during an update and changes with it, readers retry if it changed.
+    volatile uint32_t sync_sequence = 0;
+    volatile uint64_t sync_cycles = 0;
+    volatile uint32_t sync_raw = 0;
+    uint64_t sync_us = 0;
+
+    uint64_t microsecondsNow() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(HighResClock::now().time_since_epoch()).count();
+    }
+
+    // Move the extension base to the current counter value. Wraps missed since the last resync are counted with the microseconds clock.
+    Timestamp::Ticks resync() {
+        core_util_critical_section_enter();
+        uint32_t raw = DWT->CYCCNT;
+        uint64_t us = microsecondsNow();
+        uint64_t elapsed = (uint32_t)(raw - sync_raw);
+        uint64_t expected = (us - sync_us) * ticks_per_second / 1000000;
+        if (expected > elapsed)
+            elapsed += ((expected - elapsed + (1ULL << 31)) >> 32) << 32;
+        sync_sequence = sync_sequence + 1;
+        sync_cycles = sync_cycles + elapsed;
+        sync_raw = raw;
+        sync_us = us;
+        sync_sequence = sync_sequence + 1;
+        Timestamp::Ticks ticks = sync_cycles;
+        core_util_critical_section_exit();
+        return ticks;
+    }
+#endif
+}
+
+void Timestamp::init() {
+#if TIMESTAMP_SOURCE == TIMESTAMP_SOURCE_KERNEL
+    ticks_per_second = 1000;
+#elif TIMESTAMP_USE_DWT
+    // Enable trace unit then start the cycle counter.
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    // Nominal frequency until measured, the core clock may differ from SystemCoreClock.
+    ticks_per_second = SystemCoreClock;
+    Timestamp::calibrate(TIMESTAMP_CALIBRATION_WINDOW_US);
+
+    core_util_critical_section_enter();
+    sync_sequence = sync_sequence + 1;
+    sync_cycles = 0;
+    sync_raw = DWT->CYCCNT;
+    sync_us = microsecondsNow();
+    sync_sequence = sync_sequence + 1;
+    core_util_critical_section_exit();
+#elif !defined(__MBED__) && TIMESTAMP_SOURCE == TIMESTAMP_SOURCE_CYCLES
+    ticks_per_second = 1000000000;
+#else
+    ticks_per_second = 1000000;
+#endif
+}
+
+Timestamp::Ticks Timestamp::now() {
+#if TIMESTAMP_SOURCE == TIMESTAMP_SOURCE_KERNEL
+    return Kernel::Clock::now().time_since_epoch().count();
+#elif TIMESTAMP_USE_DWT
+    // Only the cycle counter is read: the difference with the last resync is exact across one wrap. Resync once it gets
+    // past TIMESTAMP_DWT_RESYNC_CYCLES, so that the base is always less than a wrap behind.
+    uint32_t sequence = sync_sequence;
+    if ((sequence & 1) == 0) {
+        uint64_t base = sync_cycles;
+        uint32_t base_raw = sync_raw;
+        uint32_t elapsed = DWT->CYCCNT - base_raw;
+        if (sequence == sync_sequence && elapsed < TIMESTAMP_DWT_RESYNC_CYCLES) return base + elapsed;
+    }
+    return resync();
+#elif defined(__MBED__)
+    return std::chrono::duration_cast<std::chrono::microseconds>(HighResClock::now().time_since_epoch()).count();
+#elif TIMESTAMP_SOURCE == TIMESTAMP_SOURCE_CYCLES
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint64_t Timestamp::ticksPerSecond() {
+    return ticks_per_second;
+}
+
+void Timestamp::calibrate(uint32_t window_us) {
+#if TIMESTAMP_USE_DWT
+    uint64_t start_us = microsecondsNow();
+    uint32_t start_raw = DWT->CYCCNT;
+    while (microsecondsNow() - start_us < window_us) {}
+    uint64_t elapsed_us = microsecondsNow() - start_us;
+    uint32_t elapsed_cycles = DWT->CYCCNT - start_raw;
+    if (elapsed_us > 0)
+        ticks_per_second = (uint64_t)elapsed_cycles * 1000000 / elapsed_us;
+#else
+    (void)window_us;
+#endif
+}
+
+uint64_t Timestamp::toNanoseconds(Ticks ticks) {
+    // Split to avoid overflowing 64 bits with large durations.
+    return (ticks / ticks_per_second) * 1000000000ULL + (ticks % ticks_per_second) * 1000000000ULL / ticks_per_second;
+}
+
+uint64_t Timestamp::toMicroseconds(Ticks ticks) {
+    return (ticks / ticks_per_second) * 1000000ULL + (ticks % ticks_per_second) * 1000000ULL / ticks_per_second;
+}
\ No newline at end of file
@@ -0,0 +1,63 @@
+/* High resolution timestamps
+ * Monotonic time source used to timestamp logs and measure the duration of short events.
+ * The source is selected at compile time with "timestamp-source" in mbed_app.json.
+ *
+ * Author: Nicolas THIERRY
+ */
+#pragma once
+
+#include <stdint.h>
+
+// Kernel clock, 1 millisecond resolution.
+#define TIMESTAMP_SOURCE_KERNEL 0
+// HighResClock (us ticker) on target, steady_clock on host. 1 microsecond resolution.
+#define TIMESTAMP_SOURCE_MICROSECONDS 1
+// DWT cycle counter on Cortex-M3 and above, steady_clock nanoseconds on host. Falls back to microseconds if the core has no DWT.
+#define TIMESTAMP_SOURCE_CYCLES 2
+
+#ifdef MBED_CONF_APP_TIMESTAMP_SOURCE
+#define TIMESTAMP_SOURCE MBED_CONF_APP_TIMESTAMP_SOURCE
+#else
+#define TIMESTAMP_SOURCE TIMESTAMP_SOURCE_MICROSECONDS
+#endif
+
+// Cycles after which the cycle counter extension is resynchronized with the microseconds clock, a quarter of its wrap period.
+// Timestamps must be read at least once per wrap period (about 40 s at 100 MHz) to count every wrap, the log flush thread does.
+#define TIMESTAMP_DWT_RESYNC_CYCLES (1UL << 30)
+
+// Duration of the calibration of the cycle counter done by init, in microseconds.
+#define TIMESTAMP_CALIBRATION_WINDOW_US 10000
+
+namespace Timestamp {
+    // Ticks of the selected source. Only differences between two ticks values are meaningful.
+    typedef uint64_t Ticks;
+
+    // Start the time source and calibrate the cycle counter, blocking for TIMESTAMP_CALIBRATION_WINDOW_US. Must be called once before any other function.
+    void init();
+
+    // Current time in ticks, monotonic and thread safe.
+    Ticks now();
+
+    // Number of ticks per second of the current source.
+    uint64_t ticksPerSecond();
+
+    /** Measure the frequency of the cycle counter against the microseconds clock, called by init. Does nothing for other sources.
+    *
+    * @param window_us duration of the measure in microseconds, longer is more precise but must stay below the counter wrap period (about 40 s at 100 MHz). The calling thread is blocked meanwhile.
+    */
+    void calibrate(uint32_t window_us);
+
+    /** Convert ticks to nanoseconds.
+    *
+    * @param ticks duration in ticks.
+    * @return duration in nanoseconds.
+    */
+    uint64_t toNanoseconds(Ticks ticks);
+
+    /** Convert ticks to microseconds.
+    *
+    * @param ticks duration in ticks.
+    * @return duration in microseconds.
+    */
+    uint64_t toMicroseconds(Ticks ticks);
+}
\ No newline at end of file